@@ -0,0 +1,432 @@
+#include "dirscan.h"
+#include "fat.h"
+#include "fat12codec.h"
+#include "fatcodec.h"
+#include "fattable.h"
+#include "filetools.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_NANOSECONDS 200000000ULL
+
+static uint64_t nanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// runs the kernel until BENCH_MIN_NANOSECONDS passed, returns nanoseconds per entry
+static double timeKernel(fat12_kernel kernel, bool unpack, uint8_t *packed, uint16_t *entries, uint32_t count)
+{
+    uint64_t iterations = 0;
+    uint64_t start = nanoseconds();
+    uint64_t elapsed = 0;
+
+    do
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            if (unpack)
+            {
+                fat12_unpack_with(kernel, packed, entries, count);
+            }
+            else
+            {
+                fat12_pack_with(kernel, entries, packed, count);
+            }
+        }
+        iterations += 64;
+        elapsed = nanoseconds() - start;
+    } while (elapsed < BENCH_MIN_NANOSECONDS);
+
+    return (double)elapsed / iterations / count;
+}
+
+// decodes the FAT of the image with every kernel, compares the results and measures the throughput
+static int benchImage(const char *filename)
+{
+    char *buffer = NULL;
+    int size = load_file_to_memory(filename, &buffer);
+    if (size < (int)sizeof(bios_parameter_block))
+    {
+        printf("%s: cannot be read\n", filename);
+        free(buffer);
+        return -1;
+    }
+
+    bios_parameter_block *bpb = (bios_parameter_block *)buffer;
+    uint32_t fatOffset = (uint32_t)bpb->rsvdSecCnt * bpb->bytesPerSec;
+    uint32_t fatSize = (uint32_t)bpb->secPerFat * bpb->bytesPerSec;
+    if (bpb->bytesPerSec == 0 || bpb->secPerFat <= 0 || fatOffset + fatSize > (uint32_t)size)
+    {
+        printf("%s: not a FAT12 image, skipped\n", filename);
+        free(buffer);
+        return 0;
+    }
+
+    // every three bytes in the fat contain two entries
+    uint32_t count = fatSize / 3 * 2;
+    const uint8_t *fat = (const uint8_t *)buffer + fatOffset;
+
+    uint16_t *reference = (uint16_t *)malloc(count * sizeof(uint16_t));
+    uint16_t *entries = (uint16_t *)malloc(count * sizeof(uint16_t));
+    uint8_t *packed = (uint8_t *)malloc(count / 2 * 3);
+    uint32_t *wideReference = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t *wide = (uint32_t *)malloc(count * sizeof(uint32_t));
+    if (reference == NULL || entries == NULL || packed == NULL || wideReference == NULL || wide == NULL)
+    {
+        free(reference);
+        free(entries);
+        free(packed);
+        free(wideReference);
+        free(wide);
+        free(buffer);
+        return -1;
+    }
+
+    fat12_unpack_with(FAT12_KERNEL_SCALAR, fat, reference, count);
+    fat12_decode_with(FAT12_KERNEL_SCALAR, fat, wideReference, count);
+
+    printf("%s: %u entries\n", filename, count);
+
+    int result = 0;
+    double scalarUnpack = 0;
+    double scalarPack = 0;
+    for (int k = 0; k < FAT12_KERNEL_COUNT; k++)
+    {
+        fat12_kernel kernel = (fat12_kernel)k;
+        if (!fat12_kernel_supported(kernel))
+        {
+            continue;
+        }
+
+        // the kernels have to agree with the scalar loop and must restore the original bytes
+        memset(entries, 0xFF, count * sizeof(uint16_t));
+        fat12_unpack_with(kernel, fat, entries, count);
+        memset(packed, 0xFF, count / 2 * 3);
+        fat12_pack_with(kernel, entries, packed, count);
+        memset(wide, 0xFF, count * sizeof(uint32_t));
+        fat12_decode_with(kernel, fat, wide, count);
+        bool correct = memcmp(entries, reference, count * sizeof(uint16_t)) == 0 && memcmp(packed, fat, count / 2 * 3) == 0 &&
+                       memcmp(wide, wideReference, count * sizeof(uint32_t)) == 0;
+        if (!correct)
+        {
+            result = -1;
+        }
+
+        double unpackTime = timeKernel(kernel, true, packed, entries, count);
+        double packTime = timeKernel(kernel, false, packed, entries, count);
+        if (kernel == FAT12_KERNEL_SCALAR)
+        {
+            scalarUnpack = unpackTime;
+            scalarPack = packTime;
+        }
+
+        printf("  %-6s unpack %6.3f ns/entry (%5.2fx)  pack %6.3f ns/entry (%5.2fx)  %s\n",
+               fat12_kernel_name(kernel), unpackTime, scalarUnpack / unpackTime, packTime, scalarPack / packTime,
+               correct ? "ok" : "MISMATCH");
+    }
+
+    free(reference);
+    free(entries);
+    free(packed);
+    free(wideReference);
+    free(wide);
+    free(buffer);
+
+    return result;
+}
+
+// follows a chain on the encoding of the volume, the way a walk without a decoded table would
+static uint32_t walkPacked(const fat_entry_codec *codec, const uint8_t *packed, uint32_t cluster)
+{
+    uint32_t hops = 0;
+    if (codec->entryBits == 12)
+    {
+        while (cluster >= 2 && cluster < FAT12_RESERVED_CLUSTER)
+        {
+            const uint8_t *entry = packed + cluster * 3 / 2;
+            uint32_t pair = entry[0] | (entry[1] << 8);
+            cluster = cluster & 1 ? pair >> 4 : pair & 0xFFF;
+            hops++;
+        }
+    }
+    else
+    {
+        while (cluster >= 2 && cluster < FAT16_RESERVED_CLUSTER)
+        {
+            cluster = packed[cluster * 2] | (packed[cluster * 2 + 1] << 8);
+            hops++;
+        }
+    }
+
+    return hops;
+}
+
+// follows a chain on the decoded entries of fat_table, the same loop for every width
+static uint32_t walkDecoded(const uint32_t *entries, uint32_t cluster)
+{
+    uint32_t hops = 0;
+    while (fat_is_data_cluster(cluster))
+    {
+        cluster = entries[cluster];
+        hops++;
+    }
+
+    return hops;
+}
+
+// runs walks of the chain starting at cluster 2 until BENCH_MIN_NANOSECONDS passed, returns nanoseconds per hop
+static double timeWalk(const fat_entry_codec *codec, const uint8_t *packed, const uint32_t *entries)
+{
+    uint64_t hops = 0;
+    uint64_t start = nanoseconds();
+    uint64_t elapsed = 0;
+
+    do
+    {
+        hops += packed != NULL ? walkPacked(codec, packed, 2) : walkDecoded(entries, 2);
+        elapsed = nanoseconds() - start;
+    } while (elapsed < BENCH_MIN_NANOSECONDS);
+
+    return (double)elapsed / hops;
+}
+
+// builds a chain through all clusters the codec can address (below the reserved values) in a random order, so that
+// every hop misses the previous entry, and measures the cost of a hop and of decoding the FAT
+static int benchChain(const fat_entry_codec *codec, uint32_t clusters)
+{
+    uint32_t count = (clusters + 2 + codec->unitEntries - 1) / codec->unitEntries * codec->unitEntries;
+    uint32_t *entries = (uint32_t *)calloc(count, sizeof(uint32_t));
+    uint32_t *decoded = (uint32_t *)calloc(count, sizeof(uint32_t));
+    uint32_t *order = (uint32_t *)malloc(clusters * sizeof(uint32_t));
+    uint8_t *packed = (uint8_t *)calloc(count / codec->unitEntries * codec->unitBytes + 1, 1);
+    if (entries == NULL || decoded == NULL || order == NULL || packed == NULL)
+    {
+        free(entries);
+        free(decoded);
+        free(order);
+        free(packed);
+        return -1;
+    }
+
+    // Fisher-Yates shuffle of the clusters behind cluster 2, driven by xorshift
+    uint32_t random = 2463534242u;
+    for (uint32_t i = 0; i < clusters; i++)
+    {
+        order[i] = i + 2;
+    }
+    for (uint32_t i = clusters - 1; i > 1; i--)
+    {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        uint32_t j = 1 + random % i;
+        uint32_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for (uint32_t i = 0; i + 1 < clusters; i++)
+    {
+        entries[order[i]] = order[i + 1];
+    }
+    entries[order[clusters - 1]] = FAT_END_OF_CHAIN;
+
+    codec->encode(entries, packed, count);
+
+    uint64_t iterations = 0;
+    uint64_t start = nanoseconds();
+    uint64_t elapsed = 0;
+    do
+    {
+        codec->decode(packed, decoded, count);
+        iterations++;
+        elapsed = nanoseconds() - start;
+    } while (elapsed < BENCH_MIN_NANOSECONDS);
+    double decodeTime = (double)elapsed / iterations / count;
+
+    bool correct = memcmp(entries, decoded, count * sizeof(uint32_t)) == 0 && walkPacked(codec, packed, 2) == clusters &&
+                   walkDecoded(decoded, 2) == clusters;
+
+    double packedHop = timeWalk(codec, packed, NULL);
+    double decodedHop = timeWalk(codec, NULL, decoded);
+
+    printf("%s chain of %u clusters: decode %6.3f ns/entry  hop packed %6.3f ns  hop decoded %6.3f ns  %s\n",
+           codec->name, clusters, decodeTime, packedHop, decodedHop, correct ? "ok" : "MISMATCH");
+
+    free(entries);
+    free(decoded);
+    free(order);
+    free(packed);
+
+    return correct ? 0 : -1;
+}
+
+// entries of the directory benchDirScan() searches, 128 sectors of 512 bytes
+#define BENCH_DIRECTORY_ENTRIES 2048
+#define BENCH_SECTOR_ENTRIES 16
+
+// scans the directory entry by entry the way the lookup did before the kernels, returns the index of the name or -1
+static int32_t findOneByOne(const directory_entry *entries, uint32_t count, const char *name)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (entries[i].filename[0] == DIRECTORY_ENTRY_FREE)
+        {
+            continue;
+        }
+        if (entries[i].filename[0] == DIRECTORY_ENTRY_LAST)
+        {
+            break;
+        }
+        if (strncmp((const char *)entries[i].filename, name, FILENAME_LENGTH) == 0)
+        {
+            return (int32_t)i;
+        }
+    }
+
+    return -1;
+}
+
+// scans the directory a sector at a time with the kernel like findDirectoryEntry(), returns the index of the name or -1
+static int32_t findWithKernel(dir_scan_kernel kernel, const directory_entry *entries, uint32_t count, const char *name)
+{
+    for (uint32_t first = 0; first < count; first += BENCH_SECTOR_ENTRIES)
+    {
+        uint32_t group = count - first < BENCH_SECTOR_ENTRIES ? count - first : BENCH_SECTOR_ENTRIES;
+        dir_slot_masks masks;
+        dir_scan_slots_with(kernel, entries + first, group, &masks);
+        uint64_t matches = dir_scan_match_with(kernel, entries + first, group, name) & dir_scan_live(&masks);
+        if (matches != 0)
+        {
+            return (int32_t)(first + __builtin_ctzll(matches));
+        }
+        if (masks.end != 0)
+        {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+// runs lookups of the last name of the directory until BENCH_MIN_NANOSECONDS passed, returns nanoseconds per entry
+static double timeDirScan(int kernel, const directory_entry *entries, uint32_t count, const char *name)
+{
+    uint64_t iterations = 0;
+    uint64_t start = nanoseconds();
+    uint64_t elapsed = 0;
+    volatile int32_t found = 0;
+
+    do
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            found = kernel < 0 ? findOneByOne(entries, count, name) : findWithKernel((dir_scan_kernel)kernel, entries, count, name);
+        }
+        iterations += 64;
+        elapsed = nanoseconds() - start;
+    } while (elapsed < BENCH_MIN_NANOSECONDS);
+    (void)found;
+
+    return (double)elapsed / iterations / count;
+}
+
+// fills a directory with names, links and free entries, checks every kernel against the entry by entry scan
+// and measures a lookup that has to look at the whole directory
+static int benchDirScan(void)
+{
+    directory_entry *entries = (directory_entry *)calloc(BENCH_DIRECTORY_ENTRIES, sizeof(directory_entry));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t random = 2463534242u;
+    for (uint32_t i = 0; i < BENCH_DIRECTORY_ENTRIES; i++)
+    {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+
+        char name[13];
+        sprintf(name, "F%06u.TXT", i);
+        filenameToFatElevenThree(name, (char *)entries[i].filename, FILENAME_LENGTH);
+        // every eighth entry was deleted, names differ in their last characters only
+        if (random % 8 == 0)
+        {
+            entries[i].filename[0] = DIRECTORY_ENTRY_FREE;
+        }
+    }
+    filenameToFatElevenThree(".", (char *)entries[0].filename, FILENAME_LENGTH);
+    filenameToFatElevenThree("..", (char *)entries[1].filename, FILENAME_LENGTH);
+    memset(&entries[BENCH_DIRECTORY_ENTRIES - 1], 0, sizeof(directory_entry));
+
+    // the names to check, the last one is not in the directory
+    char names[5][FILENAME_LENGTH];
+    filenameToFatElevenThree(".", names[0], FILENAME_LENGTH);
+    filenameToFatElevenThree("..", names[1], FILENAME_LENGTH);
+    memcpy(names[2], entries[BENCH_DIRECTORY_ENTRIES / 2].filename, FILENAME_LENGTH);
+    memcpy(names[3], entries[BENCH_DIRECTORY_ENTRIES - 2].filename, FILENAME_LENGTH);
+    filenameToFatElevenThree("MISSING.TXT", names[4], FILENAME_LENGTH);
+
+    int result = 0;
+    double oneByOne = timeDirScan(-1, entries, BENCH_DIRECTORY_ENTRIES, names[4]);
+    printf("directory of %u entries: one by one %6.3f ns/entry\n", BENCH_DIRECTORY_ENTRIES, oneByOne);
+    for (int k = 0; k < DIR_SCAN_KERNEL_COUNT; k++)
+    {
+        dir_scan_kernel kernel = (dir_scan_kernel)k;
+        if (!dir_scan_kernel_supported(kernel))
+        {
+            continue;
+        }
+
+        bool correct = true;
+        for (int n = 0; n < 5; n++)
+        {
+            correct = correct && findWithKernel(kernel, entries, BENCH_DIRECTORY_ENTRIES, names[n]) ==
+                                     findOneByOne(entries, BENCH_DIRECTORY_ENTRIES, names[n]);
+        }
+        if (!correct)
+        {
+            result = -1;
+        }
+
+        double scanTime = timeDirScan(kernel, entries, BENCH_DIRECTORY_ENTRIES, names[4]);
+        printf("  %-6s %6.3f ns/entry (%5.2fx)  %s\n", dir_scan_kernel_name(kernel), scanTime, oneByOne / scanTime,
+               correct ? "ok" : "MISMATCH");
+    }
+
+    free(entries);
+
+    return result;
+}
+
+/**
+ * usage: bench [image...]
+ *
+ * Microbenchmark of the per hop cost of a chain walk for every FAT entry width, of the directory scan
+ * kernels and of the FAT12 unpack/pack kernels on the FAT of every image.
+ */
+int main(int argc, char **argv)
+{
+    int result = 0;
+    if (benchChain(&fat12_entry_codec, FAT12_RESERVED_CLUSTER - 2) != 0 || benchChain(&fat16_entry_codec, FAT16_RESERVED_CLUSTER - 2) != 0 || benchDirScan() != 0)
+    {
+        result = -1;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (benchImage(argv[i]) != 0)
+        {
+            result = -1;
+        }
+    }
+
+    return result;
+}
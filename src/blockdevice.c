@@ -0,0 +1,1506 @@
+#define _GNU_SOURCE
+#include "blockdevice.h"
+#include "filetools.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static bool isCached(const block_device *device)
+{
+    return (device->mode & BLOCK_DEVICE_CACHED) != 0;
+}
+
+static bool isWritable(const block_device *device)
+{
+    return (device->mode & BLOCK_DEVICE_WRITABLE) != 0;
+}
+
+static bool isWriteBack(const block_device *device)
+{
+    return (device->mode & BLOCK_DEVICE_WRITE_BACK) != 0;
+}
+
+static bool testBit(const uint64_t *map, uint64_t index)
+{
+    return (map[index / 64] & (1ULL << (index % 64))) != 0;
+}
+
+static uint32_t bucketOf(const block_device *device, uint64_t sector)
+{
+    return (uint32_t)(sector % device->bucketCount);
+}
+
+static char *slotPointer(const block_device *device, uint32_t slot)
+{
+    return device->slotData + (size_t)slot * device->sectorSize;
+}
+
+// returns the slot that contains ptr or BLOCK_DEVICE_NO_SLOT if ptr does not point into the cache
+static uint32_t slotOf(const block_device *device, const char *ptr)
+{
+    if (device->slotData == NULL || ptr < device->slotData)
+    {
+        return BLOCK_DEVICE_NO_SLOT;
+    }
+
+    size_t slot = (size_t)(ptr - device->slotData) / device->sectorSize;
+    if (slot >= device->slotCount)
+    {
+        return BLOCK_DEVICE_NO_SLOT;
+    }
+
+    return (uint32_t)slot;
+}
+
+static void lruUnlink(block_device *device, uint32_t slot)
+{
+    sector_cache_slot *s = &device->slots[slot];
+
+    if (s->prev != BLOCK_DEVICE_NO_SLOT)
+    {
+        device->slots[s->prev].next = s->next;
+    }
+    else
+    {
+        device->lruHead = s->next;
+    }
+
+    if (s->next != BLOCK_DEVICE_NO_SLOT)
+    {
+        device->slots[s->next].prev = s->prev;
+    }
+    else
+    {
+        device->lruTail = s->prev;
+    }
+
+    s->prev = s->next = BLOCK_DEVICE_NO_SLOT;
+}
+
+static void lruPushFront(block_device *device, uint32_t slot)
+{
+    sector_cache_slot *s = &device->slots[slot];
+
+    s->prev = BLOCK_DEVICE_NO_SLOT;
+    s->next = device->lruHead;
+    if (device->lruHead != BLOCK_DEVICE_NO_SLOT)
+    {
+        device->slots[device->lruHead].prev = slot;
+    }
+    device->lruHead = slot;
+
+    if (device->lruTail == BLOCK_DEVICE_NO_SLOT)
+    {
+        device->lruTail = slot;
+    }
+}
+
+static uint32_t hashLookup(const block_device *device, uint64_t sector)
+{
+    uint32_t slot = device->buckets[bucketOf(device, sector)];
+    while (slot != BLOCK_DEVICE_NO_SLOT)
+    {
+        if (device->slots[slot].sector == sector)
+        {
+            return slot;
+        }
+        slot = device->slots[slot].hashNext;
+    }
+
+    return BLOCK_DEVICE_NO_SLOT;
+}
+
+static void hashRemove(block_device *device, uint32_t slot)
+{
+    uint32_t *link = &device->buckets[bucketOf(device, device->slots[slot].sector)];
+    while (*link != BLOCK_DEVICE_NO_SLOT)
+    {
+        if (*link == slot)
+        {
+            *link = device->slots[slot].hashNext;
+            break;
+        }
+        link = &device->slots[*link].hashNext;
+    }
+
+    device->slots[slot].hashNext = BLOCK_DEVICE_NO_SLOT;
+}
+
+static void hashInsert(block_device *device, uint32_t slot)
+{
+    uint32_t bucket = bucketOf(device, device->slots[slot].sector);
+    device->slots[slot].hashNext = device->buckets[bucket];
+    device->buckets[bucket] = slot;
+}
+
+// reads count bytes at offset, the part of the range that lies behind the end of the file reads as zero
+static int preadFully(int fd, char *out, size_t count, off_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t result = pread(fd, out + done, count - done, offset + done);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (result == 0)
+        {
+            memset(out + done, 0, count - done);
+            break;
+        }
+        done += result;
+    }
+
+    return 0;
+}
+
+// writes all iovecs, retries after short writes
+static int pwritevFully(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t result = pwritev(fd, iov, iovcnt, offset);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        offset += result;
+
+        // skip the iovecs that were written completely
+        while (iovcnt > 0 && (size_t)result >= iov->iov_len)
+        {
+            result -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + result;
+            iov->iov_len -= result;
+        }
+    }
+
+    return 0;
+}
+
+static void markDirty(block_device *device, const char *ptr, bool metadata);
+
+// returns the memory that holds the sector, NULL if the sector is not cached
+static char *sectorPointer(block_device *device, uint64_t sector)
+{
+    if (!isCached(device))
+    {
+        return device->buffer + sector * device->sectorSize;
+    }
+
+    uint32_t slot = hashLookup(device, sector);
+
+    return slot == BLOCK_DEVICE_NO_SLOT ? NULL : slotPointer(device, slot);
+}
+
+// drops the sectors [first, first + count) from the cache, e.g. after a failed read
+static void invalidateSectors(block_device *device, uint64_t first, uint32_t count)
+{
+    for (uint64_t sector = first; sector < first + count; sector++)
+    {
+        uint32_t slot = hashLookup(device, sector);
+        if (slot != BLOCK_DEVICE_NO_SLOT)
+        {
+            hashRemove(device, slot);
+            device->slots[slot].valid = false;
+        }
+    }
+}
+
+// collects one completion of the ring, wait blocks until a request completes
+static bool completeRequest(block_device *device, bool wait)
+{
+    uint64_t userData;
+    int32_t result;
+    if (!uring_complete(device->ring, wait, &userData, &result))
+    {
+        return false;
+    }
+
+    block_io_request *request = &device->requests[userData];
+    if (result != (int64_t)request->count * device->sectorSize)
+    {
+        device->ioErrors++;
+        printf("%s sectors %" PRIu64 " to %" PRIu64 " failed!\n", request->write ? "Writing" : "Reading",
+               request->firstSector, request->firstSector + request->count - 1);
+
+        if (request->write)
+        {
+            // written again by the next flush, it is not known whether the sectors were metadata,
+            // so they are treated as such and are not evicted before the next commit
+            for (uint64_t sector = request->firstSector; sector < request->firstSector + request->count; sector++)
+            {
+                char *ptr = sectorPointer(device, sector);
+                if (ptr != NULL)
+                {
+                    markDirty(device, ptr, true);
+                }
+            }
+        }
+        else
+        {
+            invalidateSectors(device, request->firstSector, request->count);
+        }
+    }
+
+    if (request->slot != BLOCK_DEVICE_NO_SLOT)
+    {
+        device->slots[request->slot].inflight--;
+    }
+    free(request->iov);
+    request->iov = NULL;
+    request->busy = false;
+
+    return true;
+}
+
+// queues a read or write of a run of count sectors, takes ownership of iov
+static int startRequest(block_device *device, bool write, uint64_t firstSector, struct iovec *iov, int iovcnt, uint32_t count, uint32_t slot)
+{
+    // find an idle request, wait for one if all of them are in flight
+    uint32_t index;
+    for (;;)
+    {
+        for (index = 0; index < device->queueDepth && device->requests[index].busy; index++)
+        {
+        }
+        if (index < device->queueDepth)
+        {
+            break;
+        }
+
+        uring_submit(device->ring);
+        if (!completeRequest(device, true))
+        {
+            free(iov);
+            return -1;
+        }
+    }
+
+    block_io_request *request = &device->requests[index];
+    int result = write ? uring_prepare_writev(device->ring, device->fd, iov, iovcnt, (off_t)firstSector * device->sectorSize, index)
+                       : uring_prepare_readv(device->ring, device->fd, iov, iovcnt, (off_t)firstSector * device->sectorSize, index);
+    if (result != 0)
+    {
+        free(iov);
+        return -1;
+    }
+
+    request->busy = true;
+    request->write = write;
+    request->firstSector = firstSector;
+    request->count = count;
+    request->slot = slot;
+    request->iov = iov;
+    device->asyncRequests++;
+
+    return 0;
+}
+
+// waits until all asynchronous requests completed
+// return - 0 on success, -1 if one of the requests failed
+static int drainRequests(block_device *device)
+{
+    if (device->ring == NULL)
+    {
+        return 0;
+    }
+
+    uint64_t errors = device->ioErrors;
+    if (uring_submit(device->ring) != 0)
+    {
+        return -1;
+    }
+    while (device->ring->inflight > 0 && completeRequest(device, true))
+    {
+    }
+
+    return device->ioErrors == errors ? 0 : -1;
+}
+
+// returns a copy of iov that lives until the request completes
+static struct iovec *copyIovec(const struct iovec *iov, int iovcnt)
+{
+    struct iovec *copy = (struct iovec *)malloc(iovcnt * sizeof(struct iovec));
+    if (copy != NULL)
+    {
+        memcpy(copy, iov, iovcnt * sizeof(struct iovec));
+    }
+
+    return copy;
+}
+
+// returns the amount of sectors the buffers cover, a buffer of a mapping can span several sectors
+static uint32_t iovecSectors(const block_device *device, const struct iovec *iov, int iovcnt)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        bytes += iov[i].iov_len;
+    }
+
+    return bytes / device->sectorSize;
+}
+
+// writes a run of adjacent sectors, asynchronously if the device has a ring
+static int writeRun(block_device *device, uint64_t firstSector, struct iovec *iov, int iovcnt, uint32_t slot)
+{
+    uint32_t count = iovecSectors(device, iov, iovcnt);
+    device->writeCalls++;
+    device->sectorsWritten += count;
+
+    if (device->ring != NULL)
+    {
+        struct iovec *copy = copyIovec(iov, iovcnt);
+        if (copy != NULL && startRequest(device, true, firstSector, copy, iovcnt, count, slot) == 0)
+        {
+            return 0;
+        }
+    }
+
+    if (pwritevFully(device->fd, iov, iovcnt, (off_t)firstSector * device->sectorSize) != 0)
+    {
+        printf("Writing sectors %" PRIu64 " to %" PRIu64 " failed!\n", firstSector, firstSector + count - 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+// reads a run of adjacent sectors, asynchronously if the device has a ring
+static int readRun(block_device *device, uint64_t firstSector, struct iovec *iov, int iovcnt)
+{
+    uint32_t count = iovecSectors(device, iov, iovcnt);
+    device->readCalls++;
+    device->sectorsRead += count;
+
+    if (device->ring != NULL)
+    {
+        struct iovec *copy = copyIovec(iov, iovcnt);
+        if (copy != NULL && startRequest(device, false, firstSector, copy, iovcnt, count, BLOCK_DEVICE_NO_SLOT) == 0)
+        {
+            return 0;
+        }
+    }
+
+    ssize_t result = preadv(device->fd, iov, iovcnt, (off_t)firstSector * device->sectorSize);
+    if (result != (ssize_t)count * device->sectorSize)
+    {
+        invalidateSectors(device, firstSector, count);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void freeDirtyMap(block_device *device)
+{
+    free(device->dirtyMap);
+    free(device->metadataMap);
+    device->dirtyMap = NULL;
+    device->metadataMap = NULL;
+}
+
+static int allocateDirtyMap(block_device *device)
+{
+    // scratch mappings are never written back, there is nothing to track
+    if (!isWritable(device))
+    {
+        return 0;
+    }
+
+    size_t words = (device->sectorCount + 63) / 64;
+    device->dirtyMap = (uint64_t *)calloc(words > 0 ? words : 1, sizeof(uint64_t));
+    device->metadataMap = (uint64_t *)calloc(words > 0 ? words : 1, sizeof(uint64_t));
+    if (device->dirtyMap == NULL || device->metadataMap == NULL)
+    {
+        freeDirtyMap(device);
+        return -4;
+    }
+
+    return 0;
+}
+
+static void freeCache(block_device *device)
+{
+    free(device->slotData);
+    free(device->slots);
+    free(device->buckets);
+    device->slotData = NULL;
+    device->slots = NULL;
+    device->buckets = NULL;
+}
+
+static int allocateCache(block_device *device)
+{
+    device->slotData = (char *)malloc((size_t)device->slotCount * device->sectorSize);
+    device->slots = (sector_cache_slot *)malloc(device->slotCount * sizeof(sector_cache_slot));
+
+    // roughly two buckets per slot keeps the hash chains short
+    device->bucketCount = device->slotCount * 2 + 1;
+    device->buckets = (uint32_t *)malloc(device->bucketCount * sizeof(uint32_t));
+
+    if (device->slotData == NULL || device->slots == NULL || device->buckets == NULL)
+    {
+        freeCache(device);
+        return -4;
+    }
+
+    for (uint32_t i = 0; i < device->bucketCount; i++)
+    {
+        device->buckets[i] = BLOCK_DEVICE_NO_SLOT;
+    }
+
+    // all slots are empty and queued for reuse
+    device->lruHead = device->lruTail = BLOCK_DEVICE_NO_SLOT;
+    for (uint32_t i = 0; i < device->slotCount; i++)
+    {
+        sector_cache_slot *s = &device->slots[i];
+        s->sector = 0;
+        s->hashNext = BLOCK_DEVICE_NO_SLOT;
+        s->pinCount = 0;
+        s->valid = false;
+        s->dirty = false;
+        s->metadata = false;
+        s->inflight = 0;
+        s->prev = s->next = BLOCK_DEVICE_NO_SLOT;
+        lruPushFront(device, i);
+    }
+
+    return 0;
+}
+
+int open_block_device(block_device *device, const char *filename, int mode, uint32_t cacheSectors)
+{
+    memset(device, 0, sizeof(block_device));
+    device->fd = -1;
+    device->mode = mode;
+    device->sectorSize = BLOCK_DEVICE_DEFAULT_SECTOR_SIZE;
+    device->groupCommit = 1;
+
+    if (isCached(device))
+    {
+        // evicted sectors cannot be kept anywhere, so the cached backend has to write back
+        if (!isWritable(device))
+        {
+            return -5;
+        }
+
+        device->fd = open(filename, O_RDWR);
+        if (device->fd < 0)
+        {
+            return -1;
+        }
+
+        struct stat fileStat;
+        if (fstat(device->fd, &fileStat) != 0 || fileStat.st_size <= 0)
+        {
+            close(device->fd);
+            device->fd = -1;
+            return -2;
+        }
+        device->size = fileStat.st_size;
+
+        device->slotCount = cacheSectors > 0 ? cacheSectors : BLOCK_DEVICE_DEFAULT_CACHE_SECTORS;
+        int result = allocateCache(device);
+        if (result < 0)
+        {
+            close(device->fd);
+            device->fd = -1;
+            return result;
+        }
+    }
+    else
+    {
+        // write-back mappings are private, so that the kernel never writes modified pages on its own
+        bool shared = isWritable(device) && !isWriteBack(device);
+        off_t size = map_file_to_memory(filename, &device->buffer, shared);
+        if (size < 0)
+        {
+            return (int)size;
+        }
+        device->size = size;
+
+        if (isWritable(device) && isWriteBack(device))
+        {
+            device->fd = open(filename, O_RDWR);
+            if (device->fd < 0)
+            {
+                unmap_file_from_memory(device->buffer, device->size);
+                device->buffer = NULL;
+                return -1;
+            }
+        }
+    }
+
+    device->sectorCount = device->size / device->sectorSize;
+
+    if (!isCached(device) && allocateDirtyMap(device) < 0)
+    {
+        close_block_device(device);
+        return -4;
+    }
+
+    return 0;
+}
+
+int enable_uring(block_device *device, uint32_t queueDepth)
+{
+    // a shared mapping is written by the kernel, there is nothing to submit
+    if (device->fd < 0)
+    {
+        return -1;
+    }
+
+    uring *ring = (uring *)malloc(sizeof(uring));
+    if (ring == NULL)
+    {
+        return -4;
+    }
+    if (uring_init(ring, queueDepth) != 0)
+    {
+        free(ring);
+        return -1;
+    }
+
+    device->requests = (block_io_request *)calloc(ring->entries, sizeof(block_io_request));
+    if (device->requests == NULL)
+    {
+        uring_exit(ring);
+        free(ring);
+        return -4;
+    }
+    for (uint32_t i = 0; i < ring->entries; i++)
+    {
+        device->requests[i].slot = BLOCK_DEVICE_NO_SLOT;
+    }
+
+    device->ring = ring;
+    device->queueDepth = ring->entries;
+
+    return 0;
+}
+
+void close_block_device(block_device *device)
+{
+    flush_block_device(device);
+
+    if (device->ring != NULL)
+    {
+        drainRequests(device);
+        uring_exit(device->ring);
+        free(device->ring);
+        free(device->requests);
+        device->ring = NULL;
+        device->requests = NULL;
+    }
+
+    if (device->buffer != NULL)
+    {
+        unmap_file_from_memory(device->buffer, device->size);
+        device->buffer = NULL;
+    }
+
+    freeCache(device);
+    freeDirtyMap(device);
+
+    if (device->fd >= 0)
+    {
+        close(device->fd);
+        device->fd = -1;
+    }
+}
+
+int set_sector_size(block_device *device, uint32_t sectorSize)
+{
+    if (sectorSize == 0 || (sectorSize & (sectorSize - 1)) != 0)
+    {
+        return -1;
+    }
+
+    if (sectorSize == device->sectorSize)
+    {
+        return 0;
+    }
+
+    // dirty state is kept in units of the old sector size, write it out before switching
+    if (flush_block_device(device) != 0)
+    {
+        return -1;
+    }
+
+    device->sectorSize = sectorSize;
+    device->sectorCount = device->size / sectorSize;
+
+    if (isCached(device))
+    {
+        freeCache(device);
+        return allocateCache(device);
+    }
+
+    freeDirtyMap(device);
+    return allocateDirtyMap(device);
+}
+
+// uncommitted metadata must not reach the image before the commit hook ran
+static bool isEvictable(const block_device *device, uint32_t slot)
+{
+    const sector_cache_slot *s = &device->slots[slot];
+    if (s->pinCount > 0 || s->inflight > 0)
+    {
+        return false;
+    }
+
+    return device->commitHook == NULL || !(s->dirty && s->metadata);
+}
+
+static uint32_t findVictim(const block_device *device)
+{
+    uint32_t slot = device->lruTail;
+    while (slot != BLOCK_DEVICE_NO_SLOT && !isEvictable(device, slot))
+    {
+        slot = device->slots[slot].prev;
+    }
+
+    return slot;
+}
+
+static int writeBack(block_device *device, bool includeMetadata);
+
+// returns the slot holding the sector, a missing sector is read from the image file only if read is set
+static char *lookupSector(block_device *device, uint64_t sector, bool read)
+{
+    if (sector >= device->sectorCount)
+    {
+        return NULL;
+    }
+
+    if (!isCached(device))
+    {
+        return device->buffer + sector * device->sectorSize;
+    }
+
+    uint32_t slot = hashLookup(device, sector);
+    if (slot != BLOCK_DEVICE_NO_SLOT)
+    {
+        device->cacheHits++;
+
+        // mark as most recently used
+        lruUnlink(device, slot);
+        lruPushFront(device, slot);
+
+        return slotPointer(device, slot);
+    }
+
+    device->cacheMisses++;
+
+    // find the least recently used slot that can be reused
+    slot = findVictim(device);
+    if (slot == BLOCK_DEVICE_NO_SLOT && device->ring != NULL && device->ring->inflight > 0)
+    {
+        // slots that are being written become reusable once their writes completed
+        drainRequests(device);
+        slot = findVictim(device);
+    }
+    if (slot == BLOCK_DEVICE_NO_SLOT)
+    {
+        printf("Sector cache exhausted, all slots are pinned!\n");
+        return NULL;
+    }
+
+    sector_cache_slot *s = &device->slots[slot];
+    if (s->dirty)
+    {
+        // the victim has to be written back first, write all other dirty sectors along with it
+        // so that neighbouring sectors end up in the same pwritev() call. Uncommitted metadata
+        // stays in the cache, only file contents are written ahead of the commit.
+        if (writeBack(device, device->commitHook == NULL) != 0)
+        {
+            return NULL;
+        }
+    }
+    if (s->valid)
+    {
+        hashRemove(device, slot);
+        s->valid = false;
+    }
+
+    char *ptr = slotPointer(device, slot);
+    if (read)
+    {
+        if (preadFully(device->fd, ptr, device->sectorSize, (off_t)sector * device->sectorSize) != 0)
+        {
+            return NULL;
+        }
+        device->sectorsRead++;
+        device->readCalls++;
+    }
+
+    s->sector = sector;
+    s->valid = true;
+    hashInsert(device, slot);
+
+    lruUnlink(device, slot);
+    lruPushFront(device, slot);
+
+    return ptr;
+}
+
+char *get_sector(block_device *device, uint64_t sector)
+{
+    return lookupSector(device, sector, true);
+}
+
+char *get_sector_for_overwrite(block_device *device, uint64_t sector)
+{
+    return lookupSector(device, sector, false);
+}
+
+// marks the sector containing ptr dirty, metadata sectors are additionally remembered for the commit hook
+static void markDirty(block_device *device, const char *ptr, bool metadata)
+{
+    if (!isWritable(device))
+    {
+        // private mappings are scratch space
+        return;
+    }
+
+    if (!isCached(device))
+    {
+        if (ptr < device->buffer || ptr >= device->buffer + device->sectorCount * device->sectorSize)
+        {
+            return;
+        }
+
+        uint64_t sector = (uint64_t)(ptr - device->buffer) / device->sectorSize;
+        uint64_t bit = 1ULL << (sector % 64);
+        if ((device->dirtyMap[sector / 64] & bit) == 0)
+        {
+            device->dirtyMap[sector / 64] |= bit;
+            device->dirtySectors++;
+        }
+        if (metadata && (device->metadataMap[sector / 64] & bit) == 0)
+        {
+            device->metadataMap[sector / 64] |= bit;
+            device->dirtyMetadataSectors++;
+        }
+        return;
+    }
+
+    uint32_t slot = slotOf(device, ptr);
+    if (slot == BLOCK_DEVICE_NO_SLOT || !device->slots[slot].valid)
+    {
+        return;
+    }
+
+    sector_cache_slot *s = &device->slots[slot];
+    if (!s->dirty)
+    {
+        s->dirty = true;
+        device->dirtySectors++;
+    }
+    if (metadata && !s->metadata)
+    {
+        s->metadata = true;
+        device->dirtyMetadataSectors++;
+    }
+}
+
+void put_sector(block_device *device, const char *ptr)
+{
+    markDirty(device, ptr, true);
+}
+
+void put_data_sector(block_device *device, const char *ptr)
+{
+    markDirty(device, ptr, false);
+}
+
+static int compareSectors(const void *a, const void *b)
+{
+    uint64_t sectorA = *(const uint64_t *)a;
+    uint64_t sectorB = *(const uint64_t *)b;
+
+    return sectorA < sectorB ? -1 : (sectorA > sectorB ? 1 : 0);
+}
+
+void submit_sector(block_device *device, const char *ptr)
+{
+    if (device->ring == NULL)
+    {
+        return;
+    }
+
+    // collect what completed in the meantime, keeps requests available
+    while (completeRequest(device, false))
+    {
+    }
+
+    uint64_t sector;
+    uint32_t slot = BLOCK_DEVICE_NO_SLOT;
+    bool metadata;
+    if (isCached(device))
+    {
+        slot = slotOf(device, ptr);
+        if (slot == BLOCK_DEVICE_NO_SLOT || !device->slots[slot].valid || !device->slots[slot].dirty)
+        {
+            return;
+        }
+        sector = device->slots[slot].sector;
+        metadata = device->slots[slot].metadata;
+    }
+    else
+    {
+        if (ptr < device->buffer || ptr >= device->buffer + device->sectorCount * device->sectorSize)
+        {
+            return;
+        }
+        sector = (uint64_t)(ptr - device->buffer) / device->sectorSize;
+        if (!testBit(device->dirtyMap, sector))
+        {
+            return;
+        }
+        metadata = testBit(device->metadataMap, sector);
+    }
+
+    // metadata has to wait for the commit
+    if (metadata && device->commitHook != NULL)
+    {
+        return;
+    }
+
+    struct iovec iov = {sectorPointer(device, sector), device->sectorSize};
+    if (writeRun(device, sector, &iov, 1, slot) != 0)
+    {
+        return;
+    }
+    uring_submit(device->ring);
+
+    // the sector is clean as soon as the write is queued, a failure marks it dirty again
+    device->dirtySectors--;
+    if (metadata)
+    {
+        device->dirtyMetadataSectors--;
+    }
+    if (isCached(device))
+    {
+        device->slots[slot].dirty = false;
+        device->slots[slot].metadata = false;
+        device->slots[slot].inflight++;
+    }
+    else
+    {
+        device->dirtyMap[sector / 64] &= ~(1ULL << (sector % 64));
+        device->metadataMap[sector / 64] &= ~(1ULL << (sector % 64));
+    }
+}
+
+// reads ahead into the page cache of the kernel, the mapping picks the pages up from there
+static void adviseMapping(block_device *device, const uint64_t *sectors, uint32_t count)
+{
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (sectors[i] >= device->sectorCount)
+        {
+            continue;
+        }
+
+        uint64_t start = sectors[i] * device->sectorSize / pageSize * pageSize;
+        madvise(device->buffer + start, (sectors[i] + 1) * device->sectorSize - start, MADV_WILLNEED);
+    }
+}
+
+void prefetch_sectors(block_device *device, const uint64_t *sectors, uint32_t count)
+{
+    if (!isCached(device))
+    {
+        adviseMapping(device, sectors, count);
+        return;
+    }
+
+    // leave room for the sectors the caller is working with
+    count = count < device->slotCount / 2 ? count : device->slotCount / 2;
+
+    uint64_t *missing = (uint64_t *)malloc(count * sizeof(uint64_t));
+    if (missing == NULL)
+    {
+        return;
+    }
+
+    uint32_t missingCount = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (sectors[i] < device->sectorCount && hashLookup(device, sectors[i]) == BLOCK_DEVICE_NO_SLOT)
+        {
+            missing[missingCount++] = sectors[i];
+        }
+    }
+    qsort(missing, missingCount, sizeof(uint64_t), compareSectors);
+
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+    uint64_t firstSector = 0;
+    for (uint32_t i = 0; i < missingCount; i++)
+    {
+        if (i > 0 && missing[i] == missing[i - 1])
+        {
+            continue;
+        }
+
+        uint32_t slot = findVictim(device);
+        if (slot != BLOCK_DEVICE_NO_SLOT && device->slots[slot].dirty)
+        {
+            // same as in get_sector(), write back everything that may be written at once
+            if (writeBack(device, device->commitHook == NULL) != 0)
+            {
+                break;
+            }
+            slot = findVictim(device);
+        }
+        if (slot == BLOCK_DEVICE_NO_SLOT)
+        {
+            break;
+        }
+
+        // the slot is claimed right away, the read below fills it before anyone looks at it
+        sector_cache_slot *s = &device->slots[slot];
+        if (s->valid)
+        {
+            hashRemove(device, slot);
+        }
+        s->sector = missing[i];
+        s->valid = true;
+        hashInsert(device, slot);
+        lruUnlink(device, slot);
+        lruPushFront(device, slot);
+
+        if (iovcnt > 0 && (missing[i] != firstSector + iovcnt || iovcnt == IOV_MAX))
+        {
+            readRun(device, firstSector, iov, iovcnt);
+            iovcnt = 0;
+        }
+        if (iovcnt == 0)
+        {
+            firstSector = missing[i];
+        }
+        iov[iovcnt].iov_base = slotPointer(device, slot);
+        iov[iovcnt].iov_len = device->sectorSize;
+        iovcnt++;
+    }
+    if (iovcnt > 0)
+    {
+        readRun(device, firstSector, iov, iovcnt);
+    }
+    free(missing);
+
+    drainRequests(device);
+}
+
+void end_operation(block_device *device)
+{
+    device->pendingOperations++;
+
+    // without a commit hook there is no consistency to preserve, sectors are written back whenever convenient
+    if (device->commitHook == NULL)
+    {
+        return;
+    }
+
+    // the cache cannot evict uncommitted metadata, commit early before it runs out of slots
+    bool cacheFilling = isCached(device) && device->dirtyMetadataSectors > device->slotCount / 2;
+    if (device->pendingOperations >= device->groupCommit || cacheFilling)
+    {
+        flush_block_device(device);
+    }
+}
+
+uint64_t *collect_dirty_sectors(block_device *device, bool metadataOnly, uint64_t *count)
+{
+    *count = metadataOnly ? device->dirtyMetadataSectors : device->dirtySectors;
+    if (*count == 0)
+    {
+        return NULL;
+    }
+
+    uint64_t *sectors = (uint64_t *)malloc(*count * sizeof(uint64_t));
+    if (sectors == NULL)
+    {
+        *count = 0;
+        return NULL;
+    }
+
+    uint64_t found = 0;
+    if (isCached(device))
+    {
+        for (uint32_t slot = 0; slot < device->slotCount && found < *count; slot++)
+        {
+            const sector_cache_slot *s = &device->slots[slot];
+            if (s->valid && s->dirty && (s->metadata || !metadataOnly))
+            {
+                sectors[found++] = s->sector;
+            }
+        }
+        qsort(sectors, found, sizeof(uint64_t), compareSectors);
+    }
+    else
+    {
+        const uint64_t *map = metadataOnly ? device->metadataMap : device->dirtyMap;
+        uint64_t words = (device->sectorCount + 63) / 64;
+        for (uint64_t word = 0; word < words && found < *count; word++)
+        {
+            uint64_t bits = map[word];
+            while (bits != 0)
+            {
+                sectors[found++] = word * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+            }
+        }
+    }
+    *count = found;
+
+    return sectors;
+}
+
+static int compareSlotsBySector(const void *a, const void *b, void *context)
+{
+    const block_device *device = (const block_device *)context;
+    uint64_t sectorA = device->slots[*(const uint32_t *)a].sector;
+    uint64_t sectorB = device->slots[*(const uint32_t *)b].sector;
+
+    return sectorA < sectorB ? -1 : (sectorA > sectorB ? 1 : 0);
+}
+
+// writes the dirty cache slots ordered by sector, every run of adjacent sectors is one pwritev() call
+static int flushCache(block_device *device, bool includeMetadata)
+{
+    uint32_t *dirtySlots = (uint32_t *)malloc(device->dirtySectors * sizeof(uint32_t));
+    if (dirtySlots == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t slot = 0; slot < device->slotCount; slot++)
+    {
+        const sector_cache_slot *s = &device->slots[slot];
+        if (s->valid && s->dirty && (includeMetadata || !s->metadata))
+        {
+            dirtySlots[count++] = slot;
+        }
+    }
+    qsort_r(dirtySlots, count, sizeof(uint32_t), compareSlotsBySector, device);
+
+    struct iovec iov[IOV_MAX];
+    int result = 0;
+    uint32_t i = 0;
+    while (i < count)
+    {
+        uint64_t firstSector = device->slots[dirtySlots[i]].sector;
+        uint32_t runStart = i;
+        int iovcnt = 0;
+
+        while (i < count && iovcnt < IOV_MAX && device->slots[dirtySlots[i]].sector == firstSector + iovcnt)
+        {
+            iov[iovcnt].iov_base = slotPointer(device, dirtySlots[i]);
+            iov[iovcnt].iov_len = device->sectorSize;
+            iovcnt++;
+            i++;
+        }
+
+        // asynchronous writes are marked clean right away, a failure marks them dirty again
+        if (writeRun(device, firstSector, iov, iovcnt, BLOCK_DEVICE_NO_SLOT) != 0)
+        {
+            result = -1;
+            continue;
+        }
+
+        for (uint32_t j = runStart; j < i; j++)
+        {
+            sector_cache_slot *s = &device->slots[dirtySlots[j]];
+            s->dirty = false;
+            device->dirtySectors--;
+            if (s->metadata)
+            {
+                s->metadata = false;
+                device->dirtyMetadataSectors--;
+            }
+        }
+    }
+
+    free(dirtySlots);
+
+    return result;
+}
+
+// writes the sectors [first, end) of the mapping into the image file: shared mappings are synced page by
+// page with msync(), write-back mappings are written with a single pwrite()
+static int writeMappedRun(block_device *device, uint64_t first, uint64_t end)
+{
+    uint64_t start = first * device->sectorSize;
+    uint64_t stop = end * device->sectorSize;
+
+    if (isWriteBack(device))
+    {
+        struct iovec iov = {device->buffer + start, stop - start};
+        return writeRun(device, first, &iov, 1, BLOCK_DEVICE_NO_SLOT);
+    }
+
+    device->writeCalls++;
+    device->sectorsWritten += end - first;
+
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    start = start / pageSize * pageSize;
+    stop = stop < (uint64_t)device->size ? stop : (uint64_t)device->size;
+
+    return msync(device->buffer + start, stop - start, MS_SYNC) == 0 ? 0 : -1;
+}
+
+// writes the sectors [first, end) of the mapping and clears their dirty state
+static int flushMappedRun(block_device *device, uint64_t first, uint64_t end)
+{
+    if (writeMappedRun(device, first, end) != 0)
+    {
+        return -1;
+    }
+
+    for (uint64_t sector = first; sector < end; sector++)
+    {
+        uint64_t bit = 1ULL << (sector % 64);
+        device->dirtyMap[sector / 64] &= ~bit;
+        device->dirtySectors--;
+        if ((device->metadataMap[sector / 64] & bit) != 0)
+        {
+            device->metadataMap[sector / 64] &= ~bit;
+            device->dirtyMetadataSectors--;
+        }
+    }
+
+    return 0;
+}
+
+// writes the dirty parts of a mapping, every run of adjacent dirty sectors is one call
+static int flushMapping(block_device *device, bool includeMetadata)
+{
+    uint64_t words = (device->sectorCount + 63) / 64;
+    int result = 0;
+
+    // run of dirty sectors that is currently being collected
+    uint64_t runStart = 0;
+    uint64_t runEnd = 0;
+
+    for (uint64_t word = 0; word < words; word++)
+    {
+        uint64_t bits = device->dirtyMap[word];
+        if (!includeMetadata)
+        {
+            bits &= ~device->metadataMap[word];
+        }
+
+        while (bits != 0)
+        {
+            uint64_t sector = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            if (runEnd > runStart && sector == runEnd)
+            {
+                runEnd++;
+                continue;
+            }
+
+            if (runEnd > runStart && flushMappedRun(device, runStart, runEnd) != 0)
+            {
+                result = -1;
+            }
+            runStart = sector;
+            runEnd = sector + 1;
+        }
+    }
+
+    if (runEnd > runStart && flushMappedRun(device, runStart, runEnd) != 0)
+    {
+        result = -1;
+    }
+
+    return result;
+}
+
+// writes the dirty sectors of either backend, uncommitted metadata is skipped unless includeMetadata is set
+static int writeBack(block_device *device, bool includeMetadata)
+{
+    // earlier asynchronous writes of the same sectors must not be reordered with the ones below,
+    // failed ones are dirty again and written below
+    drainRequests(device);
+
+    int result = isCached(device) ? flushCache(device, includeMetadata) : flushMapping(device, includeMetadata);
+
+    // the sectors only count as written once all requests completed
+    if (drainRequests(device) != 0)
+    {
+        result = -1;
+    }
+
+    return result;
+}
+
+int flush_block_device(block_device *device)
+{
+    if (device->flushHook != NULL && device->flushHook(device->flushContext) != 0)
+    {
+        return -1;
+    }
+
+    if (device->dirtySectors == 0)
+    {
+        // sectors passed to submit_sector() are not dirty anymore, but might still be in flight
+        return drainRequests(device);
+    }
+
+    if (device->commitHook != NULL && device->dirtyMetadataSectors > 0)
+    {
+        // file contents go first, so that committed metadata never references stale clusters,
+        // then the hook (e.g. the journal) makes the metadata durable before it may overwrite the image
+        if (writeBack(device, false) != 0 || device->commitHook(device->commitContext) != 0)
+        {
+            return -1;
+        }
+    }
+    device->pendingOperations = 0;
+
+    return writeBack(device, true);
+}
+
+int sync_block_device(block_device *device)
+{
+    if (flush_block_device(device) != 0)
+    {
+        return -1;
+    }
+
+    // shared mappings are synced with MS_SYNC already
+    if (device->fd >= 0)
+    {
+        return fdatasync(device->fd) == 0 ? 0 : -1;
+    }
+
+    return 0;
+}
+
+void pin_sector(block_device *device, const char *ptr)
+{
+    uint32_t slot = slotOf(device, ptr);
+    if (slot != BLOCK_DEVICE_NO_SLOT)
+    {
+        device->slots[slot].pinCount++;
+    }
+}
+
+void unpin_sector(block_device *device, const char *ptr)
+{
+    uint32_t slot = slotOf(device, ptr);
+    if (slot != BLOCK_DEVICE_NO_SLOT && device->slots[slot].pinCount > 0)
+    {
+        device->slots[slot].pinCount--;
+    }
+}
+
+int read_sector(block_device *device, uint64_t sector, char *out)
+{
+    char *ptr = get_sector(device, sector);
+    if (ptr == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(out, ptr, device->sectorSize);
+
+    return 0;
+}
+
+int write_sector(block_device *device, uint64_t sector, const char *in)
+{
+    char *ptr = get_sector(device, sector);
+    if (ptr == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(ptr, in, device->sectorSize);
+    put_sector(device, ptr);
+
+    return 0;
+}
+
+int read_bytes(block_device *device, off_t offset, void *out, size_t len)
+{
+    char *outPtr = (char *)out;
+
+    while (len > 0)
+    {
+        uint64_t sector = offset / device->sectorSize;
+        uint32_t offsetInSector = offset % device->sectorSize;
+        size_t count = device->sectorSize - offsetInSector;
+        count = count < len ? count : len;
+
+        char *ptr = get_sector(device, sector);
+        if (ptr == NULL)
+        {
+            return -1;
+        }
+        memcpy(outPtr, ptr + offsetInSector, count);
+
+        outPtr += count;
+        offset += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+int write_bytes(block_device *device, off_t offset, const void *in, size_t len)
+{
+    const char *inPtr = (const char *)in;
+
+    while (len > 0)
+    {
+        uint64_t sector = offset / device->sectorSize;
+        uint32_t offsetInSector = offset % device->sectorSize;
+        size_t count = device->sectorSize - offsetInSector;
+        count = count < len ? count : len;
+
+        char *ptr = get_sector(device, sector);
+        if (ptr == NULL)
+        {
+            return -1;
+        }
+        memcpy(ptr + offsetInSector, inPtr, count);
+        put_sector(device, ptr);
+
+        inPtr += count;
+        offset += count;
+        len -= count;
+    }
+
+    return 0;
+}
+
+// copies a range of the image file to fd inside the kernel, returns 0, -1 on error or -2 if nothing can be copied
+static int copyImageRange(const block_device *device, off_t offset, size_t len, int fd)
+{
+    bool useSendfile = false;
+    size_t copied = 0;
+    while (copied < len)
+    {
+        ssize_t result;
+        if (!useSendfile)
+        {
+            loff_t in = offset + copied;
+            result = copy_file_range(device->fd, &in, fd, NULL, len - copied, 0);
+            if (result < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+            {
+                useSendfile = true;
+                continue;
+            }
+        }
+        else
+        {
+            off_t in = offset + copied;
+            result = sendfile(fd, device->fd, &in, len - copied);
+            if (result < 0 && copied == 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                return -2;
+            }
+        }
+
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return -1;
+        }
+        copied += result;
+    }
+
+    return 0;
+}
+
+int copy_bytes_to_fd(block_device *device, off_t offset, size_t len, int fd)
+{
+    // a scratch mapping is never written back, the image file does not contain its modifications.
+    // Shared mappings keep no descriptor of the image file, their pages are the page cache of the file already.
+    if (!isWritable(device) || device->fd < 0 || offset < 0 || offset + (off_t)len > device->size)
+    {
+        return -2;
+    }
+
+    // the image file has to contain the data, including sectors that are still being written
+    if (device->dirtySectors > 0 && flush_block_device(device) != 0)
+    {
+        return -1;
+    }
+    if (drainRequests(device) != 0)
+    {
+        return -1;
+    }
+
+    return copyImageRange(device, offset, len, fd);
+}
+
+int write_image_bytes_to_fd(const block_device *device, off_t offset, size_t len, int fd)
+{
+    if (offset < 0 || offset + (off_t)len > device->size)
+    {
+        return -1;
+    }
+
+    if (device->buffer == NULL)
+    {
+        return copyImageRange(device, offset, len, fd);
+    }
+
+    // the mapping holds the current contents of every backend that maps the image
+    const char *ptr = device->buffer + offset;
+    while (len > 0)
+    {
+        ssize_t result = write(fd, ptr, len);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            return -1;
+        }
+        ptr += result;
+        len -= result;
+    }
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "uring.h"
+
+#define BLOCK_DEVICE_DEFAULT_SECTOR_SIZE 512
+#define BLOCK_DEVICE_DEFAULT_CACHE_SECTORS 256
+#define BLOCK_DEVICE_NO_SLOT 0xFFFFFFFF
+
+// open modes, can be combined
+#define BLOCK_DEVICE_WRITABLE 0x01   // modifications are written back into the image file
+#define BLOCK_DEVICE_CACHED 0x02     // sectors are read on demand into a bounded cache instead of mapping the image
+#define BLOCK_DEVICE_WRITE_BACK 0x04 // writable mappings are private, modifications reach the image file only through flush_block_device()
+
+// callbacks of flush_block_device(), return 0 on success
+//   - flush hook:  called first, writes state cached above the device (e.g. the decoded FAT) into its sectors
+//   - commit hook: called before dirty metadata sectors are written into the image, e.g. to journal them first
+typedef int (*block_device_hook)(void *context);
+
+// one sector held in the cache of a cached block device
+typedef struct
+{
+    uint64_t sector;   // index of the sector on the volume
+    uint32_t prev;     // neighbour towards the most recently used slot
+    uint32_t next;     // neighbour towards the least recently used slot
+    uint32_t hashNext; // next slot in the same hash bucket
+    uint16_t pinCount; // pinned slots are never evicted
+    bool valid;        // false as long as the slot was never filled
+    bool dirty;        // modified since the last flush
+    bool metadata;     // dirty because FAT or directory contents were modified (see put_sector())
+    uint8_t inflight;  // asynchronous writes of the slot that did not complete yet, the slot is not evicted
+} sector_cache_slot;
+
+// an asynchronous read or write of a run of adjacent sectors
+typedef struct
+{
+    bool busy;
+    bool write;
+    uint64_t firstSector;
+    uint32_t count;
+    uint32_t slot;      // cache slot of a single sector write (see submit_sector()), BLOCK_DEVICE_NO_SLOT otherwise
+    struct iovec *iov;  // owned by the request until it completes
+} block_io_request;
+
+// A volume image accessed sector by sector.
+//
+// There are two backends:
+//   - mapped: the whole image is mapped into memory, get_sector() is pointer arithmetic. Writable images are either
+//             mapped shared (the kernel writes modified pages back, see map_file_to_memory()) or privately
+//             with BLOCK_DEVICE_WRITE_BACK (only flush_block_device() writes into the image file)
+//   - cached: the image is read with pread() into a fixed amount of cache slots, the least recently used
+//             unpinned slot is reused when a sector is missing. Memory usage does not depend on the image size.
+//
+// Modified sectors are only remembered as dirty (see put_sector()). flush_block_device() writes the dirty
+// sectors back, runs of adjacent sectors are written with a single call.
+//
+// With enable_uring(), the cached and write-back backends submit their reads and writes through io_uring:
+// flushes and prefetches queue one request per run of sectors and wait for all of them at once,
+// submit_sector() starts writing a completed data sector while the caller goes on updating metadata.
+//
+// Filesystem operations are delimited by end_operation(). If a commit hook is installed (see journal.h), dirty
+// metadata sectors are only written back at operation boundaries, after the hook has succeeded.
+typedef struct
+{
+    int fd;
+    int mode;
+    off_t size;
+    uint32_t sectorSize;
+    uint64_t sectorCount;
+
+    // mapped backend
+    char *buffer;
+    uint64_t *dirtyMap;    // one bit per sector, only used for writable mappings
+    uint64_t *metadataMap; // one bit per sector, set for dirty sectors written with put_sector()
+
+    // cached backend
+    char *slotData;
+    sector_cache_slot *slots;
+    uint32_t slotCount;
+    uint32_t *buckets;
+    uint32_t bucketCount;
+    uint32_t lruHead; // most recently used slot
+    uint32_t lruTail; // least recently used slot, the next candidate for eviction
+
+    // amount of sectors modified since the last flush
+    uint64_t dirtySectors;
+    uint64_t dirtyMetadataSectors;
+
+    // transactions
+    block_device_hook flushHook;
+    void *flushContext;
+    block_device_hook commitHook;
+    void *commitContext;
+    uint32_t groupCommit;       // operations per commit
+    uint32_t pendingOperations; // operations finished since the last commit
+
+    // asynchronous I/O, NULL if reads and writes are synchronous
+    uring *ring;
+    block_io_request *requests; // one per queue entry, indexed by the user data of the completion
+    uint32_t queueDepth;
+    uint64_t ioErrors;
+
+    // statistics
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t sectorsRead;
+    uint64_t sectorsWritten;
+    uint64_t writeCalls;
+    uint64_t readCalls;
+    uint64_t asyncRequests;
+} block_device;
+
+/**
+ * Opens an image file as block device.
+ *
+ * mode - BLOCK_DEVICE_WRITABLE: modifications are persisted, otherwise the image is never modified (scratch mode).
+ *        BLOCK_DEVICE_CACHED: use the sector cache with cacheSectors slots instead of mapping the whole image.
+ *        The cached backend has to be writable because evicted sectors cannot be kept in memory.
+ *
+ * return - 0 on success, error codes are negative integers
+ *          -1 - file opening error
+ *          -2 - file is empty or its size cannot be determined
+ *          -3 - file mapping error
+ *          -4 - out of memory
+ *          -5 - BLOCK_DEVICE_CACHED without BLOCK_DEVICE_WRITABLE
+ */
+int open_block_device(block_device *device, const char *filename, int mode, uint32_t cacheSectors);
+
+/**
+ * Switches the reads and writes of the device to io_uring with up to queueDepth requests in flight
+ * (0 selects URING_DEFAULT_QUEUE_DEPTH). Only devices that access the image through a file descriptor
+ * (BLOCK_DEVICE_CACHED or BLOCK_DEVICE_WRITE_BACK) can use io_uring.
+ *
+ * return - 0 on success, -1 if io_uring is not available (the device stays synchronous), -4 if out of memory
+ */
+int enable_uring(block_device *device, uint32_t queueDepth);
+
+/**
+ * Flushes outstanding modifications and releases all resources of the device.
+ */
+void close_block_device(block_device *device);
+
+/**
+ * Changes the sector size (e.g. to the bytes per sector found in the boot sector).
+ * All sector indexes passed to the device afterwards are in units of the new size.
+ *
+ * return - 0 on success, -1 for an invalid size, -4 if out of memory
+ */
+int set_sector_size(block_device *device, uint32_t sectorSize);
+
+/**
+ * Returns a pointer to the contents of the sector or NULL if the sector cannot be read.
+ *
+ * For the cached backend, the pointer stays valid until the slot is reused for another sector.
+ * Use pin_sector() to keep a pointer valid across further sector accesses.
+ * After modifying the sector contents through the pointer, call put_sector().
+ */
+char *get_sector(block_device *device, uint64_t sector);
+
+/**
+ * Same as get_sector() for a sector the caller is going to overwrite completely. The cached backend does not
+ * read a missing sector from the image file, the contents behind the pointer are undefined then.
+ */
+char *get_sector_for_overwrite(block_device *device, uint64_t sector);
+
+/**
+ * Tells the device that the sector containing ptr (a pointer returned by get_sector()) was modified.
+ * The sector is marked dirty and written into the image file by the next flush_block_device() or when
+ * its cache slot is reused.
+ *
+ * put_sector() is used for filesystem metadata (FAT, directory entries) which passes the commit hook.
+ * put_data_sector() is used for file contents which are never journaled.
+ */
+void put_sector(block_device *device, const char *ptr);
+void put_data_sector(block_device *device, const char *ptr);
+
+/**
+ * Starts writing the dirty data sector containing ptr right away instead of at the next flush.
+ * Used when a sector will not be modified anymore, the write overlaps with the following operations.
+ * No-op for synchronous devices, which keep the sector dirty so that it is coalesced with its neighbours.
+ */
+void submit_sector(block_device *device, const char *ptr);
+
+/**
+ * Reads the given sectors into the cache with as few requests as possible (one per run of adjacent sectors),
+ * so that the following get_sector() calls hit. With io_uring all requests are in flight at the same time.
+ * The mapped backend only advises the kernel to read the pages ahead.
+ */
+void prefetch_sectors(block_device *device, const uint64_t *sectors, uint32_t count);
+
+/**
+ * Marks the end of a filesystem operation. All metadata modified since the previous call belongs to one
+ * consistent state of the volume. With a commit hook installed, the device is flushed after groupCommit
+ * operations (or earlier, if dirty metadata fills half of the sector cache).
+ */
+void end_operation(block_device *device);
+
+/**
+ * Returns an ascending list of all dirty sectors (only metadata sectors if metadataOnly is set).
+ * The caller has to free() the list. count is set to the amount of sectors in the list.
+ * Returns NULL if out of memory or if no sector is dirty.
+ */
+uint64_t *collect_dirty_sectors(block_device *device, bool metadataOnly, uint64_t *count);
+
+/**
+ * Writes all dirty sectors into the image file. Adjacent dirty sectors are coalesced into a single
+ * pwritev() (cached backend, write-back mappings) or msync() (shared mappings) call.
+ *
+ * return - 0 on success, -1 if writing failed (the sectors stay dirty)
+ */
+int flush_block_device(block_device *device);
+
+/**
+ * Flushes the device and waits until the image file is on stable storage.
+ *
+ * return - 0 on success, -1 on error
+ */
+int sync_block_device(block_device *device);
+
+/**
+ * Keeps the cache slot containing ptr from being evicted until unpin_sector() is called.
+ * No-op for the mapped backend.
+ */
+void pin_sector(block_device *device, const char *ptr);
+void unpin_sector(block_device *device, const char *ptr);
+
+/**
+ * Copy a whole sector out of or into the device.
+ *
+ * return - 0 on success, -1 on error
+ */
+int read_sector(block_device *device, uint64_t sector, char *out);
+int write_sector(block_device *device, uint64_t sector, const char *in);
+
+/**
+ * Copy a byte range out of or into the device. The range may span several sectors.
+ *
+ * return - 0 on success, -1 on error
+ */
+int read_bytes(block_device *device, off_t offset, void *out, size_t len);
+int write_bytes(block_device *device, off_t offset, const void *in, size_t len);
+
+/**
+ * Copies a byte range of the image file to the current position of fd without passing the data through
+ * user space, with copy_file_range() or, where the file systems do not support it, sendfile().
+ * Modified sectors are written back first.
+ *
+ * return - 0 on success, -1 on error
+ *          -2 - the range cannot be copied inside the kernel, nothing was copied. Scratch mappings keep their
+ *               modifications in memory only, shared mappings have no descriptor of the image file,
+ *               and fd might not support it.
+ */
+int copy_bytes_to_fd(block_device *device, off_t offset, size_t len, int fd);
+
+/**
+ * Writes a byte range of the image to the current position of fd, straight from the mapping of a mapped image,
+ * with copy_file_range() or sendfile() from the image file of a cached image.
+ *
+ * The sector cache, the statistics and pending requests are not touched, so several threads may call it at
+ * the same time as long as nobody modifies the volume meanwhile. Modified sectors of a cached image have to be
+ * written back with flush_block_device() before.
+ *
+ * return - 0 on success, -1 on error
+ *          -2 - the cached image cannot be copied inside the kernel, nothing was copied
+ */
+int write_image_bytes_to_fd(const block_device *device, off_t offset, size_t len, int fd);
+
+#endif
\ No newline at end of file
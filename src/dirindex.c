@@ -0,0 +1,295 @@
+#include "dirindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DIR_INDEX_EMPTY UINT64_MAX
+#define DIR_INDEX_DELETED (UINT64_MAX - 1)
+
+// buckets of a new index, the table doubles when it is filled to three quarters
+#define DIR_INDEX_INITIAL_CAPACITY 64
+
+#define FNV_OFFSET_BASIS 0x811C9DC5
+#define FNV_PRIME 0x01000193
+
+// FNV-1a of the name up to the first NUL byte, names that strncmp() considers equal hash the same
+static uint32_t hashName(const char *name)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (int i = 0; i < FILENAME_LENGTH && name[i] != '\0'; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// the set of a dentry, the directory is mixed into the hash of the name
+static dentry *dentrySet(dentry_cache *cache, uint32_t parent, const char *name)
+{
+    uint32_t hash = hashName(name) ^ parent * FNV_PRIME;
+    return cache->sets[(hash ^ hash >> 16) % DENTRY_CACHE_SETS];
+}
+
+// returns the dentry of the name, NULL if the lookup is not cached
+static dentry *findDentry(dentry_cache *cache, uint32_t parent, const char *name)
+{
+    dentry *set = dentrySet(cache, parent, name);
+    for (int i = 0; i < DENTRY_CACHE_WAYS; i++)
+    {
+        if (set[i].valid && set[i].parent == parent && strncmp(set[i].name, name, FILENAME_LENGTH) == 0)
+        {
+            return &set[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool isUsed(const dir_index_bucket *bucket)
+{
+    return bucket->slot != DIR_INDEX_EMPTY && bucket->slot != DIR_INDEX_DELETED;
+}
+
+// returns the bucket holding the name, NULL if the name is not in the index
+static dir_index_bucket *findBucket(const dir_index *index, const char *name)
+{
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = hashName(name) & mask;; i = (i + 1) & mask)
+    {
+        dir_index_bucket *bucket = &index->buckets[i];
+        if (bucket->slot == DIR_INDEX_EMPTY)
+        {
+            return NULL;
+        }
+        if (bucket->slot != DIR_INDEX_DELETED && strncmp(bucket->name, name, FILENAME_LENGTH) == 0)
+        {
+            return bucket;
+        }
+    }
+}
+
+// places a name that is not in the table into the first free bucket of its probe sequence
+static void placeName(dir_index_bucket *buckets, uint32_t capacity, const char *name, uint64_t slot)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t i = hashName(name) & mask;
+    while (isUsed(&buckets[i]))
+    {
+        i = (i + 1) & mask;
+    }
+
+    memcpy(buckets[i].name, name, FILENAME_LENGTH);
+    buckets[i].slot = slot;
+}
+
+// moves all names into a table of the given capacity, removed names are left behind
+static int resize(dir_index *index, uint32_t capacity)
+{
+    dir_index_bucket *buckets = malloc(sizeof(dir_index_bucket) * capacity);
+    if (buckets == NULL)
+    {
+        return -4;
+    }
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        buckets[i].slot = DIR_INDEX_EMPTY;
+    }
+
+    for (uint32_t i = 0; i < index->capacity; i++)
+    {
+        if (isUsed(&index->buckets[i]))
+        {
+            placeName(buckets, capacity, index->buckets[i].name, index->buckets[i].slot);
+        }
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->capacity = capacity;
+    index->deleted = 0;
+
+    return 0;
+}
+
+static void release(dir_index *index)
+{
+    free(index->buckets);
+    memset(index, 0, sizeof(dir_index));
+}
+
+dir_index *dir_index_find(dir_index_cache *cache, uint32_t cluster)
+{
+    for (int i = 0; i < DIR_INDEX_DIRECTORIES; i++)
+    {
+        dir_index *index = &cache->indexes[i];
+        if (index->valid && index->cluster == cluster)
+        {
+            index->lastUse = ++cache->clock;
+            return index;
+        }
+    }
+
+    return NULL;
+}
+
+dir_index *dir_index_create(dir_index_cache *cache, uint32_t cluster)
+{
+    dir_index_drop(cache, cluster);
+
+    // an unused index or the least recently used one
+    dir_index *victim = &cache->indexes[0];
+    for (int i = 0; i < DIR_INDEX_DIRECTORIES && victim->valid; i++)
+    {
+        dir_index *index = &cache->indexes[i];
+        if (!index->valid || index->lastUse < victim->lastUse)
+        {
+            victim = index;
+        }
+    }
+    release(victim);
+
+    if (resize(victim, DIR_INDEX_INITIAL_CAPACITY) != 0)
+    {
+        return NULL;
+    }
+    victim->cluster = cluster;
+    victim->valid = true;
+    victim->lastUse = ++cache->clock;
+
+    // a search from the first entry on is always right
+    victim->firstFree = 0;
+    victim->firstFreeCluster = cluster;
+    victim->end = UINT32_MAX;
+
+    return victim;
+}
+
+int dir_index_insert(dir_index *index, const char *name, uint64_t slot)
+{
+    if (findBucket(index, name) != NULL)
+    {
+        return 0;
+    }
+
+    // removed names also lengthen the probe sequences
+    if ((index->count + index->deleted + 1) * 4 > index->capacity * 3)
+    {
+        uint32_t capacity = (index->count + 1) * 4 > index->capacity * 3 / 2 ? index->capacity * 2 : index->capacity;
+        if (resize(index, capacity) != 0)
+        {
+            return -4;
+        }
+    }
+
+    placeName(index->buckets, index->capacity, name, slot);
+    index->count++;
+
+    return 0;
+}
+
+bool dir_index_lookup(const dir_index *index, const char *name, uint64_t *slot)
+{
+    dir_index_bucket *bucket = findBucket(index, name);
+    if (bucket == NULL)
+    {
+        return false;
+    }
+
+    *slot = bucket->slot;
+    return true;
+}
+
+void dir_index_remove(dir_index *index, const char *name)
+{
+    dir_index_bucket *bucket = findBucket(index, name);
+    if (bucket == NULL)
+    {
+        return;
+    }
+
+    bucket->slot = DIR_INDEX_DELETED;
+    index->count--;
+    index->deleted++;
+}
+
+void dir_index_drop(dir_index_cache *cache, uint32_t cluster)
+{
+    for (int i = 0; i < DIR_INDEX_DIRECTORIES; i++)
+    {
+        if (cache->indexes[i].valid && cache->indexes[i].cluster == cluster)
+        {
+            release(&cache->indexes[i]);
+        }
+    }
+}
+
+void dir_index_clear(dir_index_cache *cache)
+{
+    for (int i = 0; i < DIR_INDEX_DIRECTORIES; i++)
+    {
+        release(&cache->indexes[i]);
+    }
+}
+
+bool dentry_cache_lookup(dentry_cache *cache, uint32_t parent, const char *name, uint64_t *slot)
+{
+    dentry *entry = findDentry(cache, parent, name);
+    if (entry == NULL)
+    {
+        return false;
+    }
+
+    entry->lastUse = ++cache->clock;
+    *slot = entry->slot;
+    return true;
+}
+
+void dentry_cache_insert(dentry_cache *cache, uint32_t parent, const char *name, uint64_t slot)
+{
+    dentry *entry = findDentry(cache, parent, name);
+    if (entry == NULL)
+    {
+        // an unused way or the least recently used one
+        dentry *set = dentrySet(cache, parent, name);
+        entry = &set[0];
+        for (int i = 0; i < DENTRY_CACHE_WAYS && entry->valid; i++)
+        {
+            if (!set[i].valid || set[i].lastUse < entry->lastUse)
+            {
+                entry = &set[i];
+            }
+        }
+
+        entry->parent = parent;
+        memcpy(entry->name, name, FILENAME_LENGTH);
+        entry->valid = true;
+    }
+
+    entry->slot = slot;
+    entry->lastUse = ++cache->clock;
+}
+
+void dentry_cache_remove(dentry_cache *cache, uint32_t parent, const char *name)
+{
+    dentry *entry = findDentry(cache, parent, name);
+    if (entry != NULL)
+    {
+        entry->valid = false;
+    }
+}
+
+void dentry_cache_drop_parent(dentry_cache *cache, uint32_t parent)
+{
+    for (int set = 0; set < DENTRY_CACHE_SETS; set++)
+    {
+        for (int i = 0; i < DENTRY_CACHE_WAYS; i++)
+        {
+            if (cache->sets[set][i].parent == parent)
+            {
+                cache->sets[set][i].valid = false;
+            }
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "fat.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// directories whose index is kept at the same time, the least recently used one is replaced
+#define DIR_INDEX_DIRECTORIES 16
+
+// the dentry cache holds DENTRY_CACHE_SETS * DENTRY_CACHE_WAYS names, a name can only be kept in the ways of its set
+#define DENTRY_CACHE_SETS 256
+#define DENTRY_CACHE_WAYS 4
+
+// slot of a dentry that remembers that no entry of the name exists
+#define DENTRY_NEGATIVE UINT64_MAX
+
+// An index of the names in one directory: an open addressing hash table from the 8.3 name of an entry
+// to its slot, which is sector * entries per sector + index of the entry within the sector.
+//
+// The index is built the first time a name is looked up in the directory and from then on kept up to
+// date by the commands that add or remove entries, so that lookups no longer scan the directory. A name
+// that is not in a complete index does not exist in the directory. Names are compared like
+// findDirectoryEntry() does, up to the first NUL byte of the 11 bytes, which pads the . and .. links.
+typedef struct
+{
+    char name[FILENAME_LENGTH];
+    uint64_t slot; // DIR_INDEX_EMPTY or DIR_INDEX_DELETED if the bucket holds no name
+} dir_index_bucket;
+
+typedef struct
+{
+    uint32_t cluster; // first cluster of the directory, 0 for the fixed root directory of FAT12 and FAT16
+    bool valid;
+    uint64_t lastUse;
+
+    dir_index_bucket *buckets;
+    uint32_t capacity; // a power of two
+    uint32_t count;
+    uint32_t deleted; // buckets of removed names, they are dropped when the table grows
+
+    // Free slot hints, positions count the entries from the first one of the directory. The search for a free
+    // entry starts at firstFree instead of the first entry, which makes adding N entries O(N) instead of O(N^2).
+    uint32_t firstFree;        // no entry in front of this position is free
+    uint32_t firstFreeCluster; // cluster holding firstFree, not a data cluster if the directory is full
+    uint32_t end;              // no entry at or behind this position is used, UINT32_MAX if unknown
+} dir_index;
+
+typedef struct
+{
+    dir_index indexes[DIR_INDEX_DIRECTORIES];
+    uint64_t clock;
+} dir_index_cache;
+
+// The result of looking up a name in a directory: the slot of its entry, or DENTRY_NEGATIVE if the directory
+// has no entry of that name.
+typedef struct
+{
+    uint32_t parent; // first cluster of the directory, 0 for the fixed root directory of FAT12 and FAT16
+    char name[FILENAME_LENGTH];
+    bool valid;
+    uint64_t slot;
+    uint64_t lastUse;
+} dentry;
+
+// A bounded cache of the lookups of the path components of resolvePath(), keyed by the directory and the
+// 8.3 name. Unlike the index of a directory, a dentry does not need the whole directory to be scanned first,
+// so deep paths through many directories resolve with a few probes. The cache is set associative, a new
+// dentry replaces the least recently used one of its set.
+typedef struct
+{
+    dentry sets[DENTRY_CACHE_SETS][DENTRY_CACHE_WAYS];
+    uint64_t clock;
+} dentry_cache;
+
+/**
+ * Returns the index of the directory starting at cluster, NULL if it has not been built.
+ */
+dir_index *dir_index_find(dir_index_cache *cache, uint32_t cluster);
+
+/**
+ * Returns an empty index for the directory starting at cluster, replacing the least recently used one.
+ * The caller fills it with dir_index_insert() and drops it again if that fails.
+ */
+dir_index *dir_index_create(dir_index_cache *cache, uint32_t cluster);
+
+/**
+ * Adds the name with the slot of its entry, a name that is in the index already keeps its first slot,
+ * as the first entry of that name is the one a scan of the directory finds.
+ *
+ * return - 0 on success, -4 if out of memory
+ */
+int dir_index_insert(dir_index *index, const char *name, uint64_t slot);
+
+/**
+ * Looks up the slot of the entry with the name.
+ *
+ * return - true if the name is in the index
+ */
+bool dir_index_lookup(const dir_index *index, const char *name, uint64_t *slot);
+
+/**
+ * Removes the name from the index.
+ */
+void dir_index_remove(dir_index *index, const char *name);
+
+/**
+ * Forgets the index of the directory starting at cluster, e.g. because the directory was deleted
+ * and its clusters can be reused.
+ */
+void dir_index_drop(dir_index_cache *cache, uint32_t cluster);
+
+/**
+ * Forgets the indexes of all directories and releases their memory.
+ */
+void dir_index_clear(dir_index_cache *cache);
+
+/**
+ * Looks up the name in the directory starting at parent.
+ *
+ * return - true if the lookup is cached, slot is DENTRY_NEGATIVE if the name does not exist
+ */
+bool dentry_cache_lookup(dentry_cache *cache, uint32_t parent, const char *name, uint64_t *slot);
+
+/**
+ * Remembers the slot of the name in the directory starting at parent, DENTRY_NEGATIVE if the name does not exist.
+ * A cached lookup of the same name is replaced.
+ */
+void dentry_cache_insert(dentry_cache *cache, uint32_t parent, const char *name, uint64_t slot);
+
+/**
+ * Forgets the lookup of the name in the directory starting at parent.
+ */
+void dentry_cache_remove(dentry_cache *cache, uint32_t parent, const char *name);
+
+/**
+ * Forgets the lookups of all names in the directory starting at parent, e.g. because the directory was deleted.
+ */
+void dentry_cache_drop_parent(dentry_cache *cache, uint32_t parent);
+
+#endif
@@ -0,0 +1,274 @@
+#include "dirscan.h"
+#include "fat.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DIR_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// bytes of the entries
+#define ENTRY_SIZE 32
+
+// bytes of a name that take part in the comparison, the NUL byte that ends a shorter name included
+static uint32_t compareLength(const char *name)
+{
+    uint32_t length = 0;
+    while (length < FILENAME_LENGTH && name[length] != '\0')
+    {
+        length++;
+    }
+
+    return length < FILENAME_LENGTH ? length + 1 : FILENAME_LENGTH;
+}
+
+static uint64_t validMask(uint32_t count)
+{
+    return count >= 64 ? UINT64_MAX : (1ULL << count) - 1;
+}
+
+static void slotsScalar(const uint8_t *entries, uint32_t i, uint32_t count, dir_slot_masks *masks)
+{
+    for (; i < count; i++)
+    {
+        uint8_t first = entries[(size_t)i * ENTRY_SIZE];
+        if (first == DIRECTORY_ENTRY_FREE)
+        {
+            masks->free |= 1ULL << i;
+        }
+        else if (first == DIRECTORY_ENTRY_LAST)
+        {
+            masks->end |= 1ULL << i;
+        }
+    }
+}
+
+static uint64_t matchScalar(const uint8_t *entries, uint32_t i, uint32_t count, const char *name, uint32_t length)
+{
+    uint64_t matches = 0;
+    for (; i < count; i++)
+    {
+        if (memcmp(entries + (size_t)i * ENTRY_SIZE, name, length) == 0)
+        {
+            matches |= 1ULL << i;
+        }
+    }
+
+    return matches;
+}
+
+#ifdef DIR_SCAN_X86
+
+// Classification: the first bytes are 32 bytes apart. SSE2 loads 16 entries and interleaves their bytes with
+// unpack instructions until the 16 first bytes share one register, which is compared with 0xE5 and 0x00 at once.
+// AVX2 does the same with entry i in the low and entry i + 16 in the high lane, 32 entries per step. movemask
+// turns the bytes into bits. (Gathering the first dwords with vpgatherdd was measured slower than the unpacks.)
+//
+// Names: the first 16 bytes of an entry (name, attributes and reserved bytes) are compared with the name padded
+// to 16 bytes, only the bits of the bytes that take part in the comparison have to be set. The lookups scan a
+// sector at a time, so the setup has to be cheap as well. The AVX2 kernel compares names with the SSE2 loop,
+// two entries in the lanes of one 256 bit register were not faster.
+
+// the name padded to 16 bytes, byteMask receives the bits of the bytes that take part in the comparison
+__attribute__((target("sse2"))) static __m128i loadTarget(const char *name, uint32_t *byteMask)
+{
+    uint8_t padded[16] = {0};
+    memcpy(padded, name, FILENAME_LENGTH);
+    __m128i target = _mm_loadu_si128((const __m128i *)padded);
+
+    // up to and including the first NUL byte
+    uint32_t nul = _mm_movemask_epi8(_mm_cmpeq_epi8(target, _mm_setzero_si128())) & ((1u << FILENAME_LENGTH) - 1);
+    *byteMask = nul != 0 ? ((nul & -nul) << 1) - 1 : (1u << FILENAME_LENGTH) - 1;
+
+    return target;
+}
+
+// the first bytes of 4 entries in the lowest dword
+__attribute__((target("sse2"))) static __m128i firstBytes4(const uint8_t *in)
+{
+    __m128i e0 = _mm_loadu_si128((const __m128i *)in);
+    __m128i e1 = _mm_loadu_si128((const __m128i *)(in + ENTRY_SIZE));
+    __m128i e2 = _mm_loadu_si128((const __m128i *)(in + 2 * ENTRY_SIZE));
+    __m128i e3 = _mm_loadu_si128((const __m128i *)(in + 3 * ENTRY_SIZE));
+
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(e0, e1), _mm_unpacklo_epi8(e2, e3));
+}
+
+__attribute__((target("sse2"))) static void slotsSse2(const uint8_t *entries, uint32_t i, uint32_t count, dir_slot_masks *masks)
+{
+    const __m128i freeMarker = _mm_set1_epi8((char)DIRECTORY_ENTRY_FREE);
+    const __m128i endMarker = _mm_set1_epi8(DIRECTORY_ENTRY_LAST);
+
+    for (; i + 16 <= count; i += 16)
+    {
+        const uint8_t *in = entries + (size_t)i * ENTRY_SIZE;
+        __m128i low = _mm_unpacklo_epi32(firstBytes4(in), firstBytes4(in + 4 * ENTRY_SIZE));
+        __m128i high = _mm_unpacklo_epi32(firstBytes4(in + 8 * ENTRY_SIZE), firstBytes4(in + 12 * ENTRY_SIZE));
+        __m128i first = _mm_unpacklo_epi64(low, high);
+        masks->free |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(first, freeMarker)) << i;
+        masks->end |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(first, endMarker)) << i;
+    }
+
+    slotsScalar(entries, i, count, masks);
+}
+
+__attribute__((target("sse2"))) static uint64_t matchSse2(const uint8_t *entries, uint32_t count, const char *name)
+{
+    uint32_t byteMask;
+    const __m128i target = loadTarget(name, &byteMask);
+
+    uint64_t matches = 0;
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const uint8_t *in = entries + (size_t)i * ENTRY_SIZE;
+        uint32_t equal0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)in), target));
+        uint32_t equal1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(in + ENTRY_SIZE)), target));
+        uint32_t equal2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(in + 2 * ENTRY_SIZE)), target));
+        uint32_t equal3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(in + 3 * ENTRY_SIZE)), target));
+        uint64_t group = ((equal0 & byteMask) == byteMask) | ((equal1 & byteMask) == byteMask) << 1 |
+                         ((equal2 & byteMask) == byteMask) << 2 | ((equal3 & byteMask) == byteMask) << 3;
+        matches |= group << i;
+    }
+
+    return matches | matchScalar(entries, i, count, name, __builtin_popcount(byteMask));
+}
+
+// entry i in the low lane, entry i + 16 in the high lane
+__attribute__((target("avx2"))) static __m256i loadPair(const uint8_t *in)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+                                   _mm_loadu_si128((const __m128i *)(in + 16 * ENTRY_SIZE)), 1);
+}
+
+// the first bytes of 4 entries in the lowest dword of both lanes
+__attribute__((target("avx2"))) static __m256i firstBytes4x2(const uint8_t *in)
+{
+    __m256i e0 = loadPair(in);
+    __m256i e1 = loadPair(in + ENTRY_SIZE);
+    __m256i e2 = loadPair(in + 2 * ENTRY_SIZE);
+    __m256i e3 = loadPair(in + 3 * ENTRY_SIZE);
+
+    return _mm256_unpacklo_epi16(_mm256_unpacklo_epi8(e0, e1), _mm256_unpacklo_epi8(e2, e3));
+}
+
+__attribute__((target("avx2"))) static void slotsAvx2(const uint8_t *entries, uint32_t count, dir_slot_masks *masks)
+{
+    const __m256i freeMarker = _mm256_set1_epi8((char)DIRECTORY_ENTRY_FREE);
+    const __m256i endMarker = _mm256_set1_epi8(DIRECTORY_ENTRY_LAST);
+
+    uint32_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        const uint8_t *in = entries + (size_t)i * ENTRY_SIZE;
+        __m256i low = _mm256_unpacklo_epi32(firstBytes4x2(in), firstBytes4x2(in + 4 * ENTRY_SIZE));
+        __m256i high = _mm256_unpacklo_epi32(firstBytes4x2(in + 8 * ENTRY_SIZE), firstBytes4x2(in + 12 * ENTRY_SIZE));
+        __m256i first = _mm256_unpacklo_epi64(low, high);
+        masks->free |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(first, freeMarker)) << i;
+        masks->end |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(first, endMarker)) << i;
+    }
+
+    // a sector of 512 bytes holds 16 entries
+    slotsSse2(entries, i, count, masks);
+}
+
+#endif
+
+int dir_scan_kernel_supported(dir_scan_kernel kernel)
+{
+    switch (kernel)
+    {
+    case DIR_SCAN_KERNEL_SCALAR:
+        return 1;
+#ifdef DIR_SCAN_X86
+    case DIR_SCAN_KERNEL_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case DIR_SCAN_KERNEL_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+dir_scan_kernel dir_scan_best_kernel(void)
+{
+    static int best = -1;
+    if (best < 0)
+    {
+        best = DIR_SCAN_KERNEL_SCALAR;
+        for (int kernel = DIR_SCAN_KERNEL_SCALAR + 1; kernel < DIR_SCAN_KERNEL_COUNT; kernel++)
+        {
+            if (dir_scan_kernel_supported((dir_scan_kernel)kernel))
+            {
+                best = kernel;
+            }
+        }
+    }
+
+    return (dir_scan_kernel)best;
+}
+
+const char *dir_scan_kernel_name(dir_scan_kernel kernel)
+{
+    switch (kernel)
+    {
+    case DIR_SCAN_KERNEL_SCALAR:
+        return "scalar";
+    case DIR_SCAN_KERNEL_SSE2:
+        return "sse2";
+    case DIR_SCAN_KERNEL_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
+
+void dir_scan_slots_with(dir_scan_kernel kernel, const void *entries, uint32_t count, dir_slot_masks *masks)
+{
+    memset(masks, 0, sizeof(dir_slot_masks));
+
+    switch (kernel)
+    {
+#ifdef DIR_SCAN_X86
+    case DIR_SCAN_KERNEL_SSE2:
+        slotsSse2((const uint8_t *)entries, 0, count, masks);
+        break;
+    case DIR_SCAN_KERNEL_AVX2:
+        slotsAvx2((const uint8_t *)entries, count, masks);
+        break;
+#endif
+    default:
+        slotsScalar((const uint8_t *)entries, 0, count, masks);
+        break;
+    }
+
+    masks->used = validMask(count) & ~(masks->free | masks->end);
+}
+
+uint64_t dir_scan_match_with(dir_scan_kernel kernel, const void *entries, uint32_t count, const char *name)
+{
+    switch (kernel)
+    {
+#ifdef DIR_SCAN_X86
+    case DIR_SCAN_KERNEL_SSE2:
+    case DIR_SCAN_KERNEL_AVX2:
+        return matchSse2((const uint8_t *)entries, count, name);
+#endif
+    default:
+        return matchScalar((const uint8_t *)entries, 0, count, name, compareLength(name));
+    }
+}
+
+void dir_scan_slots(const void *entries, uint32_t count, dir_slot_masks *masks)
+{
+    dir_scan_slots_with(dir_scan_best_kernel(), entries, count, masks);
+}
+
+uint64_t dir_scan_match(const void *entries, uint32_t count, const char *name)
+{
+    return dir_scan_match_with(dir_scan_best_kernel(), entries, count, name);
+}
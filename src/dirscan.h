@@ -0,0 +1,67 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include <inttypes.h>
+
+// Scans of the 32 byte entries of a directory sector. Instead of testing entry after entry, the first bytes
+// of a group of entries are classified into bitmasks of free (0xE5), end (0x00) and used slots, and a name is
+// compared against all entries of the group at once. Bit i of a mask stands for entry i of the group.
+// Besides the scalar loop there are SSE2 (16 first bytes or 4 names per step) and AVX2 (32 first bytes per step)
+// kernels, the best one supported by the CPU is picked at runtime.
+
+// entries covered by one set of masks, sectors of more than 2048 bytes are scanned in several groups
+#define DIR_SCAN_GROUP 64
+
+typedef enum
+{
+    DIR_SCAN_KERNEL_SCALAR,
+    DIR_SCAN_KERNEL_SSE2,
+    DIR_SCAN_KERNEL_AVX2,
+    DIR_SCAN_KERNEL_COUNT
+} dir_scan_kernel;
+
+typedef struct
+{
+    uint64_t free; // first byte 0xE5
+    uint64_t end;  // first byte 0x00, this entry and all behind it are free
+    uint64_t used;
+} dir_slot_masks;
+
+/**
+ * Returns the fastest kernel the CPU supports.
+ */
+dir_scan_kernel dir_scan_best_kernel(void);
+
+/**
+ * Returns true if the CPU can execute the kernel.
+ */
+int dir_scan_kernel_supported(dir_scan_kernel kernel);
+
+/**
+ * Returns a printable name of the kernel.
+ */
+const char *dir_scan_kernel_name(dir_scan_kernel kernel);
+
+/**
+ * Classifies count (at most DIR_SCAN_GROUP) directory entries by their first byte.
+ */
+void dir_scan_slots(const void *entries, uint32_t count, dir_slot_masks *masks);
+void dir_scan_slots_with(dir_scan_kernel kernel, const void *entries, uint32_t count, dir_slot_masks *masks);
+
+/**
+ * Returns the mask of the entries among count (at most DIR_SCAN_GROUP) whose 11 byte name equals name,
+ * compared like strncmp() does, up to the first NUL byte. Free entries are not excluded, see dir_scan_live().
+ */
+uint64_t dir_scan_match(const void *entries, uint32_t count, const char *name);
+uint64_t dir_scan_match_with(dir_scan_kernel kernel, const void *entries, uint32_t count, const char *name);
+
+/**
+ * Returns the used entries in front of the first end marker, the entries a scan of the group looks at.
+ */
+static inline uint64_t dir_scan_live(const dir_slot_masks *masks)
+{
+    uint64_t beforeEnd = masks->end == 0 ? UINT64_MAX : (masks->end & -masks->end) - 1;
+    return masks->used & beforeEnd;
+}
+
+#endif
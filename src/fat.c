@@ -145,13 +145,13 @@ void filenameToFatElevenThree(const char *filename, char *out, int outLen)
         return;
     }
 
-    // allocate buffer and initialize with zero
-    char *newBuffer = (char *)malloc(sizeof(char) * stringLength);
+    // allocate buffer and initialize with zero, one more byte for the null terminator
+    char *newBuffer = (char *)malloc(sizeof(char) * (stringLength + 1));
     if (newBuffer == NULL)
     {
         return;
     }
-    memset(newBuffer, 0, stringLength);
+    memset(newBuffer, 0, stringLength + 1);
 
     // trim leading space and dots
     unsigned char currentChar = *filename;
@@ -162,6 +162,7 @@ void filenameToFatElevenThree(const char *filename, char *out, int outLen)
     }
     if (*filename == 0) // All spaces?
     {
+        free(newBuffer);
         return;
     }
 
@@ -192,6 +193,7 @@ void filenameToFatElevenThree(const char *filename, char *out, int outLen)
 
         to_upper(out, out, out_size);
 
+        free(newBuffer);
         return;
     }
 
@@ -339,3 +341,43 @@ void filenameToFatElevenThree(const char *filename, char *out, int outLen)
 
     free(newBuffer);
 }
+
+// converts a padded 8.3 name of a directory entry back into a name like FILE.TXT, the output holds up to
+// 12 characters and the null terminator. Characters that cannot be part of a host filename become underscores.
+void fatElevenThreeToFilename(const unsigned char *name, char *out, int outLen)
+{
+    char converted[12];
+    int length = 0;
+
+    for (int i = 0; i < 8 && name[i] != ' '; i++)
+    {
+        // 0x05 stands for a leading 0xE5, which marks free entries otherwise
+        unsigned char c = i == 0 && name[i] == 0x05 ? 0xE5 : name[i];
+        converted[length++] = c == '/' || c == 0 ? '_' : c;
+    }
+    if (name[8] != ' ')
+    {
+        converted[length++] = '.';
+        for (int i = 8; i < 11 && name[i] != ' '; i++)
+        {
+            converted[length++] = name[i] == '/' || name[i] == 0 ? '_' : name[i];
+        }
+    }
+
+    for (int i = 0; i < outLen; i++)
+    {
+        out[i] = i < length && i < outLen - 1 ? converted[i] : 0;
+    }
+}
+
+// the size of one FAT, FAT32 volumes store it in the extended part of the bios parameter block
+uint32_t sectorsPerFat(const bios_parameter_block *bpb)
+{
+    return bpb->secPerFat != 0 ? bpb->secPerFat : bpb->secPerFat32;
+}
+
+// the size of the volume, totSec32 is only used if the value does not fit into totSec16
+uint32_t totalSectors(const bios_parameter_block *bpb)
+{
+    return bpb->totSec16 != 0 ? bpb->totSec16 : bpb->totSec32;
+}
@@ -7,11 +7,22 @@
 #include <stdlib.h>
 #include <ctype.h>
 
-#define DIR_ENTRIES_PER_SECTOR 16
+#define FAT12_RESERVED_CLUSTER 0xFF0
 #define FAT12_DEFECTIVE_CLUSTER 0xFF7
 #define FAT12_LAST_CLUSTER_IN_CHAIN 0xFFF
 #define FAT12_FREE_CLUSTER 0x000
 
+#define FAT16_RESERVED_CLUSTER 0xFFF0
+#define FAT16_DEFECTIVE_CLUSTER 0xFFF7
+#define FAT16_LAST_CLUSTER_IN_CHAIN 0xFFFF
+
+// cluster numbers are 28 bits wide, the markers of every FAT type are kept in their FAT32 form in memory
+#define FAT_CLUSTER_MASK 0x0FFFFFFF
+#define FAT_FREE_CLUSTER 0x00000000
+#define FAT_RESERVED_CLUSTER 0x0FFFFFF0
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+#define FAT_END_OF_CHAIN 0x0FFFFFFF
+
 #define FILENAME_LENGTH 11
 //#define FILENAME_LENGTH 12
 
@@ -49,13 +60,39 @@ typedef struct __attribute__((packed))
     uint16_t rootEntCnt;  // Root directory entry count
     uint16_t totSec16;    // Total logical sectors
     int8_t media;         // Media descriptor
-    int16_t secPerFat;    // Logical sectors per FAT
+    uint16_t secPerFat;   // Logical sectors per FAT
     int16_t secPerTrack;
     int16_t numHeads;
-    int32_t hiddSec;
-    int32_t totSec32;
+    uint32_t hiddSec;
+    uint32_t totSec32;
+
+    // FAT32 only, on FAT12 and FAT16 volumes the following bytes hold the drive number and the volume id
+    uint32_t secPerFat32; // Logical sectors per FAT, secPerFat is 0
+    uint16_t extFlags;    // bit 7 set: only the FAT in bits 0 - 3 is active, the FAT is not mirrored
+    uint16_t fsVersion;
+    uint32_t rootClus;  // first cluster of the root directory
+    uint16_t fsInfo;    // sector of the FSInfo structure
+    uint16_t bkBootSec; // sector of the copy of the boot sector
 } bios_parameter_block;
 
+// FSInfo sector of a FAT32 volume, the counters are hints, 0xFFFFFFFF if unknown
+// http://elm-chan.org/docs/fat_e.html#fsinfo
+#define FSINFO_LEAD_SIGNATURE 0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_TRAIL_SIGNATURE 0xAA550000
+#define FSINFO_UNKNOWN 0xFFFFFFFF
+
+typedef struct __attribute__((packed))
+{
+    uint32_t leadSig;
+    unsigned char reserved1[480];
+    uint32_t structSig;
+    uint32_t freeCount; // free clusters
+    uint32_t nextFree;  // cluster behind the last allocated one
+    unsigned char reserved2[12];
+    uint32_t trailSig;
+} fs_info;
+
 // http://alexander.khleuven.be/courses/bs1/fat12/fat12.html
 // http://www.tavi.co.uk/phobos/fat.html#root_directory
 // this structure is 32 bytes
@@ -68,14 +105,17 @@ typedef struct __attribute__((packed))
     int16_t creation_time;
     int16_t creation_date;
     int16_t last_access_date;
-    int16_t reserved_for_fat32;
+    uint16_t first_cluster_high; // upper 16 bits of the first cluster, FAT32 only
     int16_t last_write_time;
     int16_t last_write_date;
-    int16_t first_logical_cluster; // the fat is indexed using logical cluster values
-    int32_t filesize;              // filesize in bytes
+    uint16_t first_logical_cluster; // the fat is indexed using logical cluster values
+    uint32_t filesize;              // filesize in bytes
 } directory_entry;
 
 void filenameToFatElevenThree(const char *filename, char *out, int outLen);
+void fatElevenThreeToFilename(const unsigned char *name, char *out, int outLen);
+uint32_t sectorsPerFat(const bios_parameter_block *bpb);
+uint32_t totalSectors(const bios_parameter_block *bpb);
 void numericalTruncate(char *out, char *input, int outBufferLen, int maxLength);
 void to_upper(char *out, char *input, int outBufferLen);
 
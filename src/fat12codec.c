@@ -0,0 +1,358 @@
+#include "fat12codec.h"
+#include "fat.h"
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FAT12_CODEC_X86 1
+#include <immintrin.h>
+#endif
+
+static void unpackScalar(const uint8_t *packed, uint16_t *entries, uint32_t i, uint32_t count)
+{
+    packed += (size_t)i / 2 * 3;
+    for (; i < count; i += 2)
+    {
+        uint32_t touple = packed[0] | (packed[1] << 8) | (packed[2] << 16);
+        entries[i] = touple & 0xFFF;
+        entries[i + 1] = touple >> 12;
+        packed += 3;
+    }
+}
+
+static void decodeScalar(const uint8_t *packed, uint32_t *entries, uint32_t i, uint32_t count)
+{
+    // the markers from 0xFF0 upwards get the upper 16 bits of their FAT32 form
+    const uint32_t widen = FAT_CLUSTER_MASK & ~0xFFFu;
+
+    packed += (size_t)i / 2 * 3;
+    for (; i < count; i += 2)
+    {
+        uint32_t touple = packed[0] | (packed[1] << 8) | (packed[2] << 16);
+        uint32_t even = touple & 0xFFF;
+        uint32_t odd = touple >> 12;
+        entries[i] = even >= FAT12_RESERVED_CLUSTER ? even | widen : even;
+        entries[i + 1] = odd >= FAT12_RESERVED_CLUSTER ? odd | widen : odd;
+        packed += 3;
+    }
+}
+
+static void packScalar(const uint16_t *entries, uint8_t *packed, uint32_t i, uint32_t count)
+{
+    packed += (size_t)i / 2 * 3;
+    for (; i < count; i += 2)
+    {
+        uint32_t touple = (entries[i] & 0xFFF) | ((uint32_t)(entries[i + 1] & 0xFFF) << 12);
+        packed[0] = touple & 0xFF;
+        packed[1] = (touple >> 8) & 0xFF;
+        packed[2] = touple >> 16;
+        packed += 3;
+    }
+}
+
+#ifdef FAT12_CODEC_X86
+
+// Unpacking: every 16 bit lane gathers the two bytes an entry overlaps, entry 2k starts at byte 3k (low 12 bits),
+// entry 2k + 1 at byte 3k + 1 (high 12 bits). Even lanes are masked, odd lanes shifted right by 4.
+//
+// Decoding: comparing the unpacked entries against 0xFF0 gives 0xFFFF for the markers and 0 for all other
+// entries. It fills the upper 4 bits of the 16 bit lanes and, interleaved with them, the upper half of the
+// 32 bit entries, the mask cuts them to 28 bits.
+//
+// Packing: pmaddwd combines each pair into e0 + e1 * 4096 (24 bits per 32 bit lane), pshufb drops the unused
+// fourth byte of every lane.
+//
+// The vector loads and stores touch up to 4 (SSSE3) or 8 (AVX2) bytes behind the tuples of an iteration,
+// the loops stop early enough to stay inside the buffers and the scalar loop finishes the rest.
+
+__attribute__((target("ssse3"))) static __m128i unpack8(const uint8_t *packed)
+{
+    const __m128i gather = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i evenMask = _mm_setr_epi16(0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0);
+    const __m128i oddMask = _mm_setr_epi16(0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF);
+
+    __m128i lanes = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)packed), gather);
+
+    return _mm_or_si128(_mm_and_si128(lanes, evenMask), _mm_and_si128(_mm_srli_epi16(lanes, 4), oddMask));
+}
+
+__attribute__((target("ssse3"))) static void widen8(__m128i narrow, uint32_t *entries)
+{
+    const __m128i reserved = _mm_set1_epi16(FAT12_RESERVED_CLUSTER - 1);
+    const __m128i mask = _mm_set1_epi32(FAT_CLUSTER_MASK);
+
+    __m128i markers = _mm_cmpgt_epi16(narrow, reserved);
+    narrow = _mm_or_si128(narrow, _mm_slli_epi16(markers, 12));
+
+    _mm_storeu_si128((__m128i *)entries, _mm_and_si128(_mm_unpacklo_epi16(narrow, markers), mask));
+    _mm_storeu_si128((__m128i *)(entries + 4), _mm_and_si128(_mm_unpackhi_epi16(narrow, markers), mask));
+}
+
+__attribute__((target("ssse3"))) static __m128i pack8(__m128i entries)
+{
+    const __m128i mask = _mm_set1_epi16(0x0FFF);
+    const __m128i shift = _mm_setr_epi16(1, 4096, 1, 4096, 1, 4096, 1, 4096);
+    const __m128i compact = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    __m128i pairs = _mm_madd_epi16(_mm_and_si128(entries, mask), shift);
+
+    return _mm_shuffle_epi8(pairs, compact);
+}
+
+__attribute__((target("ssse3"))) static void unpackSsse3(const uint8_t *packed, uint16_t *entries, uint32_t count)
+{
+    uint32_t i = 0;
+
+    // reads 28 bytes per iteration
+    for (; i + 20 <= count; i += 16)
+    {
+        const uint8_t *in = packed + (size_t)i / 2 * 3;
+        _mm_storeu_si128((__m128i *)(entries + i), unpack8(in));
+        _mm_storeu_si128((__m128i *)(entries + i + 8), unpack8(in + 12));
+    }
+
+    unpackScalar(packed, entries, i, count);
+}
+
+__attribute__((target("ssse3"))) static void decodeSsse3(const uint8_t *packed, uint32_t *entries, uint32_t count)
+{
+    uint32_t i = 0;
+
+    // reads 28 bytes per iteration
+    for (; i + 20 <= count; i += 16)
+    {
+        const uint8_t *in = packed + (size_t)i / 2 * 3;
+        widen8(unpack8(in), entries + i);
+        widen8(unpack8(in + 12), entries + i + 8);
+    }
+
+    decodeScalar(packed, entries, i, count);
+}
+
+__attribute__((target("ssse3"))) static void packSsse3(const uint16_t *entries, uint8_t *packed, uint32_t count)
+{
+    uint32_t i = 0;
+
+    // writes 28 bytes per iteration, the second store overwrites the padding of the first one
+    for (; i + 20 <= count; i += 16)
+    {
+        uint8_t *out = packed + (size_t)i / 2 * 3;
+        _mm_storeu_si128((__m128i *)out, pack8(_mm_loadu_si128((const __m128i *)(entries + i))));
+        _mm_storeu_si128((__m128i *)(out + 12), pack8(_mm_loadu_si128((const __m128i *)(entries + i + 8))));
+    }
+
+    packScalar(entries, packed, i, count);
+}
+
+__attribute__((target("avx2"))) static __m256i unpack16(const uint8_t *packed)
+{
+    // the low lane works on bytes 0 - 15, the high lane on bytes 12 - 27
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i gather = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+                                            0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m256i evenMask = _mm256_set1_epi32(0x00000FFF);
+    const __m256i oddMask = _mm256_set1_epi32(0x0FFF0000);
+
+    __m256i lanes = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)packed), spread);
+    lanes = _mm256_shuffle_epi8(lanes, gather);
+
+    return _mm256_or_si256(_mm256_and_si256(lanes, evenMask), _mm256_and_si256(_mm256_srli_epi16(lanes, 4), oddMask));
+}
+
+__attribute__((target("avx2"))) static void widen16(__m256i narrow, uint32_t *entries)
+{
+    const __m256i reserved = _mm256_set1_epi16(FAT12_RESERVED_CLUSTER - 1);
+    const __m256i mask = _mm256_set1_epi32(FAT_CLUSTER_MASK);
+
+    __m256i markers = _mm256_cmpgt_epi16(narrow, reserved);
+    narrow = _mm256_or_si256(narrow, _mm256_slli_epi16(markers, 12));
+
+    // the interleaving works per 128 bit lane, low holds entries 0 - 3 and 8 - 11, high entries 4 - 7 and 12 - 15
+    __m256i low = _mm256_and_si256(_mm256_unpacklo_epi16(narrow, markers), mask);
+    __m256i high = _mm256_and_si256(_mm256_unpackhi_epi16(narrow, markers), mask);
+
+    _mm256_storeu_si256((__m256i *)entries, _mm256_permute2x128_si256(low, high, 0x20));
+    _mm256_storeu_si256((__m256i *)(entries + 8), _mm256_permute2x128_si256(low, high, 0x31));
+}
+
+__attribute__((target("avx2"))) static __m256i pack16(__m256i entries)
+{
+    const __m256i mask = _mm256_set1_epi16(0x0FFF);
+    const __m256i shift = _mm256_set1_epi32(4096 << 16 | 1);
+    const __m256i compact = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    // moves the 12 bytes of the high lane right behind the 12 bytes of the low lane
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    __m256i pairs = _mm256_madd_epi16(_mm256_and_si256(entries, mask), shift);
+
+    return _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pairs, compact), join);
+}
+
+__attribute__((target("avx2"))) static void unpackAvx2(const uint8_t *packed, uint16_t *entries, uint32_t count)
+{
+    uint32_t i = 0;
+
+    // reads 56 bytes per iteration
+    for (; i + 38 <= count; i += 32)
+    {
+        const uint8_t *in = packed + (size_t)i / 2 * 3;
+        _mm256_storeu_si256((__m256i *)(entries + i), unpack16(in));
+        _mm256_storeu_si256((__m256i *)(entries + i + 16), unpack16(in + 24));
+    }
+
+    unpackScalar(packed, entries, i, count);
+}
+
+__attribute__((target("avx2"))) static void decodeAvx2(const uint8_t *packed, uint32_t *entries, uint32_t count)
+{
+    uint32_t i = 0;
+
+    // reads 56 bytes per iteration
+    for (; i + 38 <= count; i += 32)
+    {
+        const uint8_t *in = packed + (size_t)i / 2 * 3;
+        widen16(unpack16(in), entries + i);
+        widen16(unpack16(in + 24), entries + i + 16);
+    }
+
+    decodeScalar(packed, entries, i, count);
+}
+
+__attribute__((target("avx2"))) static void packAvx2(const uint16_t *entries, uint8_t *packed, uint32_t count)
+{
+    uint32_t i = 0;
+
+    // writes 56 bytes per iteration, the second store overwrites the padding of the first one
+    for (; i + 38 <= count; i += 32)
+    {
+        uint8_t *out = packed + (size_t)i / 2 * 3;
+        _mm256_storeu_si256((__m256i *)out, pack16(_mm256_loadu_si256((const __m256i *)(entries + i))));
+        _mm256_storeu_si256((__m256i *)(out + 24), pack16(_mm256_loadu_si256((const __m256i *)(entries + i + 16))));
+    }
+
+    packScalar(entries, packed, i, count);
+}
+
+#endif
+
+int fat12_kernel_supported(fat12_kernel kernel)
+{
+    switch (kernel)
+    {
+    case FAT12_KERNEL_SCALAR:
+        return 1;
+#ifdef FAT12_CODEC_X86
+    case FAT12_KERNEL_SSSE3:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+    case FAT12_KERNEL_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+fat12_kernel fat12_best_kernel(void)
+{
+    static int best = -1;
+    if (best < 0)
+    {
+        best = FAT12_KERNEL_SCALAR;
+        for (int kernel = FAT12_KERNEL_SCALAR + 1; kernel < FAT12_KERNEL_COUNT; kernel++)
+        {
+            if (fat12_kernel_supported((fat12_kernel)kernel))
+            {
+                best = kernel;
+            }
+        }
+    }
+
+    return (fat12_kernel)best;
+}
+
+const char *fat12_kernel_name(fat12_kernel kernel)
+{
+    switch (kernel)
+    {
+    case FAT12_KERNEL_SCALAR:
+        return "scalar";
+    case FAT12_KERNEL_SSSE3:
+        return "ssse3";
+    case FAT12_KERNEL_AVX2:
+        return "avx2";
+    default:
+        return "unknown";
+    }
+}
+
+void fat12_unpack_with(fat12_kernel kernel, const uint8_t *packed, uint16_t *entries, uint32_t count)
+{
+    switch (kernel)
+    {
+#ifdef FAT12_CODEC_X86
+    case FAT12_KERNEL_SSSE3:
+        unpackSsse3(packed, entries, count);
+        break;
+    case FAT12_KERNEL_AVX2:
+        unpackAvx2(packed, entries, count);
+        break;
+#endif
+    default:
+        unpackScalar(packed, entries, 0, count);
+        break;
+    }
+}
+
+void fat12_decode_with(fat12_kernel kernel, const uint8_t *packed, uint32_t *entries, uint32_t count)
+{
+    switch (kernel)
+    {
+#ifdef FAT12_CODEC_X86
+    case FAT12_KERNEL_SSSE3:
+        decodeSsse3(packed, entries, count);
+        break;
+    case FAT12_KERNEL_AVX2:
+        decodeAvx2(packed, entries, count);
+        break;
+#endif
+    default:
+        decodeScalar(packed, entries, 0, count);
+        break;
+    }
+}
+
+void fat12_pack_with(fat12_kernel kernel, const uint16_t *entries, uint8_t *packed, uint32_t count)
+{
+    switch (kernel)
+    {
+#ifdef FAT12_CODEC_X86
+    case FAT12_KERNEL_SSSE3:
+        packSsse3(entries, packed, count);
+        break;
+    case FAT12_KERNEL_AVX2:
+        packAvx2(entries, packed, count);
+        break;
+#endif
+    default:
+        packScalar(entries, packed, 0, count);
+        break;
+    }
+}
+
+void fat12_unpack(const uint8_t *packed, uint16_t *entries, uint32_t count)
+{
+    fat12_unpack_with(fat12_best_kernel(), packed, entries, count);
+}
+
+void fat12_decode(const uint8_t *packed, uint32_t *entries, uint32_t count)
+{
+    fat12_decode_with(fat12_best_kernel(), packed, entries, count);
+}
+
+void fat12_pack(const uint16_t *entries, uint8_t *packed, uint32_t count)
+{
+    fat12_pack_with(fat12_best_kernel(), entries, packed, count);
+}
@@ -0,0 +1,53 @@
+#ifndef FAT12CODEC_H
+#define FAT12CODEC_H
+
+#include <inttypes.h>
+
+// Conversion between the packed 12 bit encoding of a FAT12 (3 bytes per pair of entries) and one uint16_t
+// per entry, or one uint32_t per entry in the decoded form of fatcodec.h. Besides the scalar loop there are SSSE3 (16 entries per iteration) and AVX2 (32 entries per
+// iteration) kernels, the best one supported by the CPU is picked at runtime.
+
+typedef enum
+{
+    FAT12_KERNEL_SCALAR,
+    FAT12_KERNEL_SSSE3,
+    FAT12_KERNEL_AVX2,
+    FAT12_KERNEL_COUNT
+} fat12_kernel;
+
+/**
+ * Returns the fastest kernel the CPU supports.
+ */
+fat12_kernel fat12_best_kernel(void);
+
+/**
+ * Returns true if the CPU can execute the kernel.
+ */
+int fat12_kernel_supported(fat12_kernel kernel);
+
+/**
+ * Returns a printable name of the kernel.
+ */
+const char *fat12_kernel_name(fat12_kernel kernel);
+
+/**
+ * Unpacks count entries (count has to be even) from count * 3 / 2 bytes.
+ */
+void fat12_unpack(const uint8_t *packed, uint16_t *entries, uint32_t count);
+void fat12_unpack_with(fat12_kernel kernel, const uint8_t *packed, uint16_t *entries, uint32_t count);
+
+/**
+ * Unpacks count entries (count has to be even) from count * 3 / 2 bytes into uint32_t, the values 0xFF0 - 0xFFF
+ * (reserved, bad cluster, end of chain) are widened to 0x0FFFFFF0 - 0x0FFFFFFF.
+ */
+void fat12_decode(const uint8_t *packed, uint32_t *entries, uint32_t count);
+void fat12_decode_with(fat12_kernel kernel, const uint8_t *packed, uint32_t *entries, uint32_t count);
+
+/**
+ * Packs count entries (count has to be even) into count * 3 / 2 bytes. Only the low 12 bits of every
+ * entry are stored.
+ */
+void fat12_pack(const uint16_t *entries, uint8_t *packed, uint32_t count);
+void fat12_pack_with(fat12_kernel kernel, const uint16_t *entries, uint8_t *packed, uint32_t count);
+
+#endif
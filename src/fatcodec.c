@@ -0,0 +1,66 @@
+#include "fatcodec.h"
+#include "fat.h"
+#include "fat12codec.h"
+
+#include <stddef.h>
+
+// entries encoded per step of the FAT12 codec, the 12 bit packing kernels work on uint16_t
+#define FAT12_CODEC_CHUNK 256
+
+static void decode12(const uint8_t *packed, uint32_t *entries, uint32_t count)
+{
+    // the kernels widen the markers themselves
+    fat12_decode(packed, entries, count);
+}
+
+static void encode12(const uint32_t *entries, uint8_t *packed, uint32_t count)
+{
+    uint16_t narrow[FAT12_CODEC_CHUNK];
+    for (uint32_t first = 0; first < count; first += FAT12_CODEC_CHUNK)
+    {
+        uint32_t chunk = count - first < FAT12_CODEC_CHUNK ? count - first : FAT12_CODEC_CHUNK;
+
+        // cluster numbers of a FAT12 volume fit into 12 bits, the markers lose their upper bits
+        for (uint32_t i = 0; i < chunk; i++)
+        {
+            narrow[i] = entries[first + i] & 0xFFF;
+        }
+        fat12_pack(narrow, packed + (size_t)first / 2 * 3, chunk);
+    }
+}
+
+static void decode16(const uint8_t *packed, uint32_t *entries, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t entry = packed[2 * i] | (uint32_t)packed[2 * i + 1] << 8;
+        entries[i] = entry >= FAT16_RESERVED_CLUSTER ? entry | (FAT_CLUSTER_MASK & ~0xFFFFu) : entry;
+    }
+}
+
+static void encode16(const uint32_t *entries, uint8_t *packed, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        packed[2 * i] = entries[i] & 0xFF;
+        packed[2 * i + 1] = (entries[i] >> 8) & 0xFF;
+    }
+}
+
+const fat_entry_codec fat12_entry_codec = {"FAT12", 12, 2, 3, decode12, encode12};
+const fat_entry_codec fat16_entry_codec = {"FAT16", 16, 1, 2, decode16, encode16};
+
+const fat_entry_codec *fat_entry_codec_for(uint32_t countOfClusters)
+{
+    // FAT sub-type (FAT12, FAT16, FAT32) from http://elm-chan.org/docs/fat_e.html
+    if (countOfClusters <= 4085)
+    {
+        return &fat12_entry_codec;
+    }
+    if (countOfClusters <= 65525)
+    {
+        return &fat16_entry_codec;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef FATCODEC_H
+#define FATCODEC_H
+
+#include <inttypes.h>
+
+// Conversion between the entries of a FAT as they are stored on the volume and the decoded form of
+// fat_table: one uint32_t per cluster with 28 bit cluster numbers, the markers of every FAT type (the
+// reserved values, FAT_BAD_CLUSTER and FAT_END_OF_CHAIN) widened to 0x0FFFFFF0 - 0x0FFFFFFF.
+//
+// The codec is chosen once when the FAT is loaded, see fat_entry_codec_for(). Chain walks, allocations
+// and the removal of chains only work on decoded entries and never see the width of the encoding, the
+// codec is called when the FAT is loaded and when modified units are written back.
+typedef struct
+{
+    const char *name;
+    uint8_t entryBits;
+    // the smallest group of entries that can be written on its own, two entries share 3 bytes on FAT12
+    uint8_t unitEntries;
+    uint8_t unitBytes;
+
+    /**
+     * Decodes count entries (a multiple of unitEntries) from count / unitEntries * unitBytes bytes.
+     */
+    void (*decode)(const uint8_t *packed, uint32_t *entries, uint32_t count);
+
+    /**
+     * Encodes count entries (a multiple of unitEntries), the markers are narrowed to the width of the encoding.
+     */
+    void (*encode)(const uint32_t *entries, uint8_t *packed, uint32_t count);
+} fat_entry_codec;
+
+extern const fat_entry_codec fat12_entry_codec;
+extern const fat_entry_codec fat16_entry_codec;
+
+/**
+ * Returns the codec of the FAT type that a volume with the given count of data clusters has,
+ * NULL for FAT32 volumes.
+ */
+const fat_entry_codec *fat_entry_codec_for(uint32_t countOfClusters);
+
+#endif
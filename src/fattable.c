@@ -0,0 +1,721 @@
+#include "fattable.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int flushHook(void *context)
+{
+    return flush_fat_table((fat_table *)context);
+}
+
+// decodes the whole FAT of a FAT12 or FAT16 volume and builds the bitmap of free clusters
+static int decodeTable(fat_table *table, uint32_t clusters)
+{
+    table->entryBits = table->codec->entryBits;
+
+    // entries that fit into one FAT, on FAT12 every three bytes contain two entries
+    uint32_t units = table->sizeInBytes / table->codec->unitBytes;
+    table->entryCount = units * table->codec->unitEntries;
+
+    uint8_t *packed = (uint8_t *)malloc(units > 0 ? units * table->codec->unitBytes : 1);
+    table->entries = (uint32_t *)malloc((table->entryCount > 0 ? table->entryCount : 1) * sizeof(uint32_t));
+    table->dirtyMap = (uint64_t *)calloc(units / 64 + 1, sizeof(uint64_t));
+    table->freeMap = (uint64_t *)calloc(table->entryCount / 64 + 1, sizeof(uint64_t));
+    if (packed == NULL || table->entries == NULL || table->dirtyMap == NULL || table->freeMap == NULL)
+    {
+        free(packed);
+        free_fat_table(table);
+        return -4;
+    }
+
+    if (read_bytes(table->device, table->offset, packed, units * table->codec->unitBytes) != 0)
+    {
+        free(packed);
+        free_fat_table(table);
+        return -1;
+    }
+    table->codec->decode(packed, table->entries, table->entryCount);
+    free(packed);
+
+    // the FAT might have room for more entries than the data area has clusters
+    table->clusterCount = clusters + 2 < table->entryCount ? clusters + 2 : table->entryCount;
+
+    // cluster numbers from 0xFF0 (0xFFF0 on FAT16) upwards are reserved values and decode as markers
+    uint32_t reserved = (1u << table->entryBits) - 16;
+    if (table->clusterCount > reserved)
+    {
+        table->clusterCount = reserved;
+    }
+
+    for (uint32_t cluster = 2; cluster < table->clusterCount; cluster++)
+    {
+        if (table->entries[cluster] == FAT_FREE_CLUSTER)
+        {
+            table->freeMap[cluster / 64] |= 1ULL << (cluster % 64);
+            table->freeClusters++;
+        }
+    }
+    table->nextFree = 2;
+
+    return 0;
+}
+
+// returns a pointer to the FAT32 entry of the cluster in the given FAT copy, NULL if the sector cannot be read.
+// The pointer is valid until the next sector access.
+static uint8_t *lazyEntry(const fat_table *table, uint32_t cluster, int copy)
+{
+    off_t offset = table->offset + (off_t)copy * table->sizeInBytes + (off_t)cluster * 4;
+    char *ptr = get_sector(table->device, offset / table->device->sectorSize);
+
+    return ptr != NULL ? (uint8_t *)ptr + offset % table->device->sectorSize : NULL;
+}
+
+// returns the first free cluster of the FAT32 volume at or after start, wrapping around at the end of
+// the data area, every sector of the FAT is accessed once
+static int32_t findFreeLazy(const fat_table *table, uint32_t start)
+{
+    uint32_t entriesPerSector = table->device->sectorSize / 4;
+    uint32_t cluster = start >= 2 && start < table->clusterCount ? start : 2;
+    const uint8_t *entry = NULL;
+    for (uint32_t visited = 2; visited < table->clusterCount; visited++)
+    {
+        if (entry == NULL || cluster % entriesPerSector == 0)
+        {
+            entry = lazyEntry(table, cluster, 0);
+            if (entry == NULL)
+            {
+                return -1;
+            }
+        }
+
+        uint32_t value;
+        memcpy(&value, entry, sizeof(uint32_t));
+        if ((value & FAT_CLUSTER_MASK) == FAT_FREE_CLUSTER)
+        {
+            return (int32_t)cluster;
+        }
+
+        entry += 4;
+        if (++cluster == table->clusterCount)
+        {
+            cluster = 2;
+            entry = NULL;
+        }
+    }
+
+    return -1;
+}
+
+// counts the free clusters of a FAT32 volume, only needed if the FSInfo sector does not know them
+static int countFreeLazy(fat_table *table)
+{
+    uint32_t entriesPerSector = table->device->sectorSize / 4;
+    const uint8_t *entry = NULL;
+    table->freeClusters = 0;
+    for (uint32_t cluster = 2; cluster < table->clusterCount; cluster++)
+    {
+        if (entry == NULL || cluster % entriesPerSector == 0)
+        {
+            entry = lazyEntry(table, cluster, 0);
+            if (entry == NULL)
+            {
+                return -1;
+            }
+        }
+
+        uint32_t value;
+        memcpy(&value, entry, sizeof(uint32_t));
+        if ((value & FAT_CLUSTER_MASK) == FAT_FREE_CLUSTER)
+        {
+            table->freeClusters++;
+        }
+        entry += 4;
+    }
+
+    return 0;
+}
+
+// prepares the access of a FAT32 volume, nothing is read but the FSInfo sector
+static int openLazyTable(fat_table *table, const bios_parameter_block *bpb, uint32_t clusters)
+{
+    table->entryBits = 32;
+    table->entryCount = table->sizeInBytes / 4;
+    table->clusterCount = clusters + 2 < table->entryCount ? clusters + 2 : table->entryCount;
+
+    // with mirroring disabled, only the active FAT is used
+    if ((bpb->extFlags & 0x80) != 0)
+    {
+        table->offset += (off_t)(bpb->extFlags & 0x0F) * table->sizeInBytes;
+        table->numFats = 1;
+    }
+
+    uint32_t freeCount = FSINFO_UNKNOWN;
+    uint32_t nextFree = FSINFO_UNKNOWN;
+    fs_info info;
+    if (bpb->fsInfo != 0 && bpb->fsInfo < bpb->rsvdSecCnt &&
+        read_bytes(table->device, (off_t)bpb->fsInfo * bpb->bytesPerSec, &info, sizeof(fs_info)) == 0 &&
+        info.leadSig == FSINFO_LEAD_SIGNATURE && info.structSig == FSINFO_STRUCT_SIGNATURE && info.trailSig == FSINFO_TRAIL_SIGNATURE)
+    {
+        table->fsInfoSector = bpb->fsInfo;
+        freeCount = info.freeCount;
+        nextFree = info.nextFree;
+    }
+
+    // the counters are hints, unknown or impossible values are replaced
+    table->freeClusters = freeCount;
+    if (freeCount == FSINFO_UNKNOWN || freeCount > table->clusterCount - 2)
+    {
+        if (countFreeLazy(table) != 0)
+        {
+            return -1;
+        }
+        table->fsInfoDirty = true;
+    }
+    table->nextFree = nextFree >= 2 && nextFree < table->clusterCount ? nextFree : 2;
+
+    return 0;
+}
+
+int load_fat_table(fat_table *table, block_device *device, const bios_parameter_block *bpb)
+{
+    memset(table, 0, sizeof(fat_table));
+    table->device = device;
+    table->offset = (off_t)bpb->rsvdSecCnt * bpb->bytesPerSec;
+    table->sizeInBytes = sectorsPerFat(bpb) * bpb->bytesPerSec;
+    table->numFats = bpb->numFats;
+
+    // the FAT type follows from the count of clusters in the data area
+    uint32_t rootDirSectors = (32 * bpb->rootEntCnt + bpb->bytesPerSec - 1) / bpb->bytesPerSec;
+    uint64_t dataStartSector = bpb->rsvdSecCnt + (uint64_t)bpb->numFats * sectorsPerFat(bpb) + rootDirSectors;
+    uint32_t clusters = totalSectors(bpb) > dataStartSector && bpb->secPerClus > 0 ? (totalSectors(bpb) - dataStartSector) / bpb->secPerClus : 0;
+    table->codec = fat_entry_codec_for(clusters);
+
+    int result = table->codec != NULL ? decodeTable(table, clusters) : openLazyTable(table, bpb, clusters);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    device->flushHook = flushHook;
+    device->flushContext = table;
+
+    return 0;
+}
+
+void free_fat_table(fat_table *table)
+{
+    if (table->entries != NULL || table->entryBits == 32)
+    {
+        flush_fat_table(table);
+    }
+
+    if (table->device != NULL && table->device->flushContext == table)
+    {
+        table->device->flushHook = NULL;
+        table->device->flushContext = NULL;
+    }
+
+    free(table->entries);
+    free(table->dirtyMap);
+    free(table->freeMap);
+    table->entries = NULL;
+    table->dirtyMap = NULL;
+    table->freeMap = NULL;
+    table->entryCount = 0;
+}
+
+uint32_t fat_table_read_entry(const fat_table *table, uint32_t cluster)
+{
+    if (cluster >= table->entryCount)
+    {
+        return FAT_FREE_CLUSTER;
+    }
+
+    const uint8_t *entry = lazyEntry(table, cluster, 0);
+    if (entry == NULL)
+    {
+        return FAT_BAD_CLUSTER;
+    }
+
+    uint32_t value;
+    memcpy(&value, entry, sizeof(uint32_t));
+
+    return value & FAT_CLUSTER_MASK;
+}
+
+// changes the entry in the sectors of every FAT copy of a FAT32 volume and keeps the counters up to date
+static void setLazyEntry(fat_table *table, uint32_t cluster, uint32_t value)
+{
+    uint32_t old = fat_table_read_entry(table, cluster);
+    for (int copy = 0; copy < table->numFats; copy++)
+    {
+        uint8_t *entry = lazyEntry(table, cluster, copy);
+        if (entry == NULL)
+        {
+            printf("Writing FAT copy %d failed!\n", copy);
+            continue;
+        }
+
+        // the upper 4 bits of an entry are reserved and keep their value
+        uint32_t raw;
+        memcpy(&raw, entry, sizeof(uint32_t));
+        raw = (raw & ~(uint32_t)FAT_CLUSTER_MASK) | (value & FAT_CLUSTER_MASK);
+        memcpy(entry, &raw, sizeof(uint32_t));
+        put_sector(table->device, (const char *)entry);
+    }
+    table->generation++;
+
+    if (cluster >= 2 && cluster < table->clusterCount)
+    {
+        bool wasFree = old == FAT_FREE_CLUSTER;
+        bool isFree = (value & FAT_CLUSTER_MASK) == FAT_FREE_CLUSTER;
+        if (wasFree && !isFree)
+        {
+            table->freeClusters--;
+            table->nextFree = cluster + 1 < table->clusterCount ? cluster + 1 : 2;
+            table->fsInfoDirty = true;
+        }
+        else if (!wasFree && isFree)
+        {
+            table->freeClusters++;
+            table->fsInfoDirty = true;
+        }
+    }
+}
+
+void fat_table_set(fat_table *table, uint32_t cluster, uint32_t value)
+{
+    if (cluster >= table->entryCount)
+    {
+        return;
+    }
+
+    if (table->entryBits == 32)
+    {
+        setLazyEntry(table, cluster, value);
+        return;
+    }
+
+    table->entries[cluster] = value & FAT_CLUSTER_MASK;
+    table->generation++;
+
+    if (cluster >= 2 && cluster < table->clusterCount)
+    {
+        uint64_t freeBit = 1ULL << (cluster % 64);
+        bool wasFree = (table->freeMap[cluster / 64] & freeBit) != 0;
+        if (table->entries[cluster] == FAT_FREE_CLUSTER)
+        {
+            if (!wasFree)
+            {
+                table->freeMap[cluster / 64] |= freeBit;
+                table->freeClusters++;
+            }
+        }
+        else if (wasFree)
+        {
+            table->freeMap[cluster / 64] &= ~freeBit;
+            table->freeClusters--;
+
+            // the clusters in front of an allocated one were taken already or are picked up after wrapping around
+            table->nextFree = cluster + 1 < table->clusterCount ? cluster + 1 : 2;
+        }
+    }
+
+    uint32_t unit = cluster / table->codec->unitEntries;
+    uint64_t bit = 1ULL << (unit % 64);
+    if ((table->dirtyMap[unit / 64] & bit) == 0)
+    {
+        table->dirtyMap[unit / 64] |= bit;
+        table->dirtyUnits++;
+    }
+}
+
+int32_t fat_table_find_free(const fat_table *table, uint32_t start)
+{
+    if (table->entryBits == 32)
+    {
+        return findFreeLazy(table, start);
+    }
+
+    uint32_t words = (table->clusterCount + 63) / 64;
+    if (words == 0)
+    {
+        return -1;
+    }
+    if (start >= table->clusterCount)
+    {
+        start = 0;
+    }
+
+    // the word containing start is visited twice, first the part from start on, after wrapping around the part before
+    uint32_t firstWord = start / 64;
+    for (uint32_t step = 0; step <= words; step++)
+    {
+        uint32_t word = (firstWord + step) % words;
+        uint64_t bits = table->freeMap[word];
+        if (step == 0)
+        {
+            bits &= ~0ULL << (start % 64);
+        }
+        else if (step == words)
+        {
+            bits &= (1ULL << (start % 64)) - 1;
+        }
+
+        if (bits != 0)
+        {
+            return (int32_t)(word * 64 + __builtin_ctzll(bits));
+        }
+    }
+
+    return -1;
+}
+
+// returns the first cluster at or after from whose bit in the free map equals set, clusterCount if there is none
+static uint32_t findBit(const fat_table *table, uint32_t from, bool set)
+{
+    uint32_t words = (table->clusterCount + 63) / 64;
+    for (uint32_t word = from / 64; word < words; word++)
+    {
+        uint64_t bits = set ? table->freeMap[word] : ~table->freeMap[word];
+        if (word == from / 64)
+        {
+            bits &= ~0ULL << (from % 64);
+        }
+
+        if (bits != 0)
+        {
+            uint32_t cluster = word * 64 + __builtin_ctzll(bits);
+            return cluster < table->clusterCount ? cluster : table->clusterCount;
+        }
+    }
+
+    return table->clusterCount;
+}
+
+// finds the next run of free clusters at or after from, returns its length, 0 if there is none
+static uint32_t nextRun(const fat_table *table, uint32_t from, uint32_t *start)
+{
+    *start = findBit(table, from, true);
+
+    return findBit(table, *start, false) - *start;
+}
+
+// first fit from the next-fit hint on, wrapping around once, returns the start of the run or -1
+static int32_t findRun(const fat_table *table, uint32_t count)
+{
+    uint32_t origins[2] = {table->nextFree, 2};
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t start = 0;
+        uint32_t length = 0;
+        for (uint32_t from = origins[pass]; (length = nextRun(table, from, &start)) > 0; from = start + length)
+        {
+            if (length >= count)
+            {
+                return (int32_t)start;
+            }
+            if (pass == 1 && start >= origins[0])
+            {
+                break;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// the shortest run that holds count clusters or, if there is none, the longest run
+static uint32_t findFragment(const fat_table *table, uint32_t count, uint32_t *fragmentStart)
+{
+    uint32_t bestStart = 0;
+    uint32_t bestLength = 0;
+    uint32_t start = 0;
+    uint32_t length = 0;
+    for (uint32_t from = 2; (length = nextRun(table, from, &start)) > 0; from = start + length)
+    {
+        bool fits = length >= count;
+        bool bestFits = bestLength >= count;
+        if (bestLength == 0 || (fits && (!bestFits || length < bestLength)) || (!fits && !bestFits && length > bestLength))
+        {
+            bestStart = start;
+            bestLength = length;
+        }
+    }
+
+    *fragmentStart = bestStart;
+
+    return bestLength < count ? bestLength : count;
+}
+
+// links the clusters [start, start + length) behind previous, the last one ends the chain
+static void linkRun(fat_table *table, uint32_t previous, uint32_t start, uint32_t length)
+{
+    if (previous >= 2)
+    {
+        fat_table_set(table, previous, start);
+    }
+
+    for (uint32_t cluster = start; cluster + 1 < start + length; cluster++)
+    {
+        fat_table_set(table, cluster, cluster + 1);
+    }
+    fat_table_set(table, start + length - 1, FAT_END_OF_CHAIN);
+}
+
+// next-fit on a FAT32 volume, the clusters behind the hint are handed out one after another
+static int32_t allocateLazy(fat_table *table, uint32_t count, uint32_t previous)
+{
+    uint32_t chainEnd = previous;
+    int32_t first = -1;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        int32_t cluster = findFreeLazy(table, table->nextFree);
+        if (cluster < 0)
+        {
+            // the free count of the FSInfo sector is only a hint and was too high, the clusters taken
+            // so far are released again and the chain ends where it ended before
+            for (uint32_t taken = first < 0 ? 0 : (uint32_t)first; fat_is_data_cluster(taken);)
+            {
+                uint32_t next = fat_table_get(table, taken);
+                fat_table_set(table, taken, FAT_FREE_CLUSTER);
+                taken = next;
+            }
+            if (chainEnd >= 2)
+            {
+                fat_table_set(table, chainEnd, FAT_END_OF_CHAIN);
+            }
+
+            countFreeLazy(table);
+            table->fsInfoDirty = true;
+            return -1;
+        }
+
+        fat_table_set(table, cluster, FAT_END_OF_CHAIN);
+        if (previous >= 2)
+        {
+            fat_table_set(table, previous, cluster);
+        }
+
+        if (first < 0)
+        {
+            first = cluster;
+        }
+        previous = cluster;
+    }
+
+    return first;
+}
+
+int32_t fat_table_allocate(fat_table *table, uint32_t count, uint32_t previous)
+{
+    if (count == 0 || count > table->freeClusters)
+    {
+        return -1;
+    }
+
+    if (table->entryBits == 32)
+    {
+        return allocateLazy(table, count, previous);
+    }
+
+    int32_t first = findRun(table, count);
+    if (first >= 0)
+    {
+        linkRun(table, previous, first, count);
+        return first;
+    }
+
+    // the free space is fragmented, every fragment is linked before the next one is searched
+    first = -1;
+    while (count > 0)
+    {
+        uint32_t start = 0;
+        uint32_t length = findFragment(table, count, &start);
+        linkRun(table, previous, start, length);
+
+        if (first < 0)
+        {
+            first = (int32_t)start;
+        }
+        previous = start + length - 1;
+        count -= length;
+    }
+
+    return first;
+}
+
+int fat_table_map_chain(const fat_table *table, uint32_t firstCluster, fat_extent_map *map)
+{
+    map->count = 0;
+    map->clusters = 0;
+    map->generation = table->generation;
+
+    uint32_t cluster = firstCluster;
+    while (fat_is_data_cluster(cluster))
+    {
+        // a chain longer than the volume loops
+        if (cluster >= table->clusterCount || map->clusters >= table->clusterCount)
+        {
+            free_extent_map(map);
+            return -1;
+        }
+
+        fat_extent *last = map->count > 0 ? &map->extents[map->count - 1] : NULL;
+        if (last != NULL && last->start + last->length == cluster)
+        {
+            last->length++;
+        }
+        else
+        {
+            if (map->count == map->capacity)
+            {
+                uint32_t capacity = map->capacity > 0 ? map->capacity * 2 : 8;
+                fat_extent *extents = (fat_extent *)realloc(map->extents, capacity * sizeof(fat_extent));
+                if (extents == NULL)
+                {
+                    free_extent_map(map);
+                    return -4;
+                }
+                map->extents = extents;
+                map->capacity = capacity;
+            }
+
+            fat_extent *extent = &map->extents[map->count++];
+            extent->fileCluster = map->clusters;
+            extent->start = cluster;
+            extent->length = 1;
+        }
+
+        map->clusters++;
+        cluster = fat_table_get(table, cluster);
+    }
+
+    if (cluster == FAT_BAD_CLUSTER)
+    {
+        free_extent_map(map);
+        return -1;
+    }
+
+    return 0;
+}
+
+int32_t fat_extent_find(const fat_extent_map *map, uint32_t fileCluster)
+{
+    if (fileCluster >= map->clusters)
+    {
+        return -1;
+    }
+
+    // the last run starting at or before fileCluster
+    uint32_t low = 0;
+    uint32_t high = map->count;
+    while (high - low > 1)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (map->extents[middle].fileCluster <= fileCluster)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    return (int32_t)low;
+}
+
+void free_extent_map(fat_extent_map *map)
+{
+    free(map->extents);
+    memset(map, 0, sizeof(fat_extent_map));
+}
+
+// encodes the units [first, end) and writes them into every FAT copy
+static int writeUnits(fat_table *table, uint32_t first, uint32_t end)
+{
+    const fat_entry_codec *codec = table->codec;
+    uint8_t packed[4 * 64];
+    uint32_t count = end - first;
+
+    codec->encode(table->entries + first * codec->unitEntries, packed, count * codec->unitEntries);
+
+    int result = 0;
+    for (int copy = 0; copy < table->numFats; copy++)
+    {
+        off_t offset = table->offset + (off_t)copy * table->sizeInBytes + (off_t)first * codec->unitBytes;
+        if (write_bytes(table->device, offset, packed, count * codec->unitBytes) != 0)
+        {
+            printf("Writing FAT copy %d failed!\n", copy);
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+// writes the counters into the FSInfo sector of a FAT32 volume
+static int flushFsInfo(fat_table *table)
+{
+    if (!table->fsInfoDirty || table->fsInfoSector == 0)
+    {
+        return 0;
+    }
+
+    uint32_t counters[2] = {table->freeClusters, table->nextFree};
+    off_t offset = (off_t)table->fsInfoSector * table->device->sectorSize + offsetof(fs_info, freeCount);
+    if (write_bytes(table->device, offset, counters, sizeof(counters)) != 0)
+    {
+        printf("Writing the FSInfo sector failed!\n");
+        return -1;
+    }
+    table->fsInfoDirty = false;
+
+    return 0;
+}
+
+int flush_fat_table(fat_table *table)
+{
+    if (table->entryBits == 32)
+    {
+        return flushFsInfo(table);
+    }
+
+    if (table->dirtyUnits == 0)
+    {
+        return 0;
+    }
+
+    uint32_t words = (table->entryCount / table->codec->unitEntries) / 64 + 1;
+    int result = 0;
+    for (uint32_t word = 0; word < words; word++)
+    {
+        uint64_t bits = table->dirtyMap[word];
+        while (bits != 0)
+        {
+            // a run of adjacent dirty units within the word
+            uint32_t start = __builtin_ctzll(bits);
+            uint64_t shifted = bits >> start;
+            uint32_t length = ~shifted == 0 ? 64 - start : (uint32_t)__builtin_ctzll(~shifted);
+
+            if (writeUnits(table, word * 64 + start, word * 64 + start + length) != 0)
+            {
+                result = -1;
+            }
+
+            bits &= length + start == 64 ? 0 : ~0ULL << (start + length);
+        }
+    }
+
+    // on failure everything stays dirty, writing the same entries again is harmless
+    if (result == 0)
+    {
+        memset(table->dirtyMap, 0, words * sizeof(uint64_t));
+        table->dirtyUnits = 0;
+    }
+
+    return result;
+}
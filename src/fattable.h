@@ -0,0 +1,197 @@
+#ifndef FATTABLE_H
+#define FATTABLE_H
+
+#include "blockdevice.h"
+#include "fat.h"
+#include "fatcodec.h"
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+// The FAT of a FAT12 or FAT16 volume, decoded once into one uint32_t per cluster.
+//
+// Entries hold 28 bit cluster numbers in the form of FAT32, the reserved, bad cluster and end-of-chain markers
+// of the volume are widened to their FAT32 values when decoded and narrowed again when encoded,
+// so chain walks work the same for every entry width. The codec of the FAT type is chosen when the table
+// is loaded, see fatcodec.h.
+//
+// Chain walks and allocations read and modify the decoded entries only. Modified entries are remembered
+// per unit of the codec (two entries share a 3 byte tuple on FAT12) and encoded into every FAT copy when
+// the block device is flushed, see flush_fat_table().
+//
+// A bitmap of the free data clusters is built at load time and kept in sync by fat_table_set(), so that
+// allocations scan 64 clusters per step with ctz instead of decoding entry after entry. Like the FSInfo
+// sector of FAT32, the table counts the free clusters and remembers where the next search should start.
+//
+// The FAT of a FAT32 volume can be as large as 1 GB and is not decoded. Its entries are read and written in
+// the sectors of the FAT through the sector cache of the device, every FAT copy is updated right away. The
+// free cluster count and the next-fit hint are taken from the FSInfo sector and written back when the device
+// is flushed, the FAT is only scanned if the FSInfo sector does not know them.
+typedef struct
+{
+    block_device *device;
+    const fat_entry_codec *codec;
+    uint32_t *entries;
+    uint32_t entryCount; // entries that fit into one FAT, including the reserved entries 0 and 1
+    uint8_t entryBits;   // width of an entry on the volume
+
+    // allocation
+    uint64_t *freeMap;     // one bit per cluster, set for free data clusters
+    uint32_t clusterCount; // clusters 2 .. clusterCount - 1 exist in the data area
+    uint32_t freeClusters;
+    uint32_t nextFree; // next-fit hint, the cluster behind the last allocated one
+
+    uint64_t generation; // changes with every modified entry, see fat_extent_map
+
+    uint64_t *dirtyMap; // one bit per unit of the codec
+    uint32_t dirtyUnits;
+
+    off_t offset;         // byte offset of the first FAT on the volume
+    uint32_t sizeInBytes; // size of one FAT copy
+    uint8_t numFats;
+
+    // FAT32
+    uint32_t fsInfoSector; // 0 if the volume has no valid FSInfo sector
+    bool fsInfoDirty;      // freeClusters or nextFree changed since the FSInfo sector was written
+} fat_table;
+
+// A run of clusters that follow each other on the volume and in the chain of a file
+typedef struct
+{
+    uint32_t fileCluster; // index of the first cluster of the run within the file
+    uint32_t start;       // first cluster of the run on the volume
+    uint32_t length;
+} fat_extent;
+
+// A chain collapsed into runs, the runs are sorted by fileCluster. The map is stale as soon as the
+// generation of the table differs from the generation it was built from.
+typedef struct
+{
+    fat_extent *extents;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t clusters; // length of the chain
+    uint64_t generation;
+} fat_extent_map;
+
+/**
+ * Reads and decodes the first FAT of the volume and attaches the table to the device, so that
+ * flush_block_device() writes modified entries back. The FAT type follows from the count of data clusters.
+ *
+ * return - 0 on success, error codes are negative integers
+ *          -1 - the FAT cannot be read
+ *          -2 - the FAT type is not supported
+ *          -4 - out of memory
+ */
+int load_fat_table(fat_table *table, block_device *device, const bios_parameter_block *bpb);
+
+/**
+ * Encodes outstanding modifications into the sectors of the device, detaches the table from the device
+ * and releases its memory.
+ */
+void free_fat_table(fat_table *table);
+
+/**
+ * Returns true if the entry links to a cluster of the data area, false for free and reserved
+ * entries (0x0FFFFFF0 - 0x0FFFFFF6), bad clusters and the end of a chain.
+ */
+static inline bool fat_is_data_cluster(uint32_t value)
+{
+    return value >= 2 && value < FAT_RESERVED_CLUSTER;
+}
+
+/**
+ * Reads the entry of the cluster from the sectors of a FAT32 volume, FAT_BAD_CLUSTER if the sector
+ * cannot be read, so that chain walks stop.
+ */
+uint32_t fat_table_read_entry(const fat_table *table, uint32_t cluster);
+
+/**
+ * Returns the entry of the cluster, FAT_FREE_CLUSTER for clusters outside of the FAT.
+ */
+static inline uint32_t fat_table_get(const fat_table *table, uint32_t cluster)
+{
+    if (table->entryBits == 32)
+    {
+        return fat_table_read_entry(table, cluster);
+    }
+
+    return cluster < table->entryCount ? table->entries[cluster] : FAT_FREE_CLUSTER;
+}
+
+/**
+ * Changes the entry of the cluster in all FAT copies.
+ */
+void fat_table_set(fat_table *table, uint32_t cluster, uint32_t value);
+
+/**
+ * Returns the first free data cluster at or after start, wrapping around at the end of the data area.
+ *
+ * return - the cluster, -1 if the volume is full
+ */
+int32_t fat_table_find_free(const fat_table *table, uint32_t start);
+
+/**
+ * Returns the next free data cluster starting at the next-fit hint. The cluster is not taken until its
+ * entry is changed with fat_table_set(), which also moves the hint behind it.
+ *
+ * return - the cluster, -1 if the volume is full
+ */
+static inline int32_t fat_table_next_free(const fat_table *table)
+{
+    return table->freeClusters > 0 ? fat_table_find_free(table, table->nextFree) : -1;
+}
+
+/**
+ * Allocates count clusters and links them into a chain ending with FAT_END_OF_CHAIN.
+ *
+ * The clusters are taken from the first contiguous run of free clusters that is long enough, searched
+ * from the next-fit hint on. Only if there is no such run, the chain is assembled from fragments: the
+ * longest run first, then the shortest run that holds the rest, so that as few fragments as possible are used.
+ * On FAT32 volumes there is no bitmap of free clusters, the clusters are taken one after another from the
+ * next-fit hint on.
+ *
+ * previous - the last cluster of the chain to extend, it is linked to the first allocated cluster,
+ *            0 to start a new chain
+ *
+ * return - the first allocated cluster, -1 if fewer than count clusters are free, nothing is allocated then
+ */
+int32_t fat_table_allocate(fat_table *table, uint32_t count, uint32_t previous);
+
+/**
+ * Collapses the chain starting at firstCluster into runs of adjacent clusters.
+ *
+ * return - 0 on success, -1 if the chain is broken or loops, -4 if out of memory
+ */
+int fat_table_map_chain(const fat_table *table, uint32_t firstCluster, fat_extent_map *map);
+
+/**
+ * Returns true if the map was built from the current entries of the table.
+ */
+static inline bool fat_extent_map_valid(const fat_table *table, const fat_extent_map *map)
+{
+    return map->extents != NULL && map->generation == table->generation;
+}
+
+/**
+ * Finds the run containing the cluster with the index fileCluster within the file with a binary search.
+ *
+ * return - the index of the run, -1 if the chain is shorter
+ */
+int32_t fat_extent_find(const fat_extent_map *map, uint32_t fileCluster);
+
+/**
+ * Releases the runs of the map.
+ */
+void free_extent_map(fat_extent_map *map);
+
+/**
+ * Encodes all modified entries and writes them into every FAT copy.
+ * Runs of adjacent modified units are written with a single write_bytes() per copy.
+ * On FAT32 volumes, the entries are written already, only the counters of the FSInfo sector are updated.
+ *
+ * return - 0 on success, -1 on error
+ */
+int flush_fat_table(fat_table *table);
+
+#endif
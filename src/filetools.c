@@ -1,5 +1,13 @@
 #include "filetools.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 int load_file_to_memory(const char *filename, char **buffer)
 {
     int size = 0;
@@ -35,4 +43,289 @@ int load_file_to_memory(const char *filename, char **buffer)
     (*buffer)[size] = 0;
 
     return size;
-}
\ No newline at end of file
+}
+
+off_t map_file_to_memory(const char *filename, char **buffer, bool shared)
+{
+    *buffer = NULL;
+
+    int fd = open(filename, shared ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        // -1 means file opening failed
+        return -1;
+    }
+
+    // figure out the file size
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0)
+    {
+        close(fd);
+
+        // -2 means the size is unknown or the file is empty (an empty file cannot be mapped)
+        return -2;
+    }
+
+    // MAP_PRIVATE needs write permission on the pages only, not on the file
+    int flags = shared ? MAP_SHARED : MAP_PRIVATE;
+    char *ptr = mmap(NULL, fileStat.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+
+    // the mapping keeps its own reference to the file, the descriptor is not needed anymore
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+    {
+        // -3 means file mapping failed
+        return -3;
+    }
+
+    *buffer = ptr;
+
+    return fileStat.st_size;
+}
+
+void unmap_file_from_memory(char *buffer, off_t size)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    // for private mappings msync() is a no-op, for shared mappings it makes sure the image
+    // is up to date when this function returns
+    msync(buffer, size, MS_SYNC);
+    munmap(buffer, size);
+}
+
+// appends an entry for path, returns its index or -1 if out of memory
+static int64_t addHostEntry(host_tree *tree, char *path, const struct stat *fileStat)
+{
+    if (tree->count == tree->capacity)
+    {
+        uint32_t capacity = tree->capacity > 0 ? tree->capacity * 2 : 64;
+        host_entry *entries = (host_entry *)realloc(tree->entries, capacity * sizeof(host_entry));
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        tree->entries = entries;
+        tree->capacity = capacity;
+    }
+
+    host_entry *entry = &tree->entries[tree->count];
+    memset(entry, 0, sizeof(host_entry));
+    entry->path = path;
+    const char *slash = strrchr(path, '/');
+    entry->name = slash != NULL && slash[1] != '\0' ? slash + 1 : path;
+    entry->directory = S_ISDIR(fileStat->st_mode);
+    entry->size = entry->directory ? 0 : fileStat->st_size;
+    entry->fd = -1;
+
+    return tree->count++;
+}
+
+static int compareHostEntries(const void *a, const void *b)
+{
+    return strcmp(((const host_entry *)a)->name, ((const host_entry *)b)->name);
+}
+
+// appends the regular files and directories inside the directory of the entry
+static int scanHostDirectory(host_tree *tree, uint32_t index)
+{
+    DIR *dir = opendir(tree->entries[index].path);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t firstChild = tree->count;
+    int result = 0;
+    struct dirent *dirEntry;
+    while (result == 0 && (dirEntry = readdir(dir)) != NULL)
+    {
+        if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        // the entries array may move while it grows, the parent path is looked up again every time
+        const char *parentPath = tree->entries[index].path;
+        char *path = (char *)malloc(strlen(parentPath) + strlen(dirEntry->d_name) + 2);
+        if (path == NULL)
+        {
+            result = -4;
+            break;
+        }
+        sprintf(path, "%s/%s", parentPath, dirEntry->d_name);
+
+        struct stat fileStat;
+        if (lstat(path, &fileStat) != 0 || !(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode)))
+        {
+            free(path);
+            continue;
+        }
+        if (addHostEntry(tree, path, &fileStat) < 0)
+        {
+            free(path);
+            result = -4;
+        }
+    }
+    closedir(dir);
+
+    qsort(tree->entries + firstChild, tree->count - firstChild, sizeof(host_entry), compareHostEntries);
+    tree->entries[index].firstChild = firstChild;
+    tree->entries[index].childCount = tree->count - firstChild;
+
+    return result;
+}
+
+int scan_host_tree(const char *path, host_tree *tree)
+{
+    memset(tree, 0, sizeof(host_tree));
+
+    struct stat fileStat;
+    char *rootPath = strdup(path);
+    if (rootPath == NULL)
+    {
+        return -4;
+    }
+    if (stat(path, &fileStat) != 0 || !(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode)))
+    {
+        free(rootPath);
+        return -1;
+    }
+    if (addHostEntry(tree, rootPath, &fileStat) < 0)
+    {
+        free(rootPath);
+        return -4;
+    }
+
+    // breadth first, every directory appends its entries behind the entries found so far
+    for (uint32_t index = 0; index < tree->count; index++)
+    {
+        if (!tree->entries[index].directory)
+        {
+            continue;
+        }
+
+        int result = scanHostDirectory(tree, index);
+        if (result == -4 || (result != 0 && index == 0))
+        {
+            free_host_tree(tree);
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+void free_host_tree(host_tree *tree)
+{
+    for (uint32_t index = 0; index < tree->count; index++)
+    {
+        close_host_file(tree, index);
+        free(tree->entries[index].path);
+    }
+    free(tree->entries);
+    memset(tree, 0, sizeof(host_tree));
+}
+
+int prefetch_host_file(host_tree *tree, uint32_t index)
+{
+    host_entry *entry = &tree->entries[index];
+    if (entry->fd < 0)
+    {
+        entry->fd = open(entry->path, O_RDONLY);
+        if (entry->fd < 0)
+        {
+            return -1;
+        }
+        posix_fadvise(entry->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(entry->fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+
+    return 0;
+}
+
+ssize_t read_host_file(host_tree *tree, uint32_t index, const struct iovec *iov, int iovcnt)
+{
+    if (prefetch_host_file(tree, index) != 0)
+    {
+        return -1;
+    }
+
+    // readv() may return early, e.g. when interrupted, so it is called until the buffers are full or the file ends
+    struct iovec pending[iovcnt];
+    memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+    struct iovec *next = pending;
+    ssize_t total = 0;
+    while (iovcnt > 0)
+    {
+        ssize_t result = readv(tree->entries[index].fd, next, iovcnt);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            return -1;
+        }
+        if (result == 0)
+        {
+            break;
+        }
+        total += result;
+
+        while (iovcnt > 0 && (size_t)result >= next->iov_len)
+        {
+            result -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            next->iov_base = (char *)next->iov_base + result;
+            next->iov_len -= result;
+        }
+    }
+
+    return total;
+}
+
+void close_host_file(host_tree *tree, uint32_t index)
+{
+    host_entry *entry = &tree->entries[index];
+    if (entry->fd >= 0)
+    {
+        close(entry->fd);
+        entry->fd = -1;
+    }
+}
+
+int create_host_directory(const char *path)
+{
+    // mkdirat() because the program defines a mkdir() of its own, which the linker would pick
+    if (mkdirat(AT_FDCWD, path, 0755) != 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int create_host_file(const char *path)
+{
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+int close_host_fd(int fd)
+{
+    return close(fd);
+}
+
+uint32_t host_processor_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (uint32_t)count : 1;
+}
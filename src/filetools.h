@@ -3,6 +3,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * Opens a file, allocates a buffer the size of the file and reads the file into the buffer
@@ -15,4 +19,108 @@
  */
 int load_file_to_memory(const char *filename, char **buffer);
 
+/**
+ * Maps a file into memory instead of reading it. Only the pages that are touched are ever loaded.
+ * 
+ * shared - true:  the file is opened read-write and mapped MAP_SHARED, every modification of the buffer
+ *                 is written back to the file by the kernel, no separate save pass is needed
+ *          false: the file is opened read-only and mapped MAP_PRIVATE, modifications only exist in
+ *                 memory (copy on write) and are discarded when the buffer is unmapped (scratch mode)
+ * 
+ * Caller is responsible for calling unmap_file_from_memory() with the returned size.
+ * 
+ * return - error codes are negative integers
+ *          -1 - file opening error
+ *          -2 - file is empty or its size cannot be determined
+ *          -3 - file mapping error
+ *          positive values denote success and are the size of the file in bytes
+ */
+off_t map_file_to_memory(const char *filename, char **buffer, bool shared);
+
+/**
+ * Unmaps a buffer returned by map_file_to_memory().
+ * For shared mappings, outstanding modifications are flushed to the file before the mapping is removed.
+ */
+void unmap_file_from_memory(char *buffer, off_t size);
+
+// A file or directory found by scan_host_tree()
+typedef struct
+{
+    char *path;       // path on the host
+    const char *name; // last component of the path
+    bool directory;
+    off_t size;           // size of a file in bytes
+    uint32_t firstChild;  // index of the first entry inside a directory
+    uint32_t childCount;  // entries directly inside a directory
+    int fd;               // descriptor of an opened file, -1 otherwise
+} host_entry;
+
+// A host directory tree flattened in breadth-first order, the entries of a directory are adjacent and
+// sorted by name. The scanned path itself is the first entry.
+typedef struct
+{
+    host_entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+} host_tree;
+
+/**
+ * Walks the host directory tree below path. Symbolic links, devices and the like are skipped.
+ *
+ * return - 0 on success, error codes are negative integers
+ *          -1 - path cannot be read
+ *          -4 - out of memory
+ */
+int scan_host_tree(const char *path, host_tree *tree);
+
+/**
+ * Closes all files opened through the tree and releases its memory.
+ */
+void free_host_tree(host_tree *tree);
+
+/**
+ * Opens the file of the entry and asks the kernel to read it ahead in the background.
+ *
+ * return - 0 on success, -1 if the file cannot be opened
+ */
+int prefetch_host_file(host_tree *tree, uint32_t index);
+
+/**
+ * Reads the next bytes of the file of the entry into the buffers, the file is opened on first use.
+ *
+ * return - the amount of bytes read, less than requested at the end of the file, -1 on error
+ */
+ssize_t read_host_file(host_tree *tree, uint32_t index, const struct iovec *iov, int iovcnt);
+
+/**
+ * Closes the file of the entry.
+ */
+void close_host_file(host_tree *tree, uint32_t index);
+
+/**
+ * Creates a directory on the host, an existing directory is fine.
+ *
+ * return - 0 on success, -1 on error
+ */
+int create_host_directory(const char *path);
+
+/**
+ * Creates or truncates a file on the host for writing.
+ *
+ * return - the file descriptor, -1 on error
+ */
+int create_host_file(const char *path);
+
+/**
+ * Closes a file returned by create_host_file().
+ *
+ * return - 0 on success, -1 if the data could not be written
+ */
+int close_host_fd(int fd);
+
+/**
+ * Returns the amount of online processors, at least 1.
+ */
+uint32_t host_processor_count(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,316 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FNV_OFFSET_BASIS 0x811C9DC5
+#define FNV_PRIME 0x01000193
+
+static uint32_t fnv1a(uint32_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static int writeFully(int fd, const char *data, size_t count, off_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t result = pwrite(fd, data + done, count - done, offset + done);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        done += result;
+    }
+
+    return 0;
+}
+
+static int readFully(int fd, char *data, size_t count, off_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t result = pread(fd, data + done, count - done, offset + done);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (result == 0)
+        {
+            return -1;
+        }
+        done += result;
+    }
+
+    return 0;
+}
+
+// all transactions in the journal have been written into the image, once the image is on stable storage
+// the journal can start over
+static int checkpoint(journal *jnl)
+{
+    if (fdatasync(jnl->device->fd) != 0 || ftruncate(jnl->fd, 0) != 0)
+    {
+        printf("Checkpointing the journal failed!\n");
+        return -1;
+    }
+
+    jnl->size = 0;
+    jnl->checkpoints++;
+
+    return 0;
+}
+
+// commit hook of the block device, appends all dirty metadata sectors as one transaction
+static int commitTransaction(void *context)
+{
+    journal *jnl = (journal *)context;
+    block_device *device = jnl->device;
+
+    if (jnl->size >= JOURNAL_CHECKPOINT_BYTES && checkpoint(jnl) != 0)
+    {
+        return -1;
+    }
+
+    uint64_t count = 0;
+    uint64_t *sectors = collect_dirty_sectors(device, true, &count);
+    if (sectors == NULL)
+    {
+        return -1;
+    }
+
+    // header | sector numbers | sector contents | commit trailer
+    size_t numbersSize = count * sizeof(uint64_t);
+    size_t total = sizeof(journal_header) + numbersSize + count * device->sectorSize + sizeof(journal_commit);
+    char *record = (char *)malloc(total);
+    if (record == NULL)
+    {
+        free(sectors);
+        return -1;
+    }
+
+    journal_header header = {JOURNAL_HEADER_MAGIC, device->sectorSize, jnl->sequence, count};
+    memcpy(record, &header, sizeof(journal_header));
+
+    char *numbers = record + sizeof(journal_header);
+    memcpy(numbers, sectors, numbersSize);
+
+    char *contents = numbers + numbersSize;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        // dirty metadata is never evicted while the journal is attached, this is a cache hit
+        char *ptr = get_sector(device, sectors[i]);
+        if (ptr == NULL)
+        {
+            free(record);
+            free(sectors);
+            return -1;
+        }
+        memcpy(contents + i * device->sectorSize, ptr, device->sectorSize);
+    }
+    free(sectors);
+
+    uint32_t checksum = fnv1a(FNV_OFFSET_BASIS, numbers, total - sizeof(journal_header) - sizeof(journal_commit));
+    journal_commit commit = {JOURNAL_COMMIT_MAGIC, checksum, jnl->sequence};
+    memcpy(record + total - sizeof(journal_commit), &commit, sizeof(journal_commit));
+
+    // the single fdatasync() is the commit point of the whole group
+    int result = writeFully(jnl->fd, record, total, jnl->size);
+    if (result == 0)
+    {
+        result = fdatasync(jnl->fd);
+    }
+    free(record);
+
+    if (result != 0)
+    {
+        printf("Writing the journal failed!\n");
+        return -1;
+    }
+
+    jnl->size += total;
+    jnl->sequence++;
+    jnl->transactions++;
+    jnl->sectorsLogged += count;
+
+    return 0;
+}
+
+// writes the sectors of all complete transactions into the image, returns the amount of replayed transactions
+static int replay(journal *jnl)
+{
+    block_device *device = jnl->device;
+
+    struct stat fileStat;
+    if (fstat(jnl->fd, &fileStat) != 0)
+    {
+        return -1;
+    }
+    if (fileStat.st_size == 0)
+    {
+        return 0;
+    }
+
+    size_t size = fileStat.st_size;
+    char *data = (char *)malloc(size);
+    if (data == NULL)
+    {
+        return -4;
+    }
+    if (readFully(jnl->fd, data, size, 0) != 0)
+    {
+        free(data);
+        return -1;
+    }
+
+    int replayed = 0;
+    size_t pos = 0;
+    while (pos + sizeof(journal_header) + sizeof(journal_commit) <= size)
+    {
+        journal_header header;
+        memcpy(&header, data + pos, sizeof(journal_header));
+        if (header.magic != JOURNAL_HEADER_MAGIC || header.sectorSize != device->sectorSize)
+        {
+            break;
+        }
+
+        // a torn header could claim any amount of sectors
+        size_t available = size - pos - sizeof(journal_header) - sizeof(journal_commit);
+        if (header.count > available / (sizeof(uint64_t) + device->sectorSize))
+        {
+            break;
+        }
+
+        char *numbers = data + pos + sizeof(journal_header);
+        size_t payload = header.count * (sizeof(uint64_t) + device->sectorSize);
+        char *contents = numbers + header.count * sizeof(uint64_t);
+
+        journal_commit commit;
+        memcpy(&commit, numbers + payload, sizeof(journal_commit));
+        if (commit.magic != JOURNAL_COMMIT_MAGIC || commit.sequence != header.sequence ||
+            commit.checksum != fnv1a(FNV_OFFSET_BASIS, numbers, payload))
+        {
+            // the transaction was never committed
+            break;
+        }
+
+        for (uint64_t i = 0; i < header.count; i++)
+        {
+            uint64_t sector;
+            memcpy(&sector, numbers + i * sizeof(uint64_t), sizeof(uint64_t));
+            if (write_sector(device, sector, contents + i * device->sectorSize) != 0)
+            {
+                free(data);
+                return -3;
+            }
+        }
+
+        replayed++;
+        jnl->sequence = header.sequence + 1;
+        pos += sizeof(journal_header) + payload + sizeof(journal_commit);
+    }
+    free(data);
+
+    if (replayed > 0 && sync_block_device(device) != 0)
+    {
+        return -3;
+    }
+
+    return replayed;
+}
+
+int open_journal(journal *jnl, block_device *device, const char *imageFilename, uint32_t groupCommit)
+{
+    memset(jnl, 0, sizeof(journal));
+    jnl->fd = -1;
+    jnl->device = device;
+    jnl->sequence = 1;
+
+    // the image has to be written by the block device itself, see BLOCK_DEVICE_WRITE_BACK
+    if ((device->mode & BLOCK_DEVICE_WRITABLE) == 0 || device->fd < 0)
+    {
+        return -2;
+    }
+
+    size_t length = strlen(imageFilename) + sizeof(".journal");
+    jnl->filename = (char *)malloc(length);
+    if (jnl->filename == NULL)
+    {
+        return -4;
+    }
+    snprintf(jnl->filename, length, "%s.journal", imageFilename);
+
+    jnl->fd = open(jnl->filename, O_RDWR | O_CREAT, 0644);
+    if (jnl->fd < 0)
+    {
+        free(jnl->filename);
+        jnl->filename = NULL;
+        return -1;
+    }
+
+    int replayed = replay(jnl);
+    if (replayed < 0 || ftruncate(jnl->fd, 0) != 0)
+    {
+        printf("Replaying the journal %s failed!\n", jnl->filename);
+        close(jnl->fd);
+        jnl->fd = -1;
+        free(jnl->filename);
+        jnl->filename = NULL;
+        return replayed < 0 ? replayed : -1;
+    }
+
+    device->commitHook = commitTransaction;
+    device->commitContext = jnl;
+    device->groupCommit = groupCommit > 0 ? groupCommit : JOURNAL_DEFAULT_GROUP_COMMIT;
+    device->pendingOperations = 0;
+
+    return replayed;
+}
+
+void close_journal(journal *jnl)
+{
+    if (jnl->fd < 0)
+    {
+        return;
+    }
+
+    // commits the last group and writes it into the image
+    int result = sync_block_device(jnl->device);
+
+    jnl->device->commitHook = NULL;
+    jnl->device->commitContext = NULL;
+    jnl->device->groupCommit = 1;
+
+    close(jnl->fd);
+    jnl->fd = -1;
+
+    // keep the journal around for the next replay if the image could not be synced
+    if (result == 0)
+    {
+        unlink(jnl->filename);
+    }
+
+    free(jnl->filename);
+    jnl->filename = NULL;
+}
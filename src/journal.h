@@ -0,0 +1,79 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "blockdevice.h"
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#define JOURNAL_DEFAULT_GROUP_COMMIT 8
+#define JOURNAL_CHECKPOINT_BYTES (1024 * 1024)
+
+#define JOURNAL_HEADER_MAGIC 0x4C4E524A // "JRNL"
+#define JOURNAL_COMMIT_MAGIC 0x54494D43 // "CMIT"
+
+// written in front of the sectors of a transaction
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t sectorSize;
+    uint64_t sequence;
+    uint64_t count; // amount of sectors in the transaction
+} journal_header;
+
+// written behind the sectors of a transaction, a transaction without a valid trailer is ignored on replay
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t checksum; // FNV-1a over the sector numbers and the sector contents
+    uint64_t sequence;
+} journal_commit;
+
+// Write-ahead journal for the filesystem metadata of a block device.
+//
+// The journal lives in a sidecar file next to the image (<image>.journal). Before dirty metadata sectors
+// (FAT, directories) are written into the image, their new contents are appended to the journal as one
+// transaction: header, sector numbers, sector contents and a commit trailer, followed by a single fdatasync().
+// The block device groups several operations into one transaction (see end_operation()), so the cost of the
+// fdatasync() is shared by all of them.
+//
+// After a crash, open_journal() writes the sectors of every complete transaction into the image again.
+// Incomplete transactions at the end of the journal were never committed and are dropped.
+//
+// Once the journal grows beyond JOURNAL_CHECKPOINT_BYTES, the image is synced and the journal truncated.
+typedef struct
+{
+    int fd;
+    char *filename;
+    block_device *device;
+    off_t size;        // end of the last transaction in the journal file
+    uint64_t sequence; // sequence number of the next transaction
+
+    // statistics
+    uint64_t transactions;
+    uint64_t sectorsLogged;
+    uint64_t checkpoints;
+} journal;
+
+/**
+ * Opens (or creates) the journal of the image, replays committed transactions that did not reach the image
+ * and installs the journal as commit hook of the device. The device has to be writable and must not be a
+ * shared mapping (use BLOCK_DEVICE_WRITE_BACK or BLOCK_DEVICE_CACHED), because the kernel writes modified
+ * pages of a shared mapping back at any time.
+ *
+ * groupCommit - amount of operations per transaction, 0 selects JOURNAL_DEFAULT_GROUP_COMMIT
+ *
+ * return - amount of replayed transactions, error codes are negative integers
+ *          -1 - journal opening error
+ *          -2 - the device cannot be journaled
+ *          -3 - replay failed
+ *          -4 - out of memory
+ */
+int open_journal(journal *jnl, block_device *device, const char *imageFilename, uint32_t groupCommit);
+
+/**
+ * Commits outstanding operations, syncs the image and removes the journal file.
+ */
+void close_journal(journal *jnl);
+
+#endif
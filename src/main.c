@@ -1,144 +1,90 @@
 #include "main.h"
 #include <stdbool.h>
-
-directory_entry *workingDirectory = NULL;
+#include <pthread.h>
+#include <string.h>
+#include <sys/uio.h>
 
 // output date and timestamps of files
 // implement cd, pwd, ls
 // implement output, create, append, delete of files
 // implement create, delete of folders
 
-void rm(const char *buffer, const bios_parameter_block *bpb, const char *filename);
-void rmdir(const char *buffer, const bios_parameter_block *bpb, const char *filename);
+void rm(fat_session *session, const char *filename);
+int catFile(fat_volume *volume, directory_entry *entry);
+void rmdir(fat_session *session, const char *filename);
 
-void fillFat12Entry(const char *buffer, const int fatOffset, const int logicalClusterIndex, fat_12_entry *fat12Entry)
+bool isDirectory(directory_entry *dirEntry)
 {
-    int fatIndex1 = -1;
-    if (logicalClusterIndex % 2)
-    {
-        // odd
-        fatIndex1 = (3 * logicalClusterIndex) / 2 + fatOffset;
-        fatIndex1 = fatIndex1 - 1;
-    }
-    else
-    {
-        // even
-        fatIndex1 = (3 * logicalClusterIndex) / 2 + fatOffset;
-    }
-
-    // assemble and parse the three byte fat entry
-    unsigned char a = buffer[fatIndex1];
-    unsigned char b = buffer[fatIndex1 + 1];
-    unsigned char c = buffer[fatIndex1 + 2];
-
-    uint32_t fatTouple = (c << 16) + (b << 8) + a;
-
-    // if both values are zero, early out
-    if (fatTouple == 0)
-    {
-        fat12Entry->firstEntry = fat12Entry->secondEntry = 0;
-        return;
-    }
-
-    // bitmask the first and the second entry
-    uint32_t secondLogicalSector = fatTouple & 0xFFF000;
-    secondLogicalSector >>= 12;
-    uint32_t firstLogicalSector = fatTouple & 0x000FFF;
-
-    fat12Entry->firstEntry = firstLogicalSector;
-    fat12Entry->secondEntry = secondLogicalSector;
+    return dirEntry->attributes & 0x10;
 }
 
-/**
- * Returns the value stored in the FAT in the entry at the logicalClusterIndex
- * 
- * Every three byte block contains two logical fat entries.
- * This method will either return the first or the second fat entry, depending
- * on the logicalClusterIndex passed in.
- */
-int readFAT12Entry(const char *buffer, const int fatOffset, const int logicalClusterIndex)
+bool isNotDirectory(directory_entry *dirEntry)
 {
-    fat_12_entry fat12Entry;
-    fillFat12Entry(buffer, fatOffset, logicalClusterIndex, &fat12Entry);
-
-    // return the first or the second entry
-    if (logicalClusterIndex % 2)
-    {
-        return fat12Entry.secondEntry;
-    }
-    else
-    {
-        return fat12Entry.firstEntry;
-    }
+    return !isDirectory(dirEntry);
 }
 
-void writeFAT12Entry(char *buffer, const int fatOffset, const int logicalClusterIndex, const int newValue)
+bool isVolumeLabel(directory_entry *dirEntry)
 {
-    fat_12_entry fat12Entry;
+    return dirEntry->attributes & 0x08;
+}
 
-    // read the current values
-    fillFat12Entry(buffer, fatOffset, logicalClusterIndex, &fat12Entry);
+bool isNotVolumeLabel(directory_entry *dirEntry)
+{
+    return !isVolumeLabel(dirEntry);
+}
 
-    // update the values
-    if (logicalClusterIndex % 2)
-    {
-        fat12Entry.secondEntry = newValue;
-    }
-    else
-    {
-        fat12Entry.firstEntry = newValue;
-    }
+bool isFile(directory_entry *dirEntry)
+{
+    return !isVolumeLabel(dirEntry) && !isDirectory(dirEntry);
+}
 
-    // assemble
-    uint32_t fatTouple = (fat12Entry.secondEntry << 12) | fat12Entry.firstEntry;
+bool isNotFile(directory_entry *dirEntry)
+{
+    return !isFile(dirEntry);
+}
 
-    int fatIndex = -1;
-    if (logicalClusterIndex % 2)
-    {
-        // odd
-        fatIndex = (3 * logicalClusterIndex) / 2 + fatOffset;
-        fatIndex = fatIndex - 1;
-    }
-    else
+// returns the first cluster of the entry, FAT32 keeps the upper 16 bits of the cluster number in a separate field
+uint32_t getFirstCluster(const fat_volume *volume, const directory_entry *dirEntry)
+{
+    if (volume->fatTable.entryBits == 32)
     {
-        // even
-        fatIndex = (3 * logicalClusterIndex) / 2 + fatOffset;
+        return (uint32_t)dirEntry->first_cluster_high << 16 | dirEntry->first_logical_cluster;
     }
 
-    // assemble and parse the three byte fat entry
-    buffer[fatIndex + 2] = (char)((fatTouple & 0xFF0000) >> 16);
-    buffer[fatIndex + 1] = (char)((fatTouple & 0xFF00) >> 8);
-    buffer[fatIndex + 0] = (char)(fatTouple & 0xFF);
-}
-
-bool isDirectory(directory_entry *dirEntry)
-{
-    return dirEntry->attributes & 0x10;
+    return dirEntry->first_logical_cluster;
 }
 
-bool isNotDirectory(directory_entry *dirEntry)
+void setFirstCluster(const fat_volume *volume, directory_entry *dirEntry, uint32_t cluster)
 {
-    return !isDirectory(dirEntry);
+    dirEntry->first_logical_cluster = cluster & 0xFFFF;
+    if (volume->fatTable.entryBits == 32)
+    {
+        dirEntry->first_cluster_high = cluster >> 16;
+    }
 }
 
-bool isVolumeLabel(directory_entry *dirEntry)
+// The working directory is NULL for the fixed root directory of FAT12 and FAT16 volumes. The root directory
+// of a FAT32 volume is a cluster chain, it is handled like any other folder through rootDirectoryEntry.
+directory_entry *rootDirectory(fat_volume *volume)
 {
-    return dirEntry->attributes & 0x08;
+    return volume->fatTable.entryBits == 32 ? &volume->rootDirectoryEntry : NULL;
 }
 
-bool isNotVolumeLabel(directory_entry *dirEntry)
+void changeToRootDirectory(fat_session *session)
 {
-    return !isVolumeLabel(dirEntry);
+    session->workingDirectory = rootDirectory(session->volume);
 }
 
-bool isFile(directory_entry *dirEntry)
+// returns the cluster that .. entries store for the directory, 0 stands for the root directory on every FAT type
+uint32_t parentLinkCluster(const fat_volume *volume, const directory_entry *directory)
 {
-    return !isVolumeLabel(dirEntry) && !isDirectory(dirEntry);
+    return directory == NULL || directory == &volume->rootDirectoryEntry ? 0 : getFirstCluster(volume, directory);
 }
 
-bool isNotFile(directory_entry *dirEntry)
+// returns the cluster the name index of the directory is kept under, 0 for the fixed root directory
+uint32_t directoryIndexCluster(const fat_volume *volume, const directory_entry *directory)
 {
-    return !isFile(dirEntry);
+    return directory == NULL ? 0 : getFirstCluster(volume, directory);
 }
 
 // Computes the offset from the beginning of the volume to the data area in sectors.
@@ -152,33 +98,49 @@ bool isNotFile(directory_entry *dirEntry)
 // 3. The root directory (StartSector: 19)
 // 4. Data Area (StartSector: 33)
 //
-// Q: Why subtract 2?
-// A: The cluster numbers are linear and are relative to the data area, with cluster 2 being the first cluster of the data area
-// the first two clusters are reserved
-int16_t dataAreaOffsetInSectors(bios_parameter_block *bpb)
+// The cluster numbers are linear and are relative to the data area, with cluster 2 being the first cluster of the data area,
+// the first two clusters are reserved. A cluster is made of secPerClus adjacent sectors.
+uint64_t dataAreaOffsetInSectors(const bios_parameter_block *bpb)
 {
     // compute the amount of sectors the root dir occupies
-    int rootDirSectors = (32 * bpb->rootEntCnt + bpb->bytesPerSec - 1) / bpb->bytesPerSec;
+    uint32_t rootDirSectors = (32 * bpb->rootEntCnt + bpb->bytesPerSec - 1) / bpb->bytesPerSec;
 
     // the fat structure is:
-    return bpb->rsvdSecCnt + (bpb->secPerFat * bpb->numFats) + rootDirSectors - 2;
+    return bpb->rsvdSecCnt + (uint64_t)sectorsPerFat(bpb) * bpb->numFats + rootDirSectors;
+}
+
+// sectors that form one cluster of the data area
+int sectorsPerCluster(const bios_parameter_block *bpb)
+{
+    return bpb->secPerClus > 0 ? bpb->secPerClus : 1;
+}
+
+// bytes of one cluster of the data area
+uint32_t bytesPerCluster(const bios_parameter_block *bpb)
+{
+    return (uint32_t)sectorsPerCluster(bpb) * bpb->bytesPerSec;
+}
+
+// directory entries that fit into one sector, the root directory and clusters of directories are read sector by sector
+int dirEntriesPerSector(const bios_parameter_block *bpb)
+{
+    return bpb->bytesPerSec / sizeof(directory_entry);
 }
 
 // returns the offset from the beginning of the file to the first fat in bytes
-int16_t fatOffset(bios_parameter_block *bpb, const int fatCopyIndex)
+off_t fatOffset(bios_parameter_block *bpb, const int fatCopyIndex)
 {
     // get pointer to beginning of first fat
     // the first fat is posistioned after all reserved sectors
-    int fatOffsetInSectors = bpb->rsvdSecCnt + fatCopyIndex * bpb->secPerFat;
-    fatOffsetInSectors *= bpb->bytesPerSec;
+    uint64_t fatOffsetInSectors = bpb->rsvdSecCnt + (uint64_t)fatCopyIndex * sectorsPerFat(bpb);
 
-    return fatOffsetInSectors;
+    return (off_t)(fatOffsetInSectors * bpb->bytesPerSec);
 }
 
 // Converts a logical sector index into the index of the corresponding physical sector.
 // The physical sectors are counted from the beginning of the volume
 //
-// physical sector number = 33 + FAT entry number - 2
+// physical sector number = 33 + (FAT entry number - 2) * sectors per cluster
 // a physical sector is just a sector on the volume
 // the first physical sector is the boot sector
 // the following sectors are part of reserved sectors or maybe the FAT tables
@@ -186,8 +148,9 @@ int16_t fatOffset(bios_parameter_block *bpb, const int fatCopyIndex)
 // Followed by sectors for the data area.
 //
 // Converting the logical sector of a directory entry into a physical sector
-// will give you a sector in the data area that contains that file or directory
-int16_t logicalToPhysical(bios_parameter_block *bpb, int16_t logicalCluster)
+// will give you the first sector of the cluster in the data area that contains that file or directory,
+// the other sectors of the cluster follow it
+int64_t logicalToPhysical(const bios_parameter_block *bpb, int32_t logicalCluster)
 {
     // first two cluster 0 and 1 are reserved, negative logicalClusters do not exist
     if (logicalCluster < 2)
@@ -195,49 +158,87 @@ int16_t logicalToPhysical(bios_parameter_block *bpb, int16_t logicalCluster)
         return -1;
     }
 
-    return dataAreaOffsetInSectors(bpb) + logicalCluster;
+    return (int64_t)dataAreaOffsetInSectors(bpb) + (int64_t)(logicalCluster - 2) * sectorsPerCluster(bpb);
 }
 
 // outputs all fat entries for debugging purposes
-void outputFat(const char *buffer, bios_parameter_block *bpb)
+void outputFat(fat_volume *volume)
+{
+    // the decoded table knows how many entries fit into one fat
+    for (uint32_t i = 0; i < volume->fatTable.entryCount; i++)
+    {
+        uint32_t value = fat_table_get(&volume->fatTable, i);
+        printf("entry: %u value: %u\n", i, value);
+    }
+
+    printf("\n");
+}
+
+// reads the next clusters of a chain into the sector cache with a single batch of requests, up to READ_AHEAD_SECTORS
+// sectors but at least one cluster
+// returns the amount of clusters that were read ahead
+int readAheadChain(fat_volume *volume, int logicalClusterIndex)
 {
-    // one fat is sectory per fat multiplied by bytes per sector
-    int fatSizeInBytes = bpb->secPerFat * bpb->bytesPerSec;
+    block_device *device = volume->device;
+    bios_parameter_block *bpb = &volume->bpb;
 
-    // offset to fat
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
+    uint64_t sectors[READ_AHEAD_SECTORS];
+    int clusterSectors = sectorsPerCluster(bpb) < READ_AHEAD_SECTORS ? sectorsPerCluster(bpb) : READ_AHEAD_SECTORS;
 
-    // every three bytes in the fat contain two entries
-    for (int i = 0; i < (fatSizeInBytes / 3 * 2); i++)
+    int count = 0;
+    int clusters = 0;
+    while (count + clusterSectors <= READ_AHEAD_SECTORS && fat_is_data_cluster(logicalClusterIndex))
     {
-        int value = readFAT12Entry(buffer, firstFatOffset, i);
-        printf("entry: %d value: %d\n", i, value);
+        int64_t firstSector = logicalToPhysical(bpb, logicalClusterIndex);
+        for (int i = 0; i < clusterSectors; i++)
+        {
+            sectors[count++] = firstSector + i;
+        }
+        clusters++;
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
     }
+    prefetch_sectors(device, sectors, count);
 
-    printf("\n");
+    return clusters;
 }
 
 // outputs a file to the console by following all sectors in the chain of sectors
-void outputFile(const char *buffer, bios_parameter_block *bpb, const int firstLogicalClusterIndex)
+void outputFile(fat_volume *volume, const int firstLogicalClusterIndex)
 {
-    int16_t dataAreaOffsetInBytes = dataAreaOffsetInSectors(bpb) * bpb->bytesPerSec;
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
+    block_device *device = volume->device;
+    bios_parameter_block *bpb = &volume->bpb;
 
     int logicalClusterIndex = firstLogicalClusterIndex;
 
+    // clusters left that were already read ahead
+    int readAhead = 0;
+
     //while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != 0xFF0 && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-    while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+    while (fat_is_data_cluster(logicalClusterIndex))
     {
-        // print the physical sector
-        char *bufferPtr = buffer;
-        bufferPtr += (dataAreaOffsetInBytes + logicalClusterIndex * bpb->bytesPerSec);
-        printf("%.512s", bufferPtr);
+        if (readAhead == 0)
+        {
+            readAhead = readAheadChain(volume, logicalClusterIndex);
+        }
+        readAhead--;
+
+        // print the physical sectors of the cluster
+        int64_t firstSector = logicalToPhysical(bpb, logicalClusterIndex);
+        for (int i = 0; i < sectorsPerCluster(bpb); i++)
+        {
+            char *bufferPtr = get_sector(device, firstSector + i);
+            if (bufferPtr == NULL)
+            {
+                break;
+            }
+            printf("%.*s", bpb->bytesPerSec, bufferPtr);
+        }
 
         // read next sector in the chain of sectors from the fat
-        logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
     }
 
-    if (logicalClusterIndex == FAT12_DEFECTIVE_CLUSTER)
+    if (logicalClusterIndex == FAT_BAD_CLUSTER)
     {
         printf("Defective cluster detected!\n");
     }
@@ -245,27 +246,25 @@ void outputFile(const char *buffer, bios_parameter_block *bpb, const int firstLo
     printf("\n");
 }
 
-int findLastCluster(const char *buffer, bios_parameter_block *bpb, directory_entry *entry)
+int findLastCluster(fat_volume *volume, directory_entry *entry)
 {
     // security check
-    if (entry->first_logical_cluster == 0)
+    if (getFirstCluster(volume, entry) == 0)
     {
         return -1;
     }
 
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
-
-    int logicalClusterIndex = entry->first_logical_cluster;
-    int nextLogicalClusterIndex = entry->first_logical_cluster;
+    int logicalClusterIndex = getFirstCluster(volume, entry);
+    int nextLogicalClusterIndex = getFirstCluster(volume, entry);
     //while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != 0xFF0 && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-    while (nextLogicalClusterIndex > 1 && nextLogicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && nextLogicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+    while (fat_is_data_cluster(nextLogicalClusterIndex))
     {
         // read next sector in the chain of sectors from the fat
         logicalClusterIndex = nextLogicalClusterIndex;
-        nextLogicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, nextLogicalClusterIndex);
+        nextLogicalClusterIndex = fat_table_get(&volume->fatTable, nextLogicalClusterIndex);
     }
 
-    if (logicalClusterIndex == FAT12_DEFECTIVE_CLUSTER)
+    if (logicalClusterIndex == FAT_BAD_CLUSTER)
     {
         printf("Defective cluster detected!\n");
         return -1;
@@ -274,10 +273,10 @@ int findLastCluster(const char *buffer, bios_parameter_block *bpb, directory_ent
     return logicalClusterIndex;
 }
 
-void outputDirectoryEntry(directory_entry *dirEntry)
+void outputDirectoryEntry(const fat_volume *volume, directory_entry *dirEntry)
 {
     // http: //alexander.khleuven.be/courses/bs1/fat12/fat12.html
-    printf("filename: %.11s ReadOnly: %s, Hidden: %s, SystemFile: %s, VolumeLabel: %s, Directory: %s, ShouldBeArchived: %s, FirstLogicalCluster: %d \n",
+    printf("filename: %.11s ReadOnly: %s, Hidden: %s, SystemFile: %s, VolumeLabel: %s, Directory: %s, ShouldBeArchived: %s, FirstLogicalCluster: %u \n",
            dirEntry->filename,
            (dirEntry->attributes & 0x01 ? "true" : "false"), // readonly
            (dirEntry->attributes & 0x02 ? "true" : "false"), // hidden
@@ -285,7 +284,7 @@ void outputDirectoryEntry(directory_entry *dirEntry)
            (dirEntry->attributes & 0x08 ? "true" : "false"), // is volumeLabel
            (dirEntry->attributes & 0x10 ? "true" : "false"), // is directory
            (dirEntry->attributes & 0x20 ? "true" : "false"), // should be archived
-           dirEntry->first_logical_cluster);
+           getFirstCluster(volume, dirEntry));
 
     // TODO: output dates and timestamps
 }
@@ -310,41 +309,41 @@ bool isLink(const char *foldername)
 /**
  * Iterate directory entries for output to the console.
  */
-int iterateEntries(directory_entry *directoryEntryPtr, const int entryCount, bool returnLinks)
+int iterateEntries(const fat_volume *volume, directory_entry *directoryEntryPtr, const int entryCount, bool returnLinks)
 {
     int entriesUsed = 0;
 
-    // output all entries
-    for (int i = 0; i < entryCount; i++)
+    // If the first byte of the Filename field is 0xE5, then the directory entry is free
+    // (i.e., currently unused), and hence there is no file or subdirectory associated with the directory entry.
+    //
+    // If the first byte of the Filename field is 0x00, then this directory entry is free and all
+    // the remaining directory entries in this directory are also free.
+    //
+    // The first bytes of a group of entries are classified at once, only the used entries are visited.
+    for (int first = 0; first < entryCount; first += DIR_SCAN_GROUP)
     {
-        // If the first byte of the Filename field is 0xE5, then the directory entry is free
-        // (i.e., currently unused), and hence there is no file or subdirectory associated with the directory entry.
-        //
-        // If the first byte of the Filename field is 0x00, then this directory entry is free and all
-        // the remaining directory entries in this directory are also free.
-        if (directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_FREE)
-        {
-            // go to the next entry
-            directoryEntryPtr++;
-            continue;
-        }
-        else if (directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_LAST)
+        uint32_t count = entryCount - first < DIR_SCAN_GROUP ? entryCount - first : DIR_SCAN_GROUP;
+        dir_slot_masks masks;
+        dir_scan_slots(directoryEntryPtr + first, count, &masks);
+
+        for (uint64_t live = dir_scan_live(&masks); live != 0; live &= live - 1)
         {
-            // break the loop, because all subsequent entries are free too
-            break;
-        }
+            directory_entry *entry = directoryEntryPtr + first + __builtin_ctzll(live);
+            outputDirectoryEntry(volume, entry);
 
-        outputDirectoryEntry(directoryEntryPtr);
+            // count all entries that contain real folders or files
+            // do not count the . and .. (links)
+            if (returnLinks || !isLink(entry->filename))
+            {
+                entriesUsed++;
+            }
+        }
 
-        // count all entries that contain real folders or files
-        // do not count the . and .. (links)
-        if (returnLinks || !isLink(directoryEntryPtr->filename))
+        // break the loop, because all subsequent entries are free too
+        if (masks.end != 0)
         {
-            entriesUsed++;
+            break;
         }
-
-        // go to next entry
-        directoryEntryPtr++;
     }
 
     return entriesUsed;
@@ -356,37 +355,46 @@ int iterateEntries(directory_entry *directoryEntryPtr, const int entryCount, boo
  */
 directory_entry *findDirectoryEntry(directory_entry *directoryEntryPtr, const int entryCount, const char *filename)
 {
-    // output all entries
-    for (int i = 0; i < entryCount; i++)
+    // The name is compared against all entries of a group at once, free entries (0xE5) and the entries
+    // behind the first 0x00 entry are masked out afterwards.
+    for (int first = 0; first < entryCount; first += DIR_SCAN_GROUP)
     {
-        // If the first byte of the Filename field is 0xE5, then the directory entry is free
-        // (i.e., currently unused), and hence there is no file or subdirectory associated with the directory entry.
-        //
-        // If the first byte of the Filename field is 0x00, then this directory entry is free and all
-        // the remaining directory entries in this directory are also free.
-        if (directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_FREE)
+        uint32_t count = entryCount - first < DIR_SCAN_GROUP ? entryCount - first : DIR_SCAN_GROUP;
+        dir_slot_masks masks;
+        dir_scan_slots(directoryEntryPtr + first, count, &masks);
+
+        // names are compared up to the first NUL byte like strncmp() does, the . and .. links are padded with NUL
+        uint64_t matches = dir_scan_match(directoryEntryPtr + first, count, filename) & dir_scan_live(&masks);
+        if (matches != 0)
         {
-            // go to the next entry
-            directoryEntryPtr++;
-            continue;
+            return directoryEntryPtr + first + __builtin_ctzll(matches);
         }
-        else if (directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_LAST)
+
+        // all subsequent entries are free too
+        if (masks.end != 0)
         {
-            // break the loop, because all subsequent entries are free too
             break;
         }
+    }
 
-        // TODO: this matching is prefix matching and hence incorrect
-        // a absolute match is needed
-        if (strncmp(directoryEntryPtr->filename, filename, FILENAME_LENGTH) == 0)
+    return NULL;
+}
+
+// returns the index of the first free entry (0xE5 or 0x00) among entryCount entries, -1 if all are used
+int firstFreeDirectoryEntry(const directory_entry *directoryEntryPtr, const int entryCount)
+{
+    for (int first = 0; first < entryCount; first += DIR_SCAN_GROUP)
+    {
+        uint32_t count = entryCount - first < DIR_SCAN_GROUP ? entryCount - first : DIR_SCAN_GROUP;
+        dir_slot_masks masks;
+        dir_scan_slots(directoryEntryPtr + first, count, &masks);
+        if ((masks.free | masks.end) != 0)
         {
-            return directoryEntryPtr;
+            return first + __builtin_ctzll(masks.free | masks.end);
         }
-
-        directoryEntryPtr++;
     }
 
-    return NULL;
+    return -1;
 }
 
 /**
@@ -400,33 +408,41 @@ directory_entry *findDirectoryEntry(directory_entry *directoryEntryPtr, const in
  * If the first byte of the Filename field is 0x00, then this directory entry is free and all the remaining 
  * directory entries in this directory are also free.          
  */
-int outputFolder(const char *buffer, bios_parameter_block *bpb, const int firstLogicalClusterIndex)
+int outputFolder(fat_volume *volume, const int firstLogicalClusterIndex)
 {
+    block_device *device = volume->device;
+    bios_parameter_block *bpb = &volume->bpb;
+
     int entriesUsed = 0;
-    int16_t dataAreaOffsetInBytes = dataAreaOffsetInSectors(bpb) * bpb->bytesPerSec;
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
 
     int logicalClusterIndex = firstLogicalClusterIndex;
 
     //while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != 0xFF0 && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-    while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+    while (fat_is_data_cluster(logicalClusterIndex))
     {
-        // pointer to physical sector
-        char *bufferPtr = buffer;
-        bufferPtr += (dataAreaOffsetInBytes + logicalClusterIndex * bpb->bytesPerSec);
+        int64_t firstSector = logicalToPhysical(bpb, logicalClusterIndex);
+        for (int sectorIndex = 0; sectorIndex < sectorsPerCluster(bpb); sectorIndex++)
+        {
+            // pointer to physical sector
+            char *bufferPtr = get_sector(device, firstSector + sectorIndex);
+            if (bufferPtr == NULL)
+            {
+                break;
+            }
 
-        // cast to directory entry
-        directory_entry *directoryEntryPtr = (directory_entry *)bufferPtr;
+            // cast to directory entry
+            directory_entry *directoryEntryPtr = (directory_entry *)bufferPtr;
 
-        // output all entries
-        bool returnLinks = false;
-        entriesUsed += iterateEntries(directoryEntryPtr, DIR_ENTRIES_PER_SECTOR, returnLinks);
+            // output all entries
+            bool returnLinks = false;
+            entriesUsed += iterateEntries(volume, directoryEntryPtr, dirEntriesPerSector(bpb), returnLinks);
+        }
 
         // read next sector in the chain of sectors from the fat
-        logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
     }
 
-    if (logicalClusterIndex == FAT12_DEFECTIVE_CLUSTER)
+    if (logicalClusterIndex == FAT_BAD_CLUSTER)
     {
         printf("Defective cluster detected!\n");
     }
@@ -437,181 +453,649 @@ int outputFolder(const char *buffer, bios_parameter_block *bpb, const int firstL
 }
 
 /**
- * Compute the offset in bytes and return a pointer to the root directory.
+ * Compute the index of the first sector of the root directory.
  * The root directory is stored after the reserved sectors and the redundant FATs. 
  */
-directory_entry *findRootDirectoryEntries(const char *buffer, bios_parameter_block *bpb)
+uint64_t rootDirectoryOffsetInSectors(const bios_parameter_block *bpb)
 {
     // compute the sector where the root directory starts
     // reserved Sector count tells us how many sectors are reserved for boot information
     // secPerFat contains the sectors used for each FAT table
     // numFats is the amount of copies of the FAT. For crash-safetry, the FAT is duplicated to have it redundand
     // Copies of the FAT are still available even if one of the copies is corrupted.
-    int rootDirectoryOffsetInSectors = bpb->rsvdSecCnt + bpb->secPerFat * bpb->numFats;
-
-    // convert the offset in sectors to an offset in bytes
-    int rootDirectoryOffsetInBytes = rootDirectoryOffsetInSectors * bpb->bytesPerSec;
+    return bpb->rsvdSecCnt + (uint64_t)sectorsPerFat(bpb) * bpb->numFats;
+}
 
-    char *ptr = buffer;
-    ptr += rootDirectoryOffsetInBytes;
+/**
+ * Returns the amount of directory entries stored in the given sector of the root directory.
+ * The last sector of the root directory might only be partially used.
+ */
+int rootDirectoryEntriesInSector(const bios_parameter_block *bpb, const int rootDirectorySectorIndex)
+{
+    int entriesBefore = rootDirectorySectorIndex * dirEntriesPerSector(bpb);
+    int entriesLeft = bpb->rootEntCnt - entriesBefore;
 
-    return (directory_entry *)ptr;
+    return entriesLeft < dirEntriesPerSector(bpb) ? entriesLeft : dirEntriesPerSector(bpb);
 }
 
 /**
  * Outputs the third section of the FAT volume which is the root directory.
  */
-int outputRootFolder(const char *buffer, bios_parameter_block *bpb)
+int outputRootFolder(fat_volume *volume)
 {
-    bool returnLinks = false;
-    int entriesUsed = iterateEntries(findRootDirectoryEntries(buffer, bpb), bpb->rootEntCnt, returnLinks);
+    block_device *device = volume->device;
+    bios_parameter_block *bpb = &volume->bpb;
+
+    int entriesUsed = 0;
+    uint64_t firstSector = rootDirectoryOffsetInSectors(bpb);
+
+    // the root directory is read sector by sector
+    for (int i = 0; rootDirectoryEntriesInSector(bpb, i) > 0; i++)
+    {
+        directory_entry *directoryEntryPtr = (directory_entry *)get_sector(device, firstSector + i);
+        if (directoryEntryPtr == NULL)
+        {
+            break;
+        }
+
+        bool returnLinks = false;
+        entriesUsed += iterateEntries(volume, directoryEntryPtr, rootDirectoryEntriesInSector(bpb, i), returnLinks);
+    }
 
     printf("\n");
 
     return entriesUsed;
 }
 
-int ls(const char *buffer, const bios_parameter_block *bpb)
+int ls(fat_session *session)
+{
+    return lsDirEntry(session->volume, session->workingDirectory);
+}
+
+/**
+ * Outputs the size and the free space of the data area, the counters of the FAT table are kept up to date
+ * by every allocation and deletion, so nothing has to be read from the volume.
+ */
+void df(fat_volume *volume)
 {
-    return lsDirEntry(buffer, bpb, workingDirectory);
+    uint32_t totalClusters = volume->fatTable.clusterCount > 2 ? volume->fatTable.clusterCount - 2 : 0;
+    uint64_t bytesPerCluster = (uint64_t)volume->bpb.secPerClus * volume->bpb.bytesPerSec;
+
+    printf("clusters: %" PRIu32 " used: %" PRIu32 " free: %" PRIu32 "\n", totalClusters, totalClusters - volume->fatTable.freeClusters, volume->fatTable.freeClusters);
+    printf("bytes: %" PRIu64 " used: %" PRIu64 " free: %" PRIu64 "\n", totalClusters * bytesPerCluster,
+           (totalClusters - volume->fatTable.freeClusters) * bytesPerCluster, volume->fatTable.freeClusters * bytesPerCluster);
 }
 
-int lsDirEntry(const char *buffer, const bios_parameter_block *bpb, directory_entry *directoryEntry)
+int lsDirEntry(fat_volume *volume, directory_entry *directoryEntry)
 {
     if (directoryEntry == NULL)
     {
-        return outputRootFolder(buffer, bpb);
+        return outputRootFolder(volume);
     }
 
-    return outputFolder(buffer, bpb, directoryEntry->first_logical_cluster);
+    return outputFolder(volume, getFirstCluster(volume, directoryEntry));
 }
 
 /**
- * Find an entry in a directory that is stored in the data area
+ * Updates the free slot hints of a directory that is scanned from its first entry on with the entryCount entries
+ * of a sector at position, stored in cluster (0 in the fixed root directory). Before the scan firstFree is set
+ * to UINT32_MAX and end to 0, see finishSlotHints().
+ *
+ * Every entry a search for a free entry may not take counts as used, including the ones behind a 0x00 entry.
  */
-directory_entry *findEntryInFolder(const char *buffer, bios_parameter_block *bpb, const int firstLogicalClusterIndex, const char *filename)
+void addSlotHints(dir_index *index, const directory_entry *directoryEntryPtr, uint32_t entryCount, uint32_t position, uint32_t cluster)
 {
-    int16_t dataAreaOffsetInBytes = dataAreaOffsetInSectors(bpb) * bpb->bytesPerSec;
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
+    for (uint32_t first = 0; first < entryCount; first += DIR_SCAN_GROUP)
+    {
+        uint32_t count = entryCount - first < DIR_SCAN_GROUP ? entryCount - first : DIR_SCAN_GROUP;
+        dir_slot_masks masks;
+        dir_scan_slots(directoryEntryPtr + first, count, &masks);
 
-    int logicalClusterIndex = firstLogicalClusterIndex;
+        uint64_t freeSlots = masks.free | masks.end;
+        if (index->firstFree == UINT32_MAX && freeSlots != 0)
+        {
+            index->firstFree = position + first + __builtin_ctzll(freeSlots);
+            index->firstFreeCluster = cluster;
+        }
+        if (masks.used != 0)
+        {
+            index->end = position + first + 64 - __builtin_clzll(masks.used);
+        }
+    }
+}
 
-    //while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != 0xFF0 && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-    while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+// completes the hints after all entryCount entries of a directory were added, nextCluster follows its last cluster
+void finishSlotHints(dir_index *index, uint32_t entryCount, uint32_t nextCluster)
+{
+    // a full directory, the cluster it grows by will hold the first free entry
+    if (index->firstFree == UINT32_MAX)
     {
-        // pointer to physical sector
-        char *bufferPtr = buffer;
-        bufferPtr += (dataAreaOffsetInBytes + logicalClusterIndex * bpb->bytesPerSec);
+        index->firstFree = entryCount;
+        index->firstFreeCluster = nextCluster;
+    }
+}
 
-        // convert the filename
-        char convertedFilename[FILENAME_LENGTH];
-        memset(convertedFilename, 0, FILENAME_LENGTH);
-        filenameToFatElevenThree(filename, convertedFilename, FILENAME_LENGTH);
+/**
+ * Scans the directory starting at cluster (0 for the fixed root directory) once and builds the index of its names.
+ *
+ * returns the index, NULL if a sector cannot be read or if out of memory
+ */
+dir_index *buildDirectoryIndex(fat_volume *volume, uint32_t cluster)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
 
-        // cast to directory entry
-        directory_entry *directoryEntryPtr = (directory_entry *)bufferPtr;
-        directory_entry *entry = findDirectoryEntry(directoryEntryPtr, DIR_ENTRIES_PER_SECTOR, convertedFilename);
-        if (entry != NULL)
+    dir_index *index = dir_index_create(&volume->dirIndexes, cluster);
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    index->firstFree = UINT32_MAX;
+    index->end = 0;
+
+    uint32_t entriesPerSector = bpb->bytesPerSec / sizeof(directory_entry);
+    uint32_t logicalClusterIndex = cluster;
+    uint32_t position = 0;
+    int sectorInCluster = 0;
+    for (int sectorIndex = 0;; sectorIndex++)
+    {
+        int64_t sector;
+        uint32_t entryCount;
+        uint32_t sectorCluster = logicalClusterIndex;
+        if (cluster == 0)
         {
-            return entry;
+            entryCount = rootDirectoryEntriesInSector(bpb, sectorIndex);
+            sector = rootDirectoryOffsetInSectors(bpb) + sectorIndex;
+        }
+        else
+        {
+            if (!fat_is_data_cluster(logicalClusterIndex))
+            {
+                break;
+            }
+            entryCount = entriesPerSector;
+            sector = logicalToPhysical(bpb, logicalClusterIndex) + sectorInCluster;
+            if (++sectorInCluster == sectorsPerCluster(bpb))
+            {
+                sectorInCluster = 0;
+                logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+            }
+        }
+        if (entryCount == 0)
+        {
+            break;
         }
 
-        // read next sector in the chain of sectors from the fat
-        logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
-    }
+        directory_entry *directoryEntryPtr = (directory_entry *)get_sector(device, sector);
+        if (directoryEntryPtr == NULL)
+        {
+            dir_index_drop(&volume->dirIndexes, cluster);
+            return NULL;
+        }
+        addSlotHints(index, directoryEntryPtr, entryCount, position, sectorCluster);
+        position += entryCount;
 
-    if (logicalClusterIndex == FAT12_DEFECTIVE_CLUSTER)
-    {
-        printf("Defective cluster detected!\n");
+        // the same entries findDirectoryEntry() looks at, a 0x00 entry ends the search within the sector
+        for (uint32_t first = 0; first < entryCount; first += DIR_SCAN_GROUP)
+        {
+            uint32_t count = entryCount - first < DIR_SCAN_GROUP ? entryCount - first : DIR_SCAN_GROUP;
+            dir_slot_masks masks;
+            dir_scan_slots(directoryEntryPtr + first, count, &masks);
+
+            for (uint64_t live = dir_scan_live(&masks); live != 0; live &= live - 1)
+            {
+                uint32_t i = first + __builtin_ctzll(live);
+                if (dir_index_insert(index, (const char *)directoryEntryPtr[i].filename, (uint64_t)sector * entriesPerSector + i) != 0)
+                {
+                    dir_index_drop(&volume->dirIndexes, cluster);
+                    return NULL;
+                }
+            }
+            if (masks.end != 0)
+            {
+                break;
+            }
+        }
     }
+    finishSlotHints(index, position, logicalClusterIndex);
 
-    return NULL;
+    return index;
 }
 
-void cd(const char *buffer, const bios_parameter_block *bpb, const char *foldername)
+/**
+ * Looks the converted name up in the index of the directory starting at cluster, the index is built on first use.
+ *
+ * returns true if the index answered, with the entry or NULL if there is no entry of that name,
+ *         false if no index is available and the directory has to be scanned
+ */
+bool findIndexedEntry(fat_volume *volume, uint32_t cluster, const char *convertedFilename, directory_entry **outEntry)
 {
-    directory_entry *entry = NULL;
-    if (workingDirectory == NULL)
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    uint32_t entriesPerSector = bpb->bytesPerSec / sizeof(directory_entry);
+
+    // the dentry cache answers without the index of the directory
+    uint64_t slot;
+    if (dentry_cache_lookup(&volume->dentries, cluster, convertedFilename, &slot))
     {
-        // convert the filename
-        char convertedFoldername[FILENAME_LENGTH];
-        memset(convertedFoldername, 0, FILENAME_LENGTH);
-        filenameToFatElevenThree(foldername, convertedFoldername, FILENAME_LENGTH);
+        if (slot == DENTRY_NEGATIVE)
+        {
+            *outEntry = NULL;
+            return true;
+        }
 
-        directory_entry *entries = findRootDirectoryEntries(buffer, bpb);
-        entry = findDirectoryEntry(entries, bpb->rootEntCnt, convertedFoldername);
+        directory_entry *directoryEntryPtr = (directory_entry *)get_sector(device, slot / entriesPerSector);
+        directory_entry *entry = directoryEntryPtr == NULL ? NULL : directoryEntryPtr + slot % entriesPerSector;
+        if (entry != NULL && entry->filename[0] != DIRECTORY_ENTRY_FREE && entry->filename[0] != DIRECTORY_ENTRY_LAST &&
+            strncmp((const char *)entry->filename, convertedFilename, FILENAME_LENGTH) == 0)
+        {
+            *outEntry = entry;
+            return true;
+        }
+        dentry_cache_remove(&volume->dentries, cluster, convertedFilename);
     }
-    else
+
+    dir_index *index = dir_index_find(&volume->dirIndexes, cluster);
+    if (index == NULL)
     {
-        entry = findEntryInFolder(buffer, bpb, workingDirectory->first_logical_cluster, foldername);
+        index = buildDirectoryIndex(volume, cluster);
+        if (index == NULL)
+        {
+            return false;
+        }
     }
 
-    workingDirectory = NULL;
-    if (entry == NULL || isFile(entry))
+    if (!dir_index_lookup(index, convertedFilename, &slot))
     {
-        // convert the filename (for debug output only)
-        char convertedFoldername[FILENAME_LENGTH];
-        memset(convertedFoldername, 0, FILENAME_LENGTH);
-        filenameToFatElevenThree(foldername, convertedFoldername, FILENAME_LENGTH);
+        dentry_cache_insert(&volume->dentries, cluster, convertedFilename, DENTRY_NEGATIVE);
+        *outEntry = NULL;
+        return true;
+    }
 
-        printf("Cannot find folder '%.11s' (%s). It does not exist or is not a folder!\n", convertedFoldername, foldername);
-        return;
+    directory_entry *directoryEntryPtr = (directory_entry *)get_sector(device, slot / entriesPerSector);
+    if (directoryEntryPtr == NULL)
+    {
+        return false;
     }
 
-    // if the user executed cd .. and .. is the root directory, then leave the workingDirectory variable as NULL
-    // if .. points to the root directory, its first logical cluster contains the value 0
-    if (entry->first_logical_cluster == 0)
+    // an index that does not match the entry anymore is dropped, the scan finds the entry instead
+    directory_entry *entry = directoryEntryPtr + slot % entriesPerSector;
+    if (entry->filename[0] == DIRECTORY_ENTRY_FREE || entry->filename[0] == DIRECTORY_ENTRY_LAST ||
+        strncmp((const char *)entry->filename, convertedFilename, FILENAME_LENGTH) != 0)
     {
-        return;
+        dir_index_drop(&volume->dirIndexes, cluster);
+        return false;
     }
 
-    workingDirectory = entry;
+    dentry_cache_insert(&volume->dentries, cluster, convertedFilename, slot);
+    *outEntry = entry;
+    return true;
 }
 
-directory_entry *findFile(const char *buffer, const bios_parameter_block *bpb, const char *filename)
+// adds a new entry of the working directory to the lookup caches, replacing a negative dentry of the name
+void indexNewEntry(fat_session *session, const char *name, uint64_t slot)
 {
-    directory_entry *entry = NULL;
+    fat_volume *volume = session->volume;
 
-    if (workingDirectory == NULL)
+    uint32_t cluster = directoryIndexCluster(volume, session->workingDirectory);
+    dir_index *index = dir_index_find(&volume->dirIndexes, cluster);
+    if (index != NULL && dir_index_insert(index, name, slot) != 0)
     {
-        // convert the filename
-        char convertedFilename[FILENAME_LENGTH];
-        memset(convertedFilename, 0, FILENAME_LENGTH);
-        filenameToFatElevenThree(filename, convertedFilename, FILENAME_LENGTH);
-
-        directory_entry *entries = findRootDirectoryEntries(buffer, bpb);
-        entry = findDirectoryEntry(entries, bpb->rootEntCnt, convertedFilename);
+        dir_index_drop(&volume->dirIndexes, cluster);
     }
-    else
+    dentry_cache_insert(&volume->dentries, cluster, name, slot);
+}
+
+// removes an entry of the working directory from the lookup caches, the name is known to be missing afterwards
+void forgetEntry(fat_session *session, const char *name)
+{
+    fat_volume *volume = session->volume;
+
+    uint32_t cluster = directoryIndexCluster(volume, session->workingDirectory);
+    dir_index *index = dir_index_find(&volume->dirIndexes, cluster);
+    if (index != NULL)
     {
-        entry = findEntryInFolder(buffer, bpb, workingDirectory->first_logical_cluster, filename);
+        dir_index_remove(index, name);
     }
+    dentry_cache_insert(&volume->dentries, cluster, name, DENTRY_NEGATIVE);
+}
 
-    return entry;
+// forgets everything the lookup caches know about the entries of the directory starting at cluster
+void forgetDirectory(fat_volume *volume, uint32_t cluster)
+{
+    dir_index_drop(&volume->dirIndexes, cluster);
+    dentry_cache_drop_parent(&volume->dentries, cluster);
 }
 
-void outputFileByName(const char *buffer, const bios_parameter_block *bpb, const char *filename)
+// the working directory grew by logicalCluster, if it was full the caller takes the first entry of that cluster
+void noteGrownDirectory(fat_session *session, uint32_t logicalCluster)
 {
-    directory_entry *entry = findFile(buffer, bpb, filename);
+    fat_volume *volume = session->volume;
 
-    if (entry == NULL || isNotFile(entry))
+    dir_index *index = dir_index_find(&volume->dirIndexes, directoryIndexCluster(volume, session->workingDirectory));
+    if (index != NULL && !fat_is_data_cluster(index->firstFreeCluster))
     {
-        // convert the filename (for debug output only)
-        char convertedFilename[FILENAME_LENGTH];
-        memset(convertedFilename, 0, FILENAME_LENGTH);
-        filenameToFatElevenThree(filename, convertedFilename, FILENAME_LENGTH);
-
+        index->firstFreeCluster = logicalCluster;
+        if (index->end < index->firstFree + 1)
+        {
+            index->end = index->firstFree + 1;
+        }
+    }
+}
+
+/**
+ * Find an entry in a directory that is stored in the data area
+ */
+directory_entry *findEntryInFolder(fat_volume *volume, const int firstLogicalClusterIndex, const char *filename)
+{
+    block_device *device = volume->device;
+    bios_parameter_block *bpb = &volume->bpb;
+
+    // convert the filename
+    char convertedFilename[FILENAME_LENGTH];
+    memset(convertedFilename, 0, FILENAME_LENGTH);
+    filenameToFatElevenThree(filename, convertedFilename, FILENAME_LENGTH);
+
+    directory_entry *indexedEntry;
+    if (fat_is_data_cluster(firstLogicalClusterIndex) && findIndexedEntry(volume, firstLogicalClusterIndex, convertedFilename, &indexedEntry))
+    {
+        return indexedEntry;
+    }
+
+    int logicalClusterIndex = firstLogicalClusterIndex;
+
+    //while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != 0xFF0 && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+    while (fat_is_data_cluster(logicalClusterIndex))
+    {
+        int64_t firstSector = logicalToPhysical(bpb, logicalClusterIndex);
+        for (int sectorIndex = 0; sectorIndex < sectorsPerCluster(bpb); sectorIndex++)
+        {
+            // pointer to physical sector
+            char *bufferPtr = get_sector(device, firstSector + sectorIndex);
+            if (bufferPtr == NULL)
+            {
+                return NULL;
+            }
+
+            // cast to directory entry
+            directory_entry *directoryEntryPtr = (directory_entry *)bufferPtr;
+            directory_entry *entry = findDirectoryEntry(directoryEntryPtr, dirEntriesPerSector(bpb), convertedFilename);
+            if (entry != NULL)
+            {
+                return entry;
+            }
+        }
+
+        // read next sector in the chain of sectors from the fat
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+    }
+
+    if (logicalClusterIndex == FAT_BAD_CLUSTER)
+    {
+        printf("Defective cluster detected!\n");
+    }
+
+    return NULL;
+}
+
+/**
+ * Find an entry in the root directory
+ */
+directory_entry *findEntryInRootFolder(fat_volume *volume, const char *filename)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    // convert the filename
+    char convertedFilename[FILENAME_LENGTH];
+    memset(convertedFilename, 0, FILENAME_LENGTH);
+    filenameToFatElevenThree(filename, convertedFilename, FILENAME_LENGTH);
+
+    directory_entry *indexedEntry;
+    if (findIndexedEntry(volume, 0, convertedFilename, &indexedEntry))
+    {
+        return indexedEntry;
+    }
+
+    uint64_t firstSector = rootDirectoryOffsetInSectors(bpb);
+
+    for (int i = 0; rootDirectoryEntriesInSector(bpb, i) > 0; i++)
+    {
+        directory_entry *directoryEntryPtr = (directory_entry *)get_sector(device, firstSector + i);
+        if (directoryEntryPtr == NULL)
+        {
+            break;
+        }
+
+        directory_entry *entry = findDirectoryEntry(directoryEntryPtr, rootDirectoryEntriesInSector(bpb, i), convertedFilename);
+        if (entry != NULL)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Resolves a path of names separated by '/' such as A/B/C.TXT to the directory entry of its last component.
+ * Relative paths start in the working directory, paths starting with '/' in the root directory.
+ * Every component is looked up through the dentry cache, the working directory does not change.
+ *
+ * The entry lives in the sector cache like the result of findFile(), it is valid until the next sector is read.
+ *
+ * returns 0 on success, outEntry is the root directory (NULL on FAT12 and FAT16, like workingDirectory) if the path ends there,
+ *         -1 if a component does not exist or a component before the last one is not a folder
+ */
+int resolvePath(fat_session *session, const char *path, directory_entry **outEntry)
+{
+    fat_volume *volume = session->volume;
+
+    directory_entry *directory = path[0] == '/' ? rootDirectory(volume) : session->workingDirectory;
+
+    // longer names are cut to 8.3 anyway, but not in the middle of a component
+    char component[256];
+
+    const char *next = path;
+    while (*next != '\0')
+    {
+        const char *separator = strchr(next, '/');
+        size_t length = separator == NULL ? strlen(next) : (size_t)(separator - next);
+        if (length == 0)
+        {
+            next++;
+            continue;
+        }
+        if (length >= sizeof(component) || (directory != NULL && !isDirectory(directory)))
+        {
+            return -1;
+        }
+        memcpy(component, next, length);
+        component[length] = '\0';
+        next += length;
+
+        directory_entry *entry = NULL;
+        if (directory == NULL)
+        {
+            entry = findEntryInRootFolder(volume, component);
+        }
+        else
+        {
+            entry = findEntryInFolder(volume, getFirstCluster(volume, directory), component);
+        }
+        if (entry == NULL)
+        {
+            return -1;
+        }
+
+        // .. entries store 0 for the root directory
+        directory = isDirectory(entry) && getFirstCluster(volume, entry) == 0 ? rootDirectory(volume) : entry;
+    }
+
+    *outEntry = directory;
+    return 0;
+}
+
+void cd(fat_session *session, const char *foldername)
+{
+    fat_volume *volume = session->volume;
+
+    directory_entry *entry = NULL;
+    int result = resolvePath(session, foldername, &entry);
+
+    changeToRootDirectory(session);
+    if (result != 0 || (entry != NULL && isFile(entry)))
+    {
+        // convert the filename (for debug output only)
+        char convertedFoldername[FILENAME_LENGTH];
+        memset(convertedFoldername, 0, FILENAME_LENGTH);
+        filenameToFatElevenThree(foldername, convertedFoldername, FILENAME_LENGTH);
+
+        printf("Cannot find folder '%.11s' (%s). It does not exist or is not a folder!\n", convertedFoldername, foldername);
+        return;
+    }
+
+    // if the user executed cd .. and .. is the root directory, then stay in the root directory
+    if (entry == NULL || entry == &volume->rootDirectoryEntry)
+    {
+        return;
+    }
+
+    // the entry lives in a sector that might be evicted from the sector cache, keep a copy
+    session->workingDirectoryEntry = *entry;
+    session->workingDirectory = &session->workingDirectoryEntry;
+}
+
+directory_entry *findFile(fat_session *session, const char *filename)
+{
+    fat_volume *volume = session->volume;
+
+    directory_entry *entry = NULL;
+
+    if (session->workingDirectory == NULL)
+    {
+        entry = findEntryInRootFolder(volume, filename);
+    }
+    else
+    {
+        entry = findEntryInFolder(volume, getFirstCluster(volume, session->workingDirectory), filename);
+    }
+
+    return entry;
+}
+
+void outputFileByName(fat_session *session, const char *filename)
+{
+    fat_volume *volume = session->volume;
+
+    directory_entry *entry = NULL;
+    if (resolvePath(session, filename, &entry) != 0)
+    {
+        entry = NULL;
+    }
+
+    if (entry == NULL || isNotFile(entry))
+    {
+        // convert the filename (for debug output only)
+        char convertedFilename[FILENAME_LENGTH];
+        memset(convertedFilename, 0, FILENAME_LENGTH);
+        filenameToFatElevenThree(filename, convertedFilename, FILENAME_LENGTH);
+
         printf("Cannot find file '%.11s' (%s). It does not exist or is not a file!\n", convertedFilename, filename);
         return;
     }
 
     // security check
-    if (entry->first_logical_cluster == 0)
+    if (getFirstCluster(volume, entry) == 0)
     {
         return;
     }
 
-    outputFile(buffer, bpb, entry->first_logical_cluster);
+    catFile(volume, entry);
+}
+
+/**
+ * Finds a free entry of the working directory starting at the hints of its index instead of the first entry.
+ * Entries at or behind the end of the used entries are free without looking at them. The hints move on to
+ * the entry found, which the caller is going to use.
+ *
+ * returns the free entry or NULL if the directory is full, slot receives sector * entries per sector + index of the entry
+ */
+directory_entry *findHintedFreeDirEntry(fat_session *session, dir_index *index, uint64_t *slot)
+{
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    uint32_t entriesPerSector = bpb->bytesPerSec / sizeof(directory_entry);
+    uint32_t entriesPerCluster = entriesPerSector * sectorsPerCluster(bpb);
+    uint32_t position = index->firstFree;
+    uint32_t logicalClusterIndex = index->firstFreeCluster;
+
+    for (;;)
+    {
+        int64_t sector;
+        uint32_t entryCount;
+        if (session->workingDirectory == NULL)
+        {
+            if (position >= bpb->rootEntCnt)
+            {
+                break;
+            }
+            sector = rootDirectoryOffsetInSectors(bpb) + position / entriesPerSector;
+            entryCount = rootDirectoryEntriesInSector(bpb, position / entriesPerSector);
+        }
+        else
+        {
+            if (!fat_is_data_cluster(logicalClusterIndex))
+            {
+                break;
+            }
+            sector = logicalToPhysical(bpb, logicalClusterIndex) + position % entriesPerCluster / entriesPerSector;
+            entryCount = entriesPerSector;
+        }
+
+        directory_entry *directoryEntryPtr = (directory_entry *)get_sector(device, sector);
+        if (directoryEntryPtr == NULL)
+        {
+            return NULL;
+        }
+
+        // only the entries in front of the end of the used entries have to be looked at
+        uint32_t offset = position % entriesPerSector;
+        uint32_t left = entryCount - offset;
+        uint32_t scanned = index->end > position ? index->end - position : 0;
+        scanned = scanned < left ? scanned : left;
+        int i = firstFreeDirectoryEntry(directoryEntryPtr + offset, scanned);
+        if (i < 0 && scanned < left)
+        {
+            i = scanned;
+        }
+        if (i >= 0)
+        {
+            index->firstFree = position + i;
+            index->firstFreeCluster = logicalClusterIndex;
+            if (index->end < index->firstFree + 1)
+            {
+                index->end = index->firstFree + 1;
+            }
+
+            *slot = (uint64_t)sector * entriesPerSector + offset + i;
+            return directoryEntryPtr + offset + i;
+        }
+
+        position += left;
+        if (session->workingDirectory != NULL && position % entriesPerCluster == 0)
+        {
+            logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+        }
+    }
+
+    // the directory is full, the cluster it grows by will hold the first free entry
+    index->firstFree = position;
+    index->firstFreeCluster = logicalClusterIndex;
+    return NULL;
 }
 
 /**
@@ -623,69 +1107,98 @@ void outputFileByName(const char *buffer, const bios_parameter_block *bpb, const
  * A cluster/sector is 512 bytes, a directory entry is 32 bytes, it follows that a cluster/sector
  *     can store up to 16 entries.
  * 
- * returns the free entry or NULL if nothing is free
+ * returns the free entry or NULL if nothing is free, slot receives sector * entries per sector + index of the entry
  */
-directory_entry *findFreeDirEntry(const char *buffer, const bios_parameter_block *bpb)
+directory_entry *findFreeDirEntry(fat_session *session, uint64_t *slot)
 {
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    // with the hints of the index, adding entries one after another does not rescan the directory every time
+    uint32_t cluster = directoryIndexCluster(volume, session->workingDirectory);
+    dir_index *index = dir_index_find(&volume->dirIndexes, cluster);
+    if (index == NULL)
+    {
+        index = buildDirectoryIndex(volume, cluster);
+    }
+    if (index != NULL)
+    {
+        return findHintedFreeDirEntry(session, index, slot);
+    }
+
     directory_entry *directoryEntryPtr = NULL;
     bool found = false;
+    uint32_t entriesPerSector = bpb->bytesPerSec / sizeof(directory_entry);
 
     // if the workingDirectory variable is NULL, it means that the user is currently looking at the root directory
-    if (workingDirectory == NULL)
+    if (session->workingDirectory == NULL)
     {
-        directoryEntryPtr = findRootDirectoryEntries(buffer, bpb);
+        uint64_t firstSector = rootDirectoryOffsetInSectors(bpb);
 
-        for (int i = 0; i < bpb->rootEntCnt; i++)
+        for (int sectorIndex = 0; !found && rootDirectoryEntriesInSector(bpb, sectorIndex) > 0; sectorIndex++)
         {
+            directoryEntryPtr = (directory_entry *)get_sector(device, firstSector + sectorIndex);
+            if (directoryEntryPtr == NULL)
+            {
+                break;
+            }
+
             // If the first byte of the Filename field is 0xE5, then the directory entry is free
             // (i.e., currently unused)
             //
             // If the first byte of the Filename field is 0x00, then this directory entry is free and all
             // the remaining directory entries in this directory are also free.
-            if (directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_FREE || directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_LAST)
+            int i = firstFreeDirectoryEntry(directoryEntryPtr, rootDirectoryEntriesInSector(bpb, sectorIndex));
+            if (i >= 0)
             {
+                directoryEntryPtr += i;
+                *slot = (firstSector + sectorIndex) * entriesPerSector + i;
                 found = true;
-                break;
             }
-
-            directoryEntryPtr++;
         }
     }
     else
     {
-
-        int16_t dataAreaOffsetInBytes = dataAreaOffsetInSectors(bpb) * bpb->bytesPerSec;
-        uint16_t firstFatOffset = fatOffset(bpb, 0);
-
-        int logicalClusterIndex = workingDirectory->first_logical_cluster;
+        int logicalClusterIndex = getFirstCluster(volume, session->workingDirectory);
 
         //while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != 0xFF0 && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-        while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+        while (fat_is_data_cluster(logicalClusterIndex))
         {
-            // pointer to physical sector
-            char *bufferPtr = buffer;
-            bufferPtr += (dataAreaOffsetInBytes + logicalClusterIndex * bpb->bytesPerSec);
+            int64_t firstSector = logicalToPhysical(bpb, logicalClusterIndex);
+            for (int sectorIndex = 0; !found && sectorIndex < sectorsPerCluster(bpb); sectorIndex++)
+            {
+                // pointer to physical sector
+                char *bufferPtr = get_sector(device, firstSector + sectorIndex);
+                if (bufferPtr == NULL)
+                {
+                    return NULL;
+                }
 
-            directoryEntryPtr = (directory_entry *)bufferPtr;
+                directoryEntryPtr = (directory_entry *)bufferPtr;
 
-            for (int i = 0; i < DIR_ENTRIES_PER_SECTOR; i++)
-            {
                 // If the first byte of the Filename field is 0xE5, then the directory entry is free
                 // (i.e., currently unused)
                 //
                 // If the first byte of the Filename field is 0x00, then this directory entry is free and all
                 // the remaining directory entries in this directory are also free.
-                if (directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_FREE || directoryEntryPtr->filename[0] == DIRECTORY_ENTRY_LAST)
+                int i = firstFreeDirectoryEntry(directoryEntryPtr, dirEntriesPerSector(bpb));
+                if (i >= 0)
                 {
+                    directoryEntryPtr += i;
+                    *slot = (uint64_t)(firstSector + sectorIndex) * entriesPerSector + i;
                     found = true;
-                    break;
                 }
+            }
 
-                directoryEntryPtr++;
+            // stop at the first free entry, do not move on to the next sector
+            if (found)
+            {
+                break;
             }
 
             // read next sector in the chain of sectors from the fat
-            logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
+            logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
         }
 
         // int16_t logicalClusterIndex = workingDirectory->first_logical_cluster;
@@ -726,58 +1239,33 @@ directory_entry *findFreeDirEntry(const char *buffer, const bios_parameter_block
  * 
  * returns the logical index of the free cluster or -1 if there is no free cluster left
  */
-int16_t findFreeLogicalCluster(const char *buffer, const bios_parameter_block *bpb)
+int32_t findFreeLogicalCluster(fat_volume *volume)
 {
-    // one fat is sectory per fat multiplied by bytes per sector
-    int fatSizeInBytes = bpb->secPerFat * bpb->bytesPerSec;
-
-    // offset to fat
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
-
-    // every three bytes in the fat contain two entries
-    for (int i = 0; i < (fatSizeInBytes / 3 * 2); i++)
-    {
-        // value of zero means the FAT contains a free entry at this logical index
-        int value = readFAT12Entry(buffer, firstFatOffset, i);
-        if (value == 0)
-        {
-            return i;
-        }
-    }
-
-    return -1;
+    // next-fit, the search continues behind the last allocated cluster
+    return fat_table_next_free(&volume->fatTable);
 }
 
-void writeFAT(const char *buffer, const bios_parameter_block *bpb, int16_t chainStart, int16_t newValue)
+void writeFAT(fat_volume *volume, int32_t chainStart, uint32_t newValue)
 {
-    int16_t dataAreaOffsetInBytes = dataAreaOffsetInSectors(bpb) * bpb->bytesPerSec;
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
 
     int oldLogicalClusterIndex = chainStart;
     int logicalClusterIndex = chainStart;
 
     //while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != 0xFF0 && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-    while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+    while (fat_is_data_cluster(logicalClusterIndex))
     {
-        // print the physical sector
-        char *bufferPtr = buffer;
-        bufferPtr += (dataAreaOffsetInBytes + logicalClusterIndex * bpb->bytesPerSec);
-
         // read next sector in the chain of sectors from the fat
         oldLogicalClusterIndex = logicalClusterIndex;
-        logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
     }
 
-    if (logicalClusterIndex == FAT12_DEFECTIVE_CLUSTER)
+    if (logicalClusterIndex == FAT_BAD_CLUSTER)
     {
         printf("Defective cluster detected!\n");
         return;
     }
 
-    for (int i = 0; i < bpb->numFats; i++)
-    {
-        writeFAT12Entry(buffer, fatOffset(bpb, i), oldLogicalClusterIndex, newValue);
-    }
+    fat_table_set(&volume->fatTable, oldLogicalClusterIndex, newValue);
 }
 
 /**
@@ -788,30 +1276,26 @@ void writeFAT(const char *buffer, const bios_parameter_block *bpb, int16_t chain
  * 
  * entry->first_logical_cluster - the start of the chain to append a cluster/sector to
  */
-int16_t appendClusterSectorToChain(const char *buffer, const bios_parameter_block *bpb, directory_entry *entry)
+int32_t appendClusterSectorToChain(fat_volume *volume, directory_entry *entry)
 {
-    int16_t freeLogicalIndex = findFreeLogicalCluster(buffer, bpb);
+    int32_t freeLogicalIndex = findFreeLogicalCluster(volume);
     if (freeLogicalIndex == -1)
     {
         return -1;
     }
 
-    writeFAT(buffer, bpb, entry->first_logical_cluster, freeLogicalIndex);
-    writeFAT(buffer, bpb, freeLogicalIndex, FAT12_LAST_CLUSTER_IN_CHAIN);
+    writeFAT(volume, getFirstCluster(volume, entry), freeLogicalIndex);
+    writeFAT(volume, freeLogicalIndex, FAT_END_OF_CHAIN);
     //outputFat(buffer, bpb);
 
     return freeLogicalIndex;
 }
 
-char *initializeDirectorySector(const char *buffer, const bios_parameter_block *bpb, const bool addLinks, const int16_t logicalCluster, const int16_t parentLogicalCluster)
+// marks all directory entries of a sector as free
+void initializeDirectoryEntries(const bios_parameter_block *bpb, directory_entry *directoryEntryPtr)
 {
-    // write empty directory entries into the sector
-    int16_t physicalSector = logicalToPhysical(bpb, logicalCluster);
-    char *ptr = buffer + (physicalSector * bpb->bytesPerSec);
-    directory_entry *directoryEntryPtr = (directory_entry *)ptr;
-
     // initialize all entries
-    for (int i = 0; i < (bpb->bytesPerSec / sizeof(directory_entry)); i++)
+    for (int i = 0; i < dirEntriesPerSector(bpb); i++)
     {
         // clear entry
         memset(directoryEntryPtr, 0, sizeof(directory_entry));
@@ -823,27 +1307,65 @@ char *initializeDirectorySector(const char *buffer, const bios_parameter_block *
         // go to the next entry
         directoryEntryPtr++;
     }
+}
+
+/**
+ * Writes empty directory entries into all sectors of the cluster, with addLinks the first sector starts with . and ..
+ *
+ * returns the first sector of the cluster, NULL on error
+ */
+char *initializeDirectorySector(fat_volume *volume, const bool addLinks, const int32_t logicalCluster, const int32_t parentLogicalCluster)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    // the sectors after the first one are written completely and do not have to be read
+    int64_t firstSector = logicalToPhysical(bpb, logicalCluster);
+    for (int sectorIndex = sectorsPerCluster(bpb) - 1; sectorIndex > 0; sectorIndex--)
+    {
+        char *ptr = get_sector_for_overwrite(device, firstSector + sectorIndex);
+        if (ptr == NULL)
+        {
+            return NULL;
+        }
+        initializeDirectoryEntries(bpb, (directory_entry *)ptr);
+        put_sector(device, ptr);
+    }
+
+    // write empty directory entries into the first sector
+    char *ptr = get_sector(device, firstSector);
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+    initializeDirectoryEntries(bpb, (directory_entry *)ptr);
 
     if (addLinks)
     {
         directory_entry *firstEntryPtr = (directory_entry *)ptr;
         firstEntryPtr->filename[0] = '.';
-        firstEntryPtr->first_logical_cluster = logicalCluster;
+        setFirstCluster(volume, firstEntryPtr, logicalCluster);
 
         directory_entry *secondEntryPtr = (directory_entry *)ptr;
         secondEntryPtr++;
         secondEntryPtr->filename[0] = '.';
         secondEntryPtr->filename[1] = '.';
-        secondEntryPtr->first_logical_cluster = parentLogicalCluster;
+        setFirstCluster(volume, secondEntryPtr, parentLogicalCluster);
     }
 
+    put_sector(device, ptr);
+
     return ptr;
 }
 
-directory_entry *prepareDirectoryEntry(const char *buffer, const bios_parameter_block *bpb)
+directory_entry *prepareDirectoryEntry(fat_session *session, uint64_t *slot)
 {
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
     // find a free directory entry
-    directory_entry *directoryEntry = findFreeDirEntry(buffer, bpb);
+    directory_entry *directoryEntry = findFreeDirEntry(session, slot);
 
     // could retrieve entry
     if (directoryEntry != NULL)
@@ -851,6 +1373,7 @@ directory_entry *prepareDirectoryEntry(const char *buffer, const bios_parameter_
         // clear the directory entry
         memset(directoryEntry, 0, sizeof(directory_entry));
         directoryEntry->filename[0] = DIRECTORY_ENTRY_FREE;
+        put_sector(device, (char *)directoryEntry);
 
         return directoryEntry;
     }
@@ -858,7 +1381,7 @@ directory_entry *prepareDirectoryEntry(const char *buffer, const bios_parameter_
     // if no directory entry is free, try to create one
 
     // in root directory or not?
-    if (workingDirectory == NULL)
+    if (session->workingDirectory == NULL)
     {
         // if the root directory is full, there is no way to add an entry
         // as the root directory is fixed in size and cannot grow as files or folders stored
@@ -870,7 +1393,7 @@ directory_entry *prepareDirectoryEntry(const char *buffer, const bios_parameter_
     {
         // if this is a folder in the data area and not in the root directory, add a sector
         // TEST, create a folder and add more than 16 records to it, record 17 will hit this branch
-        int16_t logicalCluster = appendClusterSectorToChain(buffer, bpb, workingDirectory);
+        int32_t logicalCluster = appendClusterSectorToChain(volume, session->workingDirectory);
         if (logicalCluster == -1)
         {
             printf("Cannot create new folder! No space left!\n");
@@ -878,15 +1401,22 @@ directory_entry *prepareDirectoryEntry(const char *buffer, const bios_parameter_
         }
 
         bool addLinks = false;
-        char *ptr = initializeDirectorySector(buffer, bpb, addLinks, logicalCluster, workingDirectory == NULL ? 0 : workingDirectory->first_logical_cluster);
+        char *ptr = initializeDirectorySector(volume, addLinks, logicalCluster, parentLinkCluster(volume, session->workingDirectory));
+        if (ptr == NULL)
+        {
+            return NULL;
+        }
+        noteGrownDirectory(session, logicalCluster);
 
         // set the pointer to the first entry
         directoryEntry = (directory_entry *)ptr;
+        *slot = (uint64_t)logicalToPhysical(bpb, logicalCluster) * (bpb->bytesPerSec / sizeof(directory_entry));
     }
 
     // clear the directory entry
     memset(directoryEntry, 0, sizeof(directory_entry));
     directoryEntry->filename[0] = DIRECTORY_ENTRY_FREE;
+    put_sector(device, (char *)directoryEntry);
 
     return directoryEntry;
 }
@@ -904,14 +1434,21 @@ directory_entry *prepareDirectoryEntry(const char *buffer, const bios_parameter_
  *   - create a directory entry in the current directory and save the logical cluster into it, along with the changed folder name
  *     For this operation, remember to update all FATs!
  */
-void mkdir(const char *buffer, const bios_parameter_block *bpb, const char *foldername)
+void mkdir(fat_session *session, const char *foldername)
 {
-    directory_entry *directoryEntry = prepareDirectoryEntry(buffer, bpb);
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+
+    uint64_t slot;
+    directory_entry *directoryEntry = prepareDirectoryEntry(session, &slot);
     if (directoryEntry == NULL)
     {
         return;
     }
 
+    // searching the FAT must not evict the sector that holds the new entry
+    pin_sector(device, (char *)directoryEntry);
+
     // convert the filename
     char convertedFoldername[FILENAME_LENGTH];
     memset(convertedFoldername, 0, FILENAME_LENGTH);
@@ -919,26 +1456,34 @@ void mkdir(const char *buffer, const bios_parameter_block *bpb, const char *fold
 
     // set the filename
     memcpy(directoryEntry->filename, convertedFoldername, FILENAME_LENGTH);
+    indexNewEntry(session, convertedFoldername, slot);
 
     // set the flags, make it a directory
     directoryEntry->attributes |= DIRECTORY_FLAG;
 
     // find a free cluster in the data area, attach it to the directory entry
-    int16_t freeSectorLogicalIndex = findFreeLogicalCluster(buffer, bpb);
+    int32_t freeSectorLogicalIndex = findFreeLogicalCluster(volume);
     if (freeSectorLogicalIndex == -1)
     {
         printf("Cannot create new folder! No free sectors are left!\n");
+        put_sector(device, (char *)directoryEntry);
+        unpin_sector(device, (char *)directoryEntry);
         return;
     }
-    directoryEntry->first_logical_cluster = freeSectorLogicalIndex;
+    setFirstCluster(volume, directoryEntry, freeSectorLogicalIndex);
+    put_sector(device, (char *)directoryEntry);
+    unpin_sector(device, (char *)directoryEntry);
+
+    // the cluster may have belonged to a deleted folder, the lookup caches do not describe the new one
+    forgetDirectory(volume, freeSectorLogicalIndex);
 
     // write the last sector marker 0xFFF into the FAT to show that the new folder currently only
     // uses this one sector
-    writeFAT(buffer, bpb, freeSectorLogicalIndex, 0xFFF);
+    writeFAT(volume, freeSectorLogicalIndex, FAT_END_OF_CHAIN);
 
     // insert directory entries into the sector
     bool addLinks = true;
-    initializeDirectorySector(buffer, bpb, addLinks, freeSectorLogicalIndex, workingDirectory == NULL ? 0 : workingDirectory->first_logical_cluster);
+    initializeDirectorySector(volume, addLinks, freeSectorLogicalIndex, parentLinkCluster(volume, session->workingDirectory));
 }
 
 /**
@@ -957,8 +1502,10 @@ void mkdir(const char *buffer, const bios_parameter_block *bpb, const char *fold
  * 
  * Delete the entire cluster chain of the folder.
  */
-void rmdir(const char *buffer, const bios_parameter_block *bpb, const char *filename)
+void rmdir(fat_session *session, const char *filename)
 {
+    fat_volume *volume = session->volume;
+
     // cannot delete the parent folder
     if (strlen(filename) == 2 && strcmp(filename, "..") == 0)
     {
@@ -971,7 +1518,7 @@ void rmdir(const char *buffer, const bios_parameter_block *bpb, const char *file
         return;
     }
 
-    directory_entry *directoryEntry = findFile(buffer, bpb, filename);
+    directory_entry *directoryEntry = findFile(session, filename);
 
     // if the file does not exist, return
     if (directoryEntry == NULL)
@@ -986,14 +1533,14 @@ void rmdir(const char *buffer, const bios_parameter_block *bpb, const char *file
     }
 
     // if the directory is not empty, return
-    int entriesUsed = lsDirEntry(buffer, bpb, directoryEntry);
+    int entriesUsed = lsDirEntry(volume, directoryEntry);
     if (entriesUsed > 0)
     {
         printf("Cannot delete the folder because it is not empty!\n");
         return;
     }
 
-    rm(buffer, bpb, filename);
+    rm(session, filename);
 }
 
 /**
@@ -1017,15 +1564,18 @@ void rmdir(const char *buffer, const bios_parameter_block *bpb, const char *file
  * 
  * 5. set the timestamps in the directory entry
  */
-int touch(const char *buffer, const bios_parameter_block *bpb, const char *filename, directory_entry **outDirectoryEntry)
+int touch(fat_session *session, const char *filename, directory_entry **outDirectoryEntry)
 {
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+
     if (strlen(filename) == 0)
     {
         printf("Cannot create new file because no filename was specified!\n");
         return -1;
     }
 
-    directory_entry *directoryEntry = findFile(buffer, bpb, filename);
+    directory_entry *directoryEntry = findFile(session, filename);
     if (directoryEntry != NULL)
     {
         // convert the filename
@@ -1046,25 +1596,30 @@ int touch(const char *buffer, const bios_parameter_block *bpb, const char *filen
     }
 
     // find a free directory entry
-    directoryEntry = prepareDirectoryEntry(buffer, bpb);
+    uint64_t slot;
+    directoryEntry = prepareDirectoryEntry(session, &slot);
     if (directoryEntry == NULL)
     {
         printf("Cannot create new file! There is no space for a directory entry left!\n");
         return -3;
     }
 
+    // searching the FAT must not evict the sector that holds the new entry
+    pin_sector(device, (char *)directoryEntry);
+
     // create and attach a cluster
-    int16_t freeSectorLogicalIndex = findFreeLogicalCluster(buffer, bpb);
+    int32_t freeSectorLogicalIndex = findFreeLogicalCluster(volume);
     if (freeSectorLogicalIndex == -1)
     {
         printf("Cannot create new file! No free sectors are left!\n");
+        unpin_sector(device, (char *)directoryEntry);
         return -4;
     }
-    directoryEntry->first_logical_cluster = freeSectorLogicalIndex;
+    setFirstCluster(volume, directoryEntry, freeSectorLogicalIndex);
 
     // write the last sector marker 0xFFF into the FAT to show that the new file currently only
     // uses this one sector
-    writeFAT(buffer, bpb, freeSectorLogicalIndex, FAT12_LAST_CLUSTER_IN_CHAIN);
+    writeFAT(volume, freeSectorLogicalIndex, FAT_END_OF_CHAIN);
 
     // convert the filename
     char convertedName[FILENAME_LENGTH];
@@ -1073,6 +1628,9 @@ int touch(const char *buffer, const bios_parameter_block *bpb, const char *filen
 
     // set the filename
     memcpy(directoryEntry->filename, convertedName, FILENAME_LENGTH);
+    put_sector(device, (char *)directoryEntry);
+    unpin_sector(device, (char *)directoryEntry);
+    indexNewEntry(session, convertedName, slot);
 
     // fill the out parameter
     if (outDirectoryEntry != NULL)
@@ -1084,215 +1642,2006 @@ int touch(const char *buffer, const bios_parameter_block *bpb, const char *filen
 }
 
 /**
- * Appends data to a file
- * 
- * If the file does not exist in the working directory, touch it (call touch())
- * 
- * get the last sector from the cluster chain
- * append to that sector if the data fits
- * 
- * If the data does not fit, call appendClusterSectorToChain() and write the data
- * 
- * update the filesize
+ * Opens the file the directory entry belongs to, see openFile()
+ *
+ * returns 0 on success, error codes are negative integers
  */
-int appendToFile(const char *buffer, const bios_parameter_block *bpb, const char *filename, const char *data, const int dataLen)
+int openEntry(fat_volume *volume, directory_entry *directoryEntry, file_handle *handle)
 {
-    int bytesWritten = 0;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
 
-    if (dataLen <= 0)
+    memset(handle, 0, sizeof(file_handle));
+
+    // the data written through the handle passes through the sector cache, keep the directory entry around
+    pin_sector(device, (char *)directoryEntry);
+
+    // find the logical index of the last cluster
+    int logicalIndex = findLastCluster(volume, directoryEntry);
+    if (logicalIndex < 0)
     {
-        printf("dataLen is negative or zero! Aborting write!\n");
-        return bytesWritten;
+        unpin_sector(device, (char *)directoryEntry);
+        return -3;
     }
 
-    directory_entry *directoryEntry = NULL;
-    if (touch(buffer, bpb, filename, &directoryEntry) < 0)
+    handle->buffer = (char *)malloc(bpb->bytesPerSec);
+    if (handle->buffer == NULL)
     {
-        // convert the filename
-        char convertedName[FILENAME_LENGTH];
-        memset(convertedName, 0, FILENAME_LENGTH);
-        filenameToFatElevenThree(filename, convertedName, FILENAME_LENGTH);
+        unpin_sector(device, (char *)directoryEntry);
+        return -4;
+    }
 
-        printf("Cannot find or create file %s!\n", convertedName);
-        return bytesWritten;
+    // determine how many bytes are used in that cluster, a file whose size is a multiple of the cluster size fills its last cluster
+    int bytesUsed = directoryEntry->filesize % bytesPerCluster(bpb);
+    if (directoryEntry->filesize > 0 && bytesUsed == 0)
+    {
+        bytesUsed = bytesPerCluster(bpb);
     }
 
-    // find the logical index of the last cluster
-    int logicalIndex = findLastCluster(buffer, bpb, directoryEntry);
+    handle->entry = directoryEntry;
+    handle->lastCluster = logicalIndex;
+    handle->clusterOffset = bytesUsed;
 
+    return 0;
+}
+
+/**
+ * Opens a file of the working directory for reading and appending, with create the file is created if it does not exist.
+ *
+ * The handle keeps the directory entry pinned and remembers the last cluster of the chain and how many
+ * bytes of it are used, so that writeFile() neither looks the file up nor walks the chain again.
+ *
+ * returns 0 on success, error codes are negative integers
+ */
+int openFile(fat_session *session, const char *filename, bool create, file_handle *handle)
+{
+    fat_volume *volume = session->volume;
+
+    memset(handle, 0, sizeof(file_handle));
+
+    directory_entry *directoryEntry = findFile(session, filename);
+    if (directoryEntry == NULL && !create)
+    {
+        printf("Cannot open %s, the file does not exist!\n", filename);
+        return -1;
+    }
+    if (directoryEntry == NULL && touch(session, filename, &directoryEntry) < 0)
+    {
+        return -1;
+    }
+    if (isDirectory(directoryEntry))
+    {
+        printf("Cannot open %s, it is a directory!\n", filename);
+        return -2;
+    }
+
+    return openEntry(volume, directoryEntry, handle);
+}
+
+/**
+ * Appends data behind the last cluster of the handle without buffering
+ *
+ * If the data does not fit into the last cluster, all clusters the rest of the data needs are allocated at once,
+ * preferably as one contiguous run (see fat_table_allocate()), and linked to the chain before the data is written.
+ *
+ * returns the amount of bytes written
+ */
+int writeThrough(fat_volume *volume, file_handle *handle, const char *data, const int dataLen)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    int bytesWritten = 0;
     int bytesToWrite = dataLen;
+    int bytesUsed = handle->clusterOffset;
+    int bytesLeft = bytesPerCluster(bpb) - bytesUsed;
 
-    // determine how many bytes are used in that cluster
-    int bytesUsed = directoryEntry->filesize % bpb->bytesPerSec;
-    int bytesLeft = bpb->bytesPerSec - bytesUsed;
+    // reserve the clusters for the data that does not fit into the last cluster
+    if (bytesToWrite > bytesLeft)
+    {
+        uint32_t clustersNeeded = (bytesToWrite - bytesLeft + bytesPerCluster(bpb) - 1) / bytesPerCluster(bpb);
+        if (fat_table_allocate(&volume->fatTable, clustersNeeded, handle->lastCluster) < 0)
+        {
+            printf("Cannot append %d bytes! No free sectors are left!\n", dataLen);
+            return bytesWritten;
+        }
+    }
 
-    char *dataPtr = data;
+    const char *dataPtr = data;
 
     while (bytesToWrite > 0)
     {
-        int bytesToWriteIntoCluster = bytesLeft < bytesToWrite ? bytesLeft : bytesToWrite;
+        // continue in the next cluster of the chain once the current one is full
+        if (bytesLeft == 0)
+        {
+            handle->lastCluster = fat_table_get(&volume->fatTable, handle->lastCluster);
+            bytesUsed = 0;
+            bytesLeft = bytesPerCluster(bpb);
+        }
 
-        // get pointer to physical cluster
-        // int16_t dataAreaOffsetInBytes = dataAreaOffsetInSectors(bpb) * bpb->bytesPerSec;
-        char *ptr = buffer;
-        ptr += (logicalToPhysical(bpb, logicalIndex) * bpb->bytesPerSec);
+        // the data is written sector by sector, starting with the sector that contains the end of the file
+        int bytesUsedInSector = bytesUsed % bpb->bytesPerSec;
+        int bytesLeftInSector = bpb->bytesPerSec - bytesUsedInSector;
+        int bytesToWriteIntoCluster = bytesLeftInSector < bytesToWrite ? bytesLeftInSector : bytesToWrite;
+
+        // get pointer to physical sector, a sector that is written completely does not have to be read
+        int64_t sector = logicalToPhysical(bpb, handle->lastCluster) + bytesUsed / bpb->bytesPerSec;
+        bool overwrite = bytesUsedInSector == 0 && bytesToWriteIntoCluster == bpb->bytesPerSec;
+        char *ptr = overwrite ? get_sector_for_overwrite(device, sector) : get_sector(device, sector);
+        if (ptr == NULL)
+        {
+            break;
+        }
+        char *sectorPtr = ptr;
+
+        // move pointer after the data currently stored in the sector
+        ptr += bytesUsedInSector;
+
+        // append bytesToWriteIntoCluster to last cluster
+        memcpy(ptr, dataPtr, bytesToWriteIntoCluster);
+        put_data_sector(device, sectorPtr);
+        bytesWritten += bytesToWriteIntoCluster;
+
+        // a full sector is not touched again, write it while the FAT is updated
+        if (bytesUsedInSector + bytesToWriteIntoCluster == bpb->bytesPerSec)
+        {
+            submit_sector(device, sectorPtr);
+        }
+
+        // move data ptr because we just consumed bytes
+        dataPtr += bytesToWriteIntoCluster;
+
+        // update the loop condition
+        bytesToWrite -= bytesToWriteIntoCluster;
+
+        bytesUsed += bytesToWriteIntoCluster;
+        bytesLeft -= bytesToWriteIntoCluster;
+    }
+
+    handle->clusterOffset = bytesUsed;
+
+    // Update filesize in the directory entry
+    handle->entry->filesize += bytesWritten;
+    put_sector(device, (char *)handle->entry);
+
+    return bytesWritten;
+}
+
+/**
+ * Writes the buffered data of the handle into the file
+ *
+ * returns 0 on success or -1 if not all buffered bytes could be written
+ */
+int flushFile(fat_volume *volume, file_handle *handle)
+{
+    if (handle->buffered == 0)
+    {
+        return 0;
+    }
+
+    int bytesWritten = writeThrough(volume, handle, handle->buffer, handle->buffered);
+    if (bytesWritten != handle->buffered)
+    {
+        // keep what could not be written
+        memmove(handle->buffer, handle->buffer + bytesWritten, handle->buffered - bytesWritten);
+        handle->buffered -= bytesWritten;
+        return -1;
+    }
+
+    handle->buffered = 0;
+
+    return 0;
+}
+
+/**
+ * Appends data to an open file
+ *
+ * Small writes are collected in the buffer of the handle until they complete the last sector, which is then
+ * filled with a single copy. Whole sectors of larger writes are copied directly, the rest is buffered.
+ * Buffered data is part of the file after flushFile() or closeFile().
+ *
+ * returns the amount of bytes accepted, -1 on error
+ */
+int writeFile(fat_volume *volume, file_handle *handle, const char *data, const int dataLen)
+{
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    if (dataLen <= 0)
+    {
+        return 0;
+    }
+
+    // bytes until the buffered data completes a sector, if the last sector is full the buffer starts the next one
+    int bytesLeft = bpb->bytesPerSec - (handle->clusterOffset + handle->buffered) % bpb->bytesPerSec;
+    if (dataLen < bytesLeft)
+    {
+        memcpy(handle->buffer + handle->buffered, data, dataLen);
+        handle->buffered += dataLen;
+        return dataLen;
+    }
+
+    memcpy(handle->buffer + handle->buffered, data, bytesLeft);
+    handle->buffered += bytesLeft;
+    if (flushFile(volume, handle) != 0)
+    {
+        return -1;
+    }
+
+    int rest = dataLen - bytesLeft;
+    int direct = rest - rest % bpb->bytesPerSec;
+    if (direct > 0 && writeThrough(volume, handle, data + bytesLeft, direct) != direct)
+    {
+        return -1;
+    }
+
+    memcpy(handle->buffer, data + bytesLeft + direct, rest - direct);
+    handle->buffered = rest - direct;
+
+    return dataLen;
+}
+
+// builds the extent map of the handle unless it is up to date, returns 0 on success or -1 if the chain is broken
+int mapFile(fat_volume *volume, file_handle *handle)
+{
+    if (!fat_extent_map_valid(&volume->fatTable, &handle->extents) && fat_table_map_chain(&volume->fatTable, getFirstCluster(volume, handle->entry), &handle->extents) != 0)
+    {
+        printf("The cluster chain of the file is broken!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads up to len bytes at offset from an open file into out, buffered writes are written first
+ *
+ * The cluster containing offset is looked up in the extent map of the handle, which is built from the FAT
+ * on the first read and again whenever the FAT was modified since.
+ *
+ * returns the amount of bytes read, 0 at the end of the file, -1 on error
+ */
+int preadFile(fat_volume *volume, file_handle *handle, char *out, uint32_t offset, int len)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    if (flushFile(volume, handle) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t filesize = handle->entry->filesize;
+    if (len <= 0 || offset >= filesize)
+    {
+        return 0;
+    }
+    if ((uint32_t)len > filesize - offset)
+    {
+        len = filesize - offset;
+    }
+
+    if (mapFile(volume, handle) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t fileCluster = offset / bytesPerCluster(bpb);
+    int32_t extentIndex = fat_extent_find(&handle->extents, fileCluster);
+    if (extentIndex < 0)
+    {
+        return -1;
+    }
+
+    int bytesRead = 0;
+    int sectorInCluster = offset % bytesPerCluster(bpb) / bpb->bytesPerSec;
+    uint32_t bytesUsed = offset % bpb->bytesPerSec;
+    while (bytesRead < len)
+    {
+        const fat_extent *extent = &handle->extents.extents[extentIndex];
+        if (fileCluster == extent->fileCluster + extent->length)
+        {
+            // the chain continues with the next run
+            if ((uint32_t)++extentIndex >= handle->extents.count)
+            {
+                break;
+            }
+            extent = &handle->extents.extents[extentIndex];
+        }
+
+        char *ptr = get_sector(device, logicalToPhysical(bpb, extent->start + fileCluster - extent->fileCluster) + sectorInCluster);
+        if (ptr == NULL)
+        {
+            return bytesRead > 0 ? bytesRead : -1;
+        }
+
+        int bytesFromSector = bpb->bytesPerSec - bytesUsed < (uint32_t)(len - bytesRead) ? bpb->bytesPerSec - bytesUsed : len - bytesRead;
+        memcpy(out + bytesRead, ptr + bytesUsed, bytesFromSector);
+        bytesRead += bytesFromSector;
+
+        bytesUsed = 0;
+        if (++sectorInCluster == sectorsPerCluster(bpb))
+        {
+            sectorInCluster = 0;
+            fileCluster++;
+        }
+    }
+
+    return bytesRead;
+}
+
+/**
+ * Writes the buffered data and releases the handle
+ *
+ * returns 0 on success or -1 if buffered data was lost
+ */
+int closeFile(fat_volume *volume, file_handle *handle)
+{
+    block_device *device = volume->device;
+
+    if (handle->entry == NULL)
+    {
+        return 0;
+    }
+
+    int result = flushFile(volume, handle);
+
+    unpin_sector(device, (char *)handle->entry);
+    free(handle->buffer);
+    free_extent_map(&handle->extents);
+    memset(handle, 0, sizeof(file_handle));
+
+    return result;
+}
+
+/**
+ * Fills iov with pointers to the contents of an open file from offset on, trimmed to the file size. Nothing is copied,
+ * the caller can pass the vectors to writev() or checksum them directly.
+ *
+ * Adjacent sectors of a mapped image are covered by a single vector. For the cached backend every vector is one
+ * sector whose cache slot stays pinned until releaseFileVectors(), at most half of the cache is handed out at once.
+ *
+ * returns the amount of vectors, 0 at the end of the file, -1 on error
+ */
+int readFileVectors(fat_volume *volume, file_handle *handle, uint32_t offset, uint32_t len, struct iovec *iov, int maxIov)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    if (flushFile(volume, handle) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t filesize = handle->entry->filesize;
+    if (len == 0 || offset >= filesize || maxIov <= 0)
+    {
+        return 0;
+    }
+    if (len > filesize - offset)
+    {
+        len = filesize - offset;
+    }
+
+    bool cached = (device->mode & BLOCK_DEVICE_CACHED) != 0;
+    if (cached && (uint32_t)maxIov > device->slotCount / 2)
+    {
+        maxIov = device->slotCount > 1 ? device->slotCount / 2 : 1;
+    }
+
+    if (mapFile(volume, handle) != 0)
+    {
+        return -1;
+    }
+
+    uint32_t fileCluster = offset / bytesPerCluster(bpb);
+    int32_t extentIndex = fat_extent_find(&handle->extents, fileCluster);
+    if (extentIndex < 0)
+    {
+        return -1;
+    }
+
+    uint64_t *sectors = (uint64_t *)malloc(maxIov * sizeof(uint64_t));
+    if (sectors == NULL)
+    {
+        return -1;
+    }
+
+    // the sectors of the range, they are read with one batch of requests before the pointers are collected
+    int sectorInCluster = offset % bytesPerCluster(bpb) / bpb->bytesPerSec;
+    uint32_t bytesUsed = offset % bpb->bytesPerSec;
+    int sectorCount = 0;
+    for (uint32_t bytes = 0; bytes < bytesUsed + len && sectorCount < maxIov; bytes += bpb->bytesPerSec)
+    {
+        const fat_extent *extent = &handle->extents.extents[extentIndex];
+        if (fileCluster == extent->fileCluster + extent->length)
+        {
+            // the chain continues with the next run
+            if ((uint32_t)++extentIndex >= handle->extents.count)
+            {
+                break;
+            }
+            extent = &handle->extents.extents[extentIndex];
+        }
+
+        sectors[sectorCount++] = logicalToPhysical(bpb, extent->start + fileCluster - extent->fileCluster) + sectorInCluster;
+        if (++sectorInCluster == sectorsPerCluster(bpb))
+        {
+            sectorInCluster = 0;
+            fileCluster++;
+        }
+    }
+    prefetch_sectors(device, sectors, sectorCount);
+
+    int count = 0;
+    for (int i = 0; i < sectorCount && len > 0; i++)
+    {
+        char *ptr = get_sector(device, sectors[i]);
+        if (ptr == NULL)
+        {
+            break;
+        }
+        pin_sector(device, ptr);
+
+        uint32_t bytesFromSector = bpb->bytesPerSec - bytesUsed < len ? bpb->bytesPerSec - bytesUsed : len;
+        if (!cached && count > 0 && (char *)iov[count - 1].iov_base + iov[count - 1].iov_len == ptr + bytesUsed)
+        {
+            iov[count - 1].iov_len += bytesFromSector;
+        }
+        else
+        {
+            iov[count].iov_base = ptr + bytesUsed;
+            iov[count].iov_len = bytesFromSector;
+            count++;
+        }
+
+        len -= bytesFromSector;
+        bytesUsed = 0;
+    }
+    free(sectors);
+
+    return count > 0 ? count : -1;
+}
+
+/**
+ * Releases the cache slots of vectors returned by readFileVectors()
+ */
+void releaseFileVectors(block_device *device, const struct iovec *iov, int count)
+{
+    // the vectors of mapped images are not pinned and may span several sectors
+    if ((device->mode & BLOCK_DEVICE_CACHED) == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        unpin_sector(device, (const char *)iov[i].iov_base);
+    }
+}
+
+/**
+ * Writes the contents of an open file from offset on to the file descriptor fd
+ *
+ * The data is passed from the image to writev() without intermediate copies, see readFileVectors().
+ *
+ * returns 0 on success, -1 on error
+ */
+int writeFileVectors(fat_volume *volume, file_handle *handle, uint32_t offset, int fd)
+{
+    block_device *device = volume->device;
+
+    struct iovec iov[CAT_VECTORS];
+    struct iovec pending[CAT_VECTORS];
+    int result = 0;
+    int count;
+    while (result == 0 && (count = readFileVectors(volume, handle, offset, handle->entry->filesize - offset, iov, CAT_VECTORS)) > 0)
+    {
+        // writev() may write less than requested, the pending vectors are advanced while iov is kept for releasing
+        memcpy(pending, iov, count * sizeof(struct iovec));
+        int first = 0;
+        while (first < count)
+        {
+            ssize_t written = writev(fd, pending + first, count - first);
+            if (written < 0)
+            {
+                result = -1;
+                break;
+            }
+
+            offset += written;
+            while (first < count && (size_t)written >= pending[first].iov_len)
+            {
+                written -= pending[first].iov_len;
+                first++;
+            }
+            if (first < count)
+            {
+                pending[first].iov_base = (char *)pending[first].iov_base + written;
+                pending[first].iov_len -= written;
+            }
+        }
+
+        releaseFileVectors(device, iov, count);
+    }
+    if (count < 0)
+    {
+        result = -1;
+    }
+
+    return result;
+}
+
+/**
+ * Writes the contents of a file to stdout, NUL bytes included and trimmed to the file size
+ *
+ * returns 0 on success, -1 on error
+ */
+int catFile(fat_volume *volume, directory_entry *entry)
+{
+    file_handle handle;
+    if (openEntry(volume, entry, &handle) != 0)
+    {
+        return -1;
+    }
+
+    // the data bypasses stdio, everything printed before has to come first
+    fflush(stdout);
+
+    int result = writeFileVectors(volume, &handle, 0, fileno(stdout));
+
+    printf("\n");
+    closeFile(volume, &handle);
+
+    return result;
+}
+
+/**
+ * Copies the file at path filename (see resolvePath()) to the host file descriptor hostFd
+ *
+ * The chain is collapsed into runs of adjacent clusters, every run is copied from the image file to hostFd
+ * with a single copy_bytes_to_fd() call inside the kernel. If the image cannot be copied that way (mapped
+ * images without write-back), the rest of the file is written from the mapping with writev().
+ *
+ * returns 0 on success, error codes are negative integers
+ */
+int exportFile(fat_session *session, const char *filename, int hostFd)
+{
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    directory_entry *entry = NULL;
+    if (resolvePath(session, filename, &entry) != 0 || entry == NULL || isNotFile(entry))
+    {
+        printf("Cannot export %s. It does not exist or is not a file!\n", filename);
+        return -1;
+    }
+
+    // a file without clusters is empty
+    if (getFirstCluster(volume, entry) == 0)
+    {
+        return 0;
+    }
+
+    file_handle handle;
+    if (openEntry(volume, entry, &handle) != 0 || mapFile(volume, &handle) != 0)
+    {
+        closeFile(volume, &handle);
+        return -2;
+    }
+
+    int result = 0;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < handle.extents.count && offset < entry->filesize; i++)
+    {
+        const fat_extent *extent = &handle.extents.extents[i];
+        uint32_t bytesLeft = entry->filesize - offset;
+        uint64_t runBytes = (uint64_t)extent->length * bytesPerCluster(bpb);
+        uint32_t len = runBytes < bytesLeft ? (uint32_t)runBytes : bytesLeft;
+
+        result = copy_bytes_to_fd(device, (off_t)logicalToPhysical(bpb, extent->start) * bpb->bytesPerSec, len, hostFd);
+        if (result != 0)
+        {
+            break;
+        }
+        offset += len;
+    }
+
+    if (result == -2)
+    {
+        result = writeFileVectors(volume, &handle, offset, hostFd);
+    }
+    else if (result == 0 && offset < entry->filesize)
+    {
+        printf("The cluster chain of %s is shorter than the file!\n", filename);
+        result = -3;
+    }
+    if (result != 0)
+    {
+        printf("Exporting %s failed!\n", filename);
+    }
+
+    closeFile(volume, &handle);
+
+    return result;
+}
+
+// orders import entries by their converted names
+int compareImportNames(const void *a, const void *b)
+{
+    return memcmp((*(import_entry *const *)a)->name, (*(import_entry *const *)b)->name, FILENAME_LENGTH);
+}
+
+/**
+ * Collects up to wanted free directory entries of the working directory with a single pass over its sectors.
+ * Every entry is stored as sector * entries per sector + index of the entry within the sector.
+ *
+ * returns the amount of free entries found
+ */
+uint32_t collectFreeDirEntries(fat_session *session, uint64_t *slots, uint32_t wanted)
+{
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    uint32_t entriesPerSector = bpb->bytesPerSec / sizeof(directory_entry);
+    uint32_t found = 0;
+
+    int logicalClusterIndex = session->workingDirectory == NULL ? 0 : getFirstCluster(volume, session->workingDirectory);
+    int sectorInCluster = 0;
+    for (int sectorIndex = 0; found < wanted; sectorIndex++)
+    {
+        int64_t sector;
+        uint32_t entryCount;
+        if (session->workingDirectory == NULL)
+        {
+            // the root directory is a fixed run of sectors
+            entryCount = rootDirectoryEntriesInSector(bpb, sectorIndex);
+            sector = rootDirectoryOffsetInSectors(bpb) + sectorIndex;
+        }
+        else
+        {
+            if (!fat_is_data_cluster(logicalClusterIndex))
+            {
+                break;
+            }
+            entryCount = entriesPerSector;
+            sector = logicalToPhysical(bpb, logicalClusterIndex) + sectorInCluster;
+            if (++sectorInCluster == sectorsPerCluster(bpb))
+            {
+                sectorInCluster = 0;
+                logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+            }
+        }
+        if (entryCount == 0)
+        {
+            break;
+        }
+
+        directory_entry *directoryEntryPtr = (directory_entry *)get_sector(device, sector);
+        if (directoryEntryPtr == NULL)
+        {
+            break;
+        }
+        for (uint32_t first = 0; first < entryCount && found < wanted; first += DIR_SCAN_GROUP)
+        {
+            uint32_t count = entryCount - first < DIR_SCAN_GROUP ? entryCount - first : DIR_SCAN_GROUP;
+            dir_slot_masks masks;
+            dir_scan_slots(directoryEntryPtr + first, count, &masks);
+
+            for (uint64_t freeSlots = masks.free | masks.end; freeSlots != 0 && found < wanted; freeSlots &= freeSlots - 1)
+            {
+                slots[found++] = (uint64_t)sector * entriesPerSector + first + __builtin_ctzll(freeSlots);
+            }
+        }
+    }
+
+    return found;
+}
+
+// writes the directory entry of an imported file or directory
+int writeImportEntry(fat_volume *volume, uint64_t slot, const import_entry *entry, const host_entry *hostEntry)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    uint32_t entriesPerSector = bpb->bytesPerSec / sizeof(directory_entry);
+    char *ptr = get_sector(device, slot / entriesPerSector);
+    if (ptr == NULL)
+    {
+        return -1;
+    }
+
+    directory_entry *directoryEntry = (directory_entry *)ptr + slot % entriesPerSector;
+    memset(directoryEntry, 0, sizeof(directory_entry));
+    memcpy(directoryEntry->filename, entry->name, FILENAME_LENGTH);
+    directoryEntry->attributes = hostEntry->directory ? DIRECTORY_FLAG : 0;
+    setFirstCluster(volume, directoryEntry, entry->firstCluster);
+    directoryEntry->filesize = hostEntry->directory ? 0 : hostEntry->size;
+    put_sector(device, ptr);
+
+    return 0;
+}
+
+/**
+ * Reads a host file straight into the clusters of its chain, trimmed to size
+ *
+ * The sectors are not read from the image first (see get_sector_for_overwrite()), a batch of them is filled by a
+ * single readv() and handed to the device for writing right away.
+ *
+ * returns 0 on success, -1 on error
+ */
+int importFileContents(fat_volume *volume, host_tree *tree, uint32_t index, int32_t firstCluster, off_t size)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    bool cached = (device->mode & BLOCK_DEVICE_CACHED) != 0;
+    uint32_t batch = cached && device->slotCount / 2 < CAT_VECTORS ? device->slotCount / 2 : CAT_VECTORS;
+    batch = batch > 0 ? batch : 1;
+
+    struct iovec iov[CAT_VECTORS];
+    char *sectors[CAT_VECTORS];
+    int32_t logicalClusterIndex = firstCluster;
+    int sectorInCluster = 0;
+    off_t bytesLeft = size;
+    int result = 0;
+    while (result == 0 && bytesLeft > 0 && fat_is_data_cluster(logicalClusterIndex))
+    {
+        uint32_t count = 0;
+        int iovcnt = 0;
+        ssize_t requested = 0;
+        while (count < batch && bytesLeft > 0 && fat_is_data_cluster(logicalClusterIndex))
+        {
+            char *ptr = get_sector_for_overwrite(device, logicalToPhysical(bpb, logicalClusterIndex) + sectorInCluster);
+            if (ptr == NULL)
+            {
+                result = -1;
+                break;
+            }
+            pin_sector(device, ptr);
+            sectors[count++] = ptr;
+
+            size_t len = bytesLeft < bpb->bytesPerSec ? bytesLeft : bpb->bytesPerSec;
+            if (!cached && iovcnt > 0 && (char *)iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len == ptr)
+            {
+                iov[iovcnt - 1].iov_len += len;
+            }
+            else
+            {
+                iov[iovcnt].iov_base = ptr;
+                iov[iovcnt].iov_len = len;
+                iovcnt++;
+            }
+
+            // the rest of the last sector is cleared
+            memset(ptr + len, 0, bpb->bytesPerSec - len);
+
+            requested += len;
+            bytesLeft -= len;
+            if (++sectorInCluster == sectorsPerCluster(bpb))
+            {
+                sectorInCluster = 0;
+                logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+            }
+        }
+
+        ssize_t bytesRead = iovcnt > 0 ? read_host_file(tree, index, iov, iovcnt) : 0;
+        if (bytesRead < requested)
+        {
+            printf("Reading %s failed or the file shrank while it was imported!\n", tree->entries[index].path);
+            result = -1;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            put_data_sector(device, sectors[i]);
+            submit_sector(device, sectors[i]);
+            unpin_sector(device, sectors[i]);
+        }
+    }
+
+    close_host_file(tree, index);
+
+    return result;
+}
+
+/**
+ * Imports a host file or the contents of a host directory recursively into the working directory, like mcopy -s
+ *
+ * 1. The host tree is scanned and everything is sized in advance: a directory needs a cluster per
+ *    bytesPerCluster() / 32 entries (. and .. included), a file a cluster per bytesPerCluster() of data but at
+ *    least one. Nothing is modified if the volume has not enough free clusters or the working directory not
+ *    enough free entries. Entries whose name exists already are skipped.
+ * 2. Directories and files are created breadth first. Every directory and file gets its clusters with a single
+ *    fat_table_allocate() call, the entries of a directory are written one after another into its sectors.
+ * 3. The host files are read straight into their clusters, while the kernel reads the next
+ *    IMPORT_READ_AHEAD_FILES files ahead.
+ *
+ * returns the amount of imported files and directories, error codes are negative integers
+ */
+int importTree(fat_session *session, const char *hostPath)
+{
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    host_tree tree;
+    if (scan_host_tree(hostPath, &tree) != 0)
+    {
+        printf("Cannot read %s!\n", hostPath);
+        return -1;
+    }
+
+    // the contents of a directory are imported, a single file is imported itself
+    uint32_t topFirst = tree.entries[0].directory ? tree.entries[0].firstChild : 0;
+    uint32_t topCount = tree.entries[0].directory ? tree.entries[0].childCount : 1;
+
+    import_entry *entries = (import_entry *)calloc(tree.count, sizeof(import_entry));
+    import_entry **siblings = (import_entry **)malloc(tree.count * sizeof(import_entry *));
+    uint64_t *slots = (uint64_t *)malloc((topCount > 0 ? topCount : 1) * sizeof(uint64_t));
+    if (entries == NULL || siblings == NULL || slots == NULL)
+    {
+        free(entries);
+        free(siblings);
+        free(slots);
+        free_host_tree(&tree);
+        return -4;
+    }
+
+    // names, parents and name clashes, the root of the host tree is not imported itself if it is a directory
+    entries[0].skipped = tree.entries[0].directory;
+    for (uint32_t i = 0; i < tree.count; i++)
+    {
+        char name[FILENAME_LENGTH];
+        filenameToFatElevenThree(tree.entries[i].name, name, FILENAME_LENGTH);
+        memcpy(entries[i].name, name, FILENAME_LENGTH);
+    }
+    for (uint32_t i = 0; i < tree.count; i++)
+    {
+        if (!tree.entries[i].directory)
+        {
+            continue;
+        }
+
+        uint32_t count = 0;
+        for (uint32_t child = tree.entries[i].firstChild; child < tree.entries[i].firstChild + tree.entries[i].childCount; child++)
+        {
+            entries[child].parent = i;
+            entries[child].skipped = i != 0 && entries[i].skipped;
+            if (!entries[child].skipped)
+            {
+                siblings[count++] = &entries[child];
+            }
+        }
+
+        // several host names can be shortened to the same 8.3 name
+        qsort(siblings, count, sizeof(import_entry *), compareImportNames);
+        for (uint32_t k = 1; k < count; k++)
+        {
+            if (memcmp(siblings[k]->name, siblings[k - 1]->name, FILENAME_LENGTH) == 0)
+            {
+                printf("Skipping %s, its name %.11s is taken!\n", tree.entries[siblings[k] - entries].path, siblings[k]->name);
+                siblings[k]->skipped = true;
+            }
+        }
+    }
+    for (uint32_t i = topFirst; i < topFirst + topCount; i++)
+    {
+        if (!entries[i].skipped && findFile(session, tree.entries[i].name) != NULL)
+        {
+            printf("Skipping %s, a file or folder with the same name exists!\n", tree.entries[i].path);
+            entries[i].skipped = true;
+        }
+    }
+    // the clash checks above ran parents first, children of skipped directories are skipped as well
+    for (uint32_t i = 1; i < tree.count; i++)
+    {
+        if (entries[entries[i].parent].skipped && entries[i].parent != 0)
+        {
+            entries[i].skipped = true;
+        }
+    }
+
+    // size everything, the sectors of a cluster are adjacent, so entry i of a cluster is entry i % entriesPerSector
+    // of its sector i / entriesPerSector
+    uint32_t entriesPerSector = dirEntriesPerSector(bpb);
+    uint32_t entriesPerCluster = entriesPerSector * sectorsPerCluster(bpb);
+    uint32_t clustersNeeded = 0;
+    uint32_t topEntries = 0;
+    for (uint32_t i = 0; i < tree.count; i++)
+    {
+        if (entries[i].skipped)
+        {
+            continue;
+        }
+
+        if (tree.entries[i].directory)
+        {
+            uint32_t used = 2;
+            for (uint32_t child = tree.entries[i].firstChild; child < tree.entries[i].firstChild + tree.entries[i].childCount; child++)
+            {
+                used += entries[child].skipped ? 0 : 1;
+            }
+            entries[i].clusters = (used + entriesPerCluster - 1) / entriesPerCluster;
+        }
+        else
+        {
+            entries[i].clusters = tree.entries[i].size > 0 ? (tree.entries[i].size + bytesPerCluster(bpb) - 1) / bytesPerCluster(bpb) : 1;
+        }
+        clustersNeeded += entries[i].clusters;
+
+        if (i >= topFirst && i < topFirst + topCount)
+        {
+            topEntries++;
+        }
+    }
+
+    // free entries of the working directory, a directory in the data area grows by the missing entries
+    uint32_t slotCount = collectFreeDirEntries(session, slots, topEntries);
+    uint32_t extraClusters = 0;
+    if (slotCount < topEntries)
+    {
+        if (session->workingDirectory == NULL)
+        {
+            printf("Cannot import %s! Only %u of %u root directory entries are free!\n", hostPath, slotCount, topEntries);
+            clustersNeeded = UINT32_MAX;
+        }
+        else
+        {
+            extraClusters = (topEntries - slotCount + entriesPerCluster - 1) / entriesPerCluster;
+            clustersNeeded += extraClusters;
+        }
+    }
+    if (clustersNeeded > volume->fatTable.freeClusters)
+    {
+        if (clustersNeeded != UINT32_MAX)
+        {
+            printf("Cannot import %s! %u clusters are needed, %u are free!\n", hostPath, clustersNeeded, volume->fatTable.freeClusters);
+        }
+        free(entries);
+        free(siblings);
+        free(slots);
+        free_host_tree(&tree);
+        return -2;
+    }
+
+    if (extraClusters > 0)
+    {
+        int32_t lastCluster = findLastCluster(volume, session->workingDirectory);
+        int32_t logicalCluster = fat_table_allocate(&volume->fatTable, extraClusters, lastCluster);
+        noteGrownDirectory(session, logicalCluster);
+        while (fat_is_data_cluster(logicalCluster))
+        {
+            initializeDirectorySector(volume, false, logicalCluster, 0);
+            for (uint32_t i = 0; i < entriesPerCluster && slotCount < topEntries; i++)
+            {
+                slots[slotCount++] = (uint64_t)logicalToPhysical(bpb, logicalCluster) * entriesPerSector + i;
+            }
+            logicalCluster = fat_table_get(&volume->fatTable, logicalCluster);
+        }
+    }
+
+    // the new entries of the working directory may lie behind the end of its used entries
+    dir_index *workingIndex = dir_index_find(&volume->dirIndexes, directoryIndexCluster(volume, session->workingDirectory));
+    if (workingIndex != NULL)
+    {
+        workingIndex->end = UINT32_MAX;
+    }
+
+    // allocate and create breadth first, a directory is created before its entries are written into it
+    int workingCluster = parentLinkCluster(volume, session->workingDirectory);
+    uint32_t nextSlot = 0;
+    int imported = 0;
+    for (uint32_t i = 0; i < tree.count; i++)
+    {
+        import_entry *entry = &entries[i];
+        if (entry->skipped)
+        {
+            continue;
+        }
+
+        entry->firstCluster = fat_table_allocate(&volume->fatTable, entry->clusters, 0);
+        if (entry->firstCluster < 0)
+        {
+            break;
+        }
+
+        if (tree.entries[i].directory)
+        {
+            int parentCluster = i >= topFirst && i < topFirst + topCount ? workingCluster : entries[entry->parent].firstCluster;
+            bool addLinks = true;
+            for (int32_t logicalCluster = entry->firstCluster; fat_is_data_cluster(logicalCluster); logicalCluster = fat_table_get(&volume->fatTable, logicalCluster))
+            {
+                initializeDirectorySector(volume, addLinks, logicalCluster, parentCluster);
+                addLinks = false;
+            }
+            entry->cursorCluster = entry->firstCluster;
+            entry->cursorIndex = 2;
+        }
+
+        uint64_t slot;
+        if (i >= topFirst && i < topFirst + topCount)
+        {
+            slot = slots[nextSlot++];
+        }
+        else
+        {
+            import_entry *parent = &entries[entry->parent];
+            if (parent->cursorIndex == entriesPerCluster)
+            {
+                parent->cursorCluster = fat_table_get(&volume->fatTable, parent->cursorCluster);
+                parent->cursorIndex = 0;
+            }
+            slot = (uint64_t)logicalToPhysical(bpb, parent->cursorCluster) * entriesPerSector + parent->cursorIndex++;
+        }
+        if (writeImportEntry(volume, slot, entry, &tree.entries[i]) != 0)
+        {
+            break;
+        }
+        imported++;
+
+        if (i >= topFirst && i < topFirst + topCount)
+        {
+            indexNewEntry(session, entry->name, slot);
+        }
+
+        // a directory is complete once its last entry is written
+        uint32_t parentIndex = i >= topFirst && i < topFirst + topCount ? 0 : entry->parent;
+        if (!tree.entries[0].directory || i + 1 == tree.entries[parentIndex].firstChild + tree.entries[parentIndex].childCount)
+        {
+            end_operation(device);
+        }
+    }
+
+    // stream the contents, the kernel reads up to IMPORT_READ_AHEAD_FILES files ahead meanwhile
+    uint32_t prefetched = 0;
+    uint32_t opened = 0;
+    for (uint32_t i = 0; i < tree.count; i++)
+    {
+        if (entries[i].skipped || entries[i].firstCluster <= 1 || tree.entries[i].directory || tree.entries[i].size == 0)
+        {
+            continue;
+        }
+
+        for (; prefetched < tree.count && opened < IMPORT_READ_AHEAD_FILES; prefetched++)
+        {
+            if (!entries[prefetched].skipped && entries[prefetched].firstCluster > 1 && !tree.entries[prefetched].directory && tree.entries[prefetched].size > 0)
+            {
+                prefetch_host_file(&tree, prefetched);
+                opened++;
+            }
+        }
+
+        importFileContents(volume, &tree, i, entries[i].firstCluster, tree.entries[i].size);
+        opened--;
+    }
+
+    free(entries);
+    free(siblings);
+    free(slots);
+    free_host_tree(&tree);
+
+    return imported;
+}
+
+/**
+ * Metadata pass of extractAll(): walks the directory starting at firstLogicalCluster (0 for the fixed root directory),
+ * creates its subdirectories below hostPath and collects every file with the runs of its chain.
+ * Directories that were walked already (loops in damaged images) are skipped.
+ *
+ * returns 0 on success, -4 if out of memory
+ */
+int collectExtractFiles(fat_volume *volume, int firstLogicalCluster, const char *hostPath, extract_job *job)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    // copy the entries first, walking the subdirectories evicts the sectors of a cached image
+    uint32_t entriesPerSector = dirEntriesPerSector(bpb);
+    uint32_t entryCount = 0;
+    directory_entry *entries = NULL;
+    if (firstLogicalCluster == 0)
+    {
+        entries = (directory_entry *)malloc((bpb->rootEntCnt > 0 ? bpb->rootEntCnt : 1) * sizeof(directory_entry));
+        for (int sectorIndex = 0; entries != NULL && rootDirectoryEntriesInSector(bpb, sectorIndex) > 0; sectorIndex++)
+        {
+            char *ptr = get_sector(device, rootDirectoryOffsetInSectors(bpb) + sectorIndex);
+            if (ptr == NULL)
+            {
+                break;
+            }
+            memcpy(entries + entryCount, ptr, rootDirectoryEntriesInSector(bpb, sectorIndex) * sizeof(directory_entry));
+            entryCount += rootDirectoryEntriesInSector(bpb, sectorIndex);
+        }
+    }
+    else
+    {
+        fat_extent_map map;
+        memset(&map, 0, sizeof(fat_extent_map));
+        if (fat_table_map_chain(&volume->fatTable, firstLogicalCluster, &map) != 0)
+        {
+            return 0;
+        }
+        entries = (directory_entry *)malloc((map.clusters > 0 ? map.clusters : 1) * bytesPerCluster(bpb));
+        for (uint32_t i = 0; entries != NULL && i < map.count; i++)
+        {
+            // the clusters of a run and thereby their sectors are adjacent
+            for (uint32_t k = 0; k < map.extents[i].length * sectorsPerCluster(bpb); k++)
+            {
+                char *ptr = get_sector(device, logicalToPhysical(bpb, map.extents[i].start) + k);
+                if (ptr == NULL)
+                {
+                    break;
+                }
+                memcpy(entries + entryCount, ptr, bpb->bytesPerSec);
+                entryCount += entriesPerSector;
+            }
+        }
+        free_extent_map(&map);
+    }
+    if (entries == NULL)
+    {
+        return -4;
+    }
+
+    // the used entries in front of the first 0x00 entry of the directory, found a group of entries at a time
+    uint32_t usedCount = 0;
+    for (uint32_t first = 0; first < entryCount; first += DIR_SCAN_GROUP)
+    {
+        uint32_t count = entryCount - first < DIR_SCAN_GROUP ? entryCount - first : DIR_SCAN_GROUP;
+        dir_slot_masks masks;
+        dir_scan_slots(entries + first, count, &masks);
+
+        for (uint64_t live = dir_scan_live(&masks); live != 0; live &= live - 1)
+        {
+            // compacted in place, an entry never moves behind its position
+            entries[usedCount++] = entries[first + __builtin_ctzll(live)];
+        }
+        if (masks.end != 0)
+        {
+            break;
+        }
+    }
+
+    int result = 0;
+    size_t hostPathLength = strlen(hostPath);
+    for (uint32_t i = 0; i < usedCount && result == 0; i++)
+    {
+        directory_entry *entry = &entries[i];
+        if (entry->filename[0] == '.' || isVolumeLabel(entry))
+        {
+            continue;
+        }
+
+        char name[13];
+        fatElevenThreeToFilename(entry->filename, name, sizeof(name));
+        char *path = (char *)malloc(hostPathLength + 1 + sizeof(name));
+        if (path == NULL)
+        {
+            result = -4;
+            break;
+        }
+        sprintf(path, "%s/%s", hostPath, name);
+
+        uint32_t firstCluster = getFirstCluster(volume, entry);
+        if (isDirectory(entry))
+        {
+            bool walked = firstCluster < 2 || firstCluster >= volume->fatTable.entryCount || (job->visited[firstCluster / 64] >> (firstCluster % 64) & 1) != 0;
+            if (!walked)
+            {
+                job->visited[firstCluster / 64] |= 1ULL << (firstCluster % 64);
+                if (create_host_directory(path) != 0)
+                {
+                    printf("Cannot create %s!\n", path);
+                    job->failed++;
+                }
+                else
+                {
+                    result = collectExtractFiles(volume, firstCluster, path, job);
+                }
+            }
+            free(path);
+            continue;
+        }
+
+        if (job->count == job->capacity)
+        {
+            uint32_t capacity = job->capacity > 0 ? job->capacity * 2 : 64;
+            extract_file *files = (extract_file *)realloc(job->files, capacity * sizeof(extract_file));
+            if (files == NULL)
+            {
+                free(path);
+                result = -4;
+                break;
+            }
+            job->files = files;
+            job->capacity = capacity;
+        }
+
+        extract_file *file = &job->files[job->count++];
+        memset(file, 0, sizeof(extract_file));
+        file->path = path;
+        file->size = entry->filesize;
+        if (firstCluster != 0 && file->size > 0 && fat_table_map_chain(&volume->fatTable, firstCluster, &file->extents) != 0)
+        {
+            printf("The cluster chain of %s is damaged, only its name is extracted!\n", path);
+            file->size = 0;
+        }
+    }
+
+    free(entries);
+
+    return result;
+}
+
+// writes a file collected by collectExtractFiles() to the host, runs on the threads of extractAll()
+int extractFile(const extract_job *job, const extract_file *file)
+{
+    int fd = create_host_file(file->path);
+    if (fd < 0)
+    {
+        printf("Cannot create %s!\n", file->path);
+        return -1;
+    }
+
+    int result = 0;
+    uint32_t offset = 0;
+    uint32_t clusterSize = bytesPerCluster(job->bpb);
+    for (uint32_t i = 0; i < file->extents.count && offset < file->size && result == 0; i++)
+    {
+        const fat_extent *extent = &file->extents.extents[i];
+        uint32_t bytesLeft = file->size - offset;
+        uint64_t runBytes = (uint64_t)extent->length * clusterSize;
+        uint32_t len = runBytes < bytesLeft ? (uint32_t)runBytes : bytesLeft;
+
+        result = write_image_bytes_to_fd(job->device, (off_t)logicalToPhysical(job->bpb, extent->start) * job->bpb->bytesPerSec, len, fd);
+        offset += len;
+    }
+    if (result == 0 && offset < file->size)
+    {
+        printf("The cluster chain of %s is shorter than the file!\n", file->path);
+        result = -3;
+    }
+
+    if (close_host_fd(fd) != 0 && result == 0)
+    {
+        result = -1;
+    }
+    if (result != 0)
+    {
+        printf("Extracting %s failed!\n", file->path);
+    }
+
+    return result;
+}
+
+void *extractWorker(void *context)
+{
+    extract_job *job = (extract_job *)context;
+
+    for (;;)
+    {
+        uint32_t index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (index >= job->count)
+        {
+            break;
+        }
+        if (extractFile(job, &job->files[index]) != 0)
+        {
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+// orders extract files by size, largest first
+int compareExtractSizes(const void *a, const void *b)
+{
+    const extract_file *first = (const extract_file *)a;
+    const extract_file *second = (const extract_file *)b;
+
+    return first->size < second->size ? 1 : first->size > second->size ? -1 : 0;
+}
+
+/**
+ * Extracts all files and folders of the volume below the host directory hostPath
+ *
+ * 1. A single thread walks the directory tree, creates the host directories and collects every file with the
+ *    runs of its chain. This is the only pass that goes through the sector cache.
+ * 2. A pool of up to EXTRACT_MAX_WORKERS threads (one per processor) writes the files, largest first. Every run of
+ *    a file is written with one write_image_bytes_to_fd() call: straight from the mapping of a mapped image, inside
+ *    the kernel from the image file of a cached image.
+ *
+ * returns the amount of files that could not be extracted, error codes are negative integers
+ */
+int extractAll(fat_volume *volume, const char *hostPath)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    if (create_host_directory(hostPath) != 0)
+    {
+        printf("Cannot create %s!\n", hostPath);
+        return -1;
+    }
+
+    extract_job job;
+    memset(&job, 0, sizeof(extract_job));
+    job.device = device;
+    job.bpb = bpb;
+    job.visited = (uint64_t *)calloc((volume->fatTable.entryCount + 63) / 64, sizeof(uint64_t));
+    if (job.visited == NULL)
+    {
+        return -4;
+    }
+
+    int result = collectExtractFiles(volume, getFirstCluster(volume, &volume->rootDirectoryEntry), hostPath, &job);
+
+    // the workers read the image file of a cached image directly
+    if (result == 0 && (device->mode & BLOCK_DEVICE_CACHED) != 0 && flush_block_device(device) != 0)
+    {
+        result = -1;
+    }
+
+    if (result == 0)
+    {
+        qsort(job.files, job.count, sizeof(extract_file), compareExtractSizes);
+
+        uint32_t workerCount = host_processor_count();
+        workerCount = workerCount < EXTRACT_MAX_WORKERS ? workerCount : EXTRACT_MAX_WORKERS;
+        workerCount = workerCount < job.count ? workerCount : job.count;
+
+        pthread_t workers[EXTRACT_MAX_WORKERS];
+        uint32_t started = 0;
+        while (started + 1 < workerCount && pthread_create(&workers[started], NULL, extractWorker, &job) == 0)
+        {
+            started++;
+        }
+        // the calling thread is a worker as well
+        extractWorker(&job);
+        for (uint32_t i = 0; i < started; i++)
+        {
+            pthread_join(workers[i], NULL);
+        }
+
+        printf("Extracted %u files to %s with %u threads\n", job.count - job.failed, hostPath, started + 1);
+        result = job.failed;
+    }
+
+    for (uint32_t i = 0; i < job.count; i++)
+    {
+        free(job.files[i].path);
+        free_extent_map(&job.files[i].extents);
+    }
+    free(job.files);
+    free(job.visited);
+
+    return result;
+}
+
+/**
+ * Appends data to a file
+ * 
+ * If the file does not exist in the working directory, touch it (call touch())
+ * 
+ * The file is opened, the data is written through the handle without buffering and the file is closed
+ * again, see openFile() and writeThrough().
+ */
+int appendToFile(fat_session *session, const char *filename, const char *data, const int dataLen)
+{
+    fat_volume *volume = session->volume;
+
+    int bytesWritten = 0;
+
+    if (dataLen <= 0)
+    {
+        printf("dataLen is negative or zero! Aborting write!\n");
+        return bytesWritten;
+    }
+
+    file_handle handle;
+    if (openFile(session, filename, true, &handle) < 0)
+    {
+        // convert the filename
+        char convertedName[FILENAME_LENGTH];
+        memset(convertedName, 0, FILENAME_LENGTH);
+        filenameToFatElevenThree(filename, convertedName, FILENAME_LENGTH);
+
+        printf("Cannot find or create file %s!\n", convertedName);
+        return bytesWritten;
+    }
+
+    bytesWritten = writeThrough(volume, &handle, data, dataLen);
+    closeFile(volume, &handle);
+
+    return bytesWritten;
+}
+
+/**
+ * Removes the clusters at the end of the folder's chain that do not hold any entry.
+ * The used entries stay where they are, so the name index of the folder remains valid.
+ * The free slot hints of the index are computed anew while the folder is scanned.
+ */
+void collapseTheFolder(fat_volume *volume, directory_entry *directoryEntry)
+{
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    int lastUsedLogicalSector = 0;
+    uint32_t entriesPerCluster = dirEntriesPerSector(bpb) * sectorsPerCluster(bpb);
+    uint32_t clusterCount = 0;
+    uint32_t usedClusterCount = 0;
+
+    int logicalClusterIndex = getFirstCluster(volume, directoryEntry);
+
+    dir_index *index = dir_index_find(&volume->dirIndexes, directoryIndexCluster(volume, directoryEntry));
+    if (index != NULL)
+    {
+        index->firstFree = UINT32_MAX;
+        index->end = 0;
+    }
+
+    while (fat_is_data_cluster(logicalClusterIndex))
+    {
+        int64_t firstSector = logicalToPhysical(bpb, logicalClusterIndex);
+        for (int sectorIndex = 0; sectorIndex < sectorsPerCluster(bpb); sectorIndex++)
+        {
+            // pointer to physical sector
+            char *bufferPtr = get_sector(device, firstSector + sectorIndex);
+            if (bufferPtr == NULL)
+            {
+                // the hints cannot be trusted without all entries
+                dir_index_drop(&volume->dirIndexes, directoryIndexCluster(volume, directoryEntry));
+                index = NULL;
+                break;
+            }
+
+            // cast to directory entry
+            directory_entry *directoryEntryPtr = (directory_entry *)bufferPtr;
+            if (index != NULL)
+            {
+                uint32_t position = clusterCount * entriesPerCluster + sectorIndex * dirEntriesPerSector(bpb);
+                addSlotHints(index, directoryEntryPtr, dirEntriesPerSector(bpb), position, logicalClusterIndex);
+            }
+
+            // output all entries
+            bool returnLinks = true;
+            int entriesUsed = iterateEntries(volume, directoryEntryPtr, dirEntriesPerSector(bpb), returnLinks);
+            if (entriesUsed > 0)
+            {
+                lastUsedLogicalSector = logicalClusterIndex;
+                usedClusterCount = clusterCount + 1;
+            }
+        }
+
+        // read next sector in the chain of sectors from the fat
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+        clusterCount++;
+    }
+
+    if (index != NULL)
+    {
+        finishSlotHints(index, clusterCount * entriesPerCluster, logicalClusterIndex);
+
+        // a free entry in one of the clusters removed below is gone, the folder is full up to them
+        uint32_t keptEntries = (lastUsedLogicalSector != 0 ? usedClusterCount : clusterCount) * entriesPerCluster;
+        if (index->firstFree >= keptEntries)
+        {
+            index->firstFree = keptEntries;
+            index->firstFreeCluster = FAT_END_OF_CHAIN;
+        }
+    }
+
+    // update the FAT and remove unused sectors
+    logicalClusterIndex = getFirstCluster(volume, directoryEntry);
+    int oldClusterIndex = logicalClusterIndex;
+    bool lastSectorFound = false;
+    while (fat_is_data_cluster(logicalClusterIndex))
+    {
+        // read next sector in the chain of sectors from the fat
+        oldClusterIndex = logicalClusterIndex;
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+
+        if (oldClusterIndex == lastUsedLogicalSector)
+        {
+            fat_table_set(&volume->fatTable, oldClusterIndex, FAT_END_OF_CHAIN);
+            lastSectorFound = true;
+            continue;
+        }
+
+        if (lastSectorFound)
+        {
+            fat_table_set(&volume->fatTable, oldClusterIndex, FAT_FREE_CLUSTER);
+        }
+    }
+}
+
+/**
+ * Deletes a file
+ * 
+ * 0. Check if the file exists and is not read only in its directory entries attributes.
+ * 
+ * Set the directory entry to free (0xE5 as first byte in the filename)
+ * if there are no used directory entries after this one, set the first byte in the filename to 0x00
+ * 
+ * If the cluster is contained in the data area not in the root directory
+ * and the entire cluster consist only of empty directory entries, remove this cluster from the
+ * folders cluster chain, if it is the last cluster in the cluster chain!
+ * 
+ * Delete the entire cluster chain of the file.
+ */
+void rm(fat_session *session, const char *filename)
+{
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
+    const bios_parameter_block *bpb = &volume->bpb;
+
+    directory_entry *directoryEntry = findFile(session, filename);
+    if (directoryEntry == NULL)
+    {
+        return;
+    }
+
+    // check readonly and volume label
+    if (directoryEntry->attributes == VOLUMELABEL_FLAG || directoryEntry->attributes == READONLY_FLAG)
+    {
+        return;
+    }
+
+    // walking the FAT must not evict the sector that holds the entry
+    pin_sector(device, (char *)directoryEntry);
+
+    int logicalClusterIndex = getFirstCluster(volume, directoryEntry);
+    int oldLogicalClusterIndex = logicalClusterIndex;
+
+    // the fixed root directory is not collapsed, the entry becomes its first free one if it comes before the hint
+    dir_index *index = dir_index_find(&volume->dirIndexes, directoryIndexCluster(volume, session->workingDirectory));
+    if (session->workingDirectory == NULL && index != NULL)
+    {
+        uint64_t slot;
+        if (dentry_cache_lookup(&volume->dentries, 0, (const char *)directoryEntry->filename, &slot) && slot != DENTRY_NEGATIVE)
+        {
+            uint32_t position = slot - rootDirectoryOffsetInSectors(bpb) * dirEntriesPerSector(bpb);
+            index->firstFree = position < index->firstFree ? position : index->firstFree;
+            if (position + 1 == index->end)
+            {
+                index->end = position;
+            }
+        }
+        else
+        {
+            index->firstFree = 0;
+        }
+    }
+
+    // the entry leaves the lookup caches of the working directory, a deleted folder loses its own
+    forgetEntry(session, (const char *)directoryEntry->filename);
+    if (isDirectory(directoryEntry))
+    {
+        forgetDirectory(volume, logicalClusterIndex);
+    }
+
+    while (fat_is_data_cluster(logicalClusterIndex))
+    {
+        oldLogicalClusterIndex = logicalClusterIndex;
+
+        // read next sector in the chain of sectors from the fat
+        logicalClusterIndex = fat_table_get(&volume->fatTable, logicalClusterIndex);
+
+        fat_table_set(&volume->fatTable, oldLogicalClusterIndex, FAT_FREE_CLUSTER);
+    }
+
+    // erase directory entry
+    memset(directoryEntry, 0, sizeof(directory_entry));
+
+    // set entry to unused
+    directoryEntry->filename[0] = DIRECTORY_ENTRY_FREE;
+    put_sector(device, (char *)directoryEntry);
+    unpin_sector(device, (char *)directoryEntry);
+
+    // collapse the folder, the root directory of FAT12 and FAT16 has a fixed size and cannot be collapsed
+    if (session->workingDirectory != NULL)
+    {
+        collapseTheFolder(volume, session->workingDirectory);
+    }
+}
+
+/**
+ * Renames a file or folder of the working directory. The entry keeps its place, its clusters and its attributes,
+ * only the lookup caches of the old and the new name change.
+ *
+ * returns 0 on success, -1 if the entry does not exist or cannot be renamed, -2 if the new name is taken
+ */
+int renameEntry(fat_session *session, const char *oldName, const char *newName)
+{
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
 
-        // move pointer after the data currently stored in the cluster
-        ptr += bytesUsed;
+    // the links of a folder keep their names
+    if (strlen(newName) == 0 || isLink(oldName) || isLink(newName))
+    {
+        printf("Cannot rename %s to %s!\n", oldName, newName);
+        return -1;
+    }
 
-        // append bytesToWriteIntoCluster to last cluster
-        memcpy(ptr, dataPtr, bytesToWriteIntoCluster);
-        bytesWritten += bytesToWriteIntoCluster;
+    char convertedName[FILENAME_LENGTH];
+    memset(convertedName, 0, FILENAME_LENGTH);
+    filenameToFatElevenThree(newName, convertedName, FILENAME_LENGTH);
 
-        // move data ptr because we just consumed bytes
-        dataPtr += bytesToWriteIntoCluster;
+    if (findFile(session, newName) != NULL)
+    {
+        printf("Cannot rename %s! A file or folder named %.11s exists!\n", oldName, convertedName);
+        return -2;
+    }
 
-        // update the loop condition
-        bytesToWrite -= bytesToWriteIntoCluster;
+    directory_entry *directoryEntry = findFile(session, oldName);
+    if (directoryEntry == NULL || directoryEntry->attributes == VOLUMELABEL_FLAG || directoryEntry->attributes == READONLY_FLAG)
+    {
+        printf("Cannot rename %s! It does not exist or is read only!\n", oldName);
+        return -1;
+    }
 
-        bytesUsed += bytesToWriteIntoCluster;
-        bytesLeft -= bytesToWriteIntoCluster;
+    // the lookup of the old name has just put the slot of the entry into the dentry cache
+    char oldConvertedName[FILENAME_LENGTH];
+    memcpy(oldConvertedName, directoryEntry->filename, FILENAME_LENGTH);
+    uint64_t slot;
+    bool slotKnown = dentry_cache_lookup(&volume->dentries, directoryIndexCluster(volume, session->workingDirectory), oldConvertedName, &slot) && slot != DENTRY_NEGATIVE;
 
-        // if the cluster is used completely, add a new cluster
-        if (bytesToWrite > 0 && bytesLeft == 0)
-        {
-            logicalIndex = appendClusterSectorToChain(buffer, bpb, directoryEntry);
-            bytesUsed = 0;
-            bytesLeft = bpb->bytesPerSec - bytesUsed;
-        }
-    }
+    memcpy(directoryEntry->filename, convertedName, FILENAME_LENGTH);
+    put_sector(device, (char *)directoryEntry);
 
-    // Update filesize in the directory entry
-    directoryEntry->filesize += dataLen;
+    forgetEntry(session, oldConvertedName);
+    if (slotKnown)
+    {
+        indexNewEntry(session, convertedName, slot);
+    }
+    else
+    {
+        // without the slot, the new name has to be found by the next scan
+        dir_index_drop(&volume->dirIndexes, directoryIndexCluster(volume, session->workingDirectory));
+        dentry_cache_remove(&volume->dentries, directoryIndexCluster(volume, session->workingDirectory), convertedName);
+    }
 
-    return bytesWritten;
+    return 0;
 }
 
-void collapseTheFolder(const char *buffer, const bios_parameter_block *bpb, directory_entry *directoryEntry)
+/**
+ * Executes the commands given on the command line one after another in the session, e.g.
+ * 
+ *   mkdir folder1 cd folder1 touch file.txt append file.txt hello ls
+ * 
+ * open, write, pread and close work on one file through a handle, e.g. open log.txt write a write b pread 1 1 close
+ * cd, cat and export take paths, e.g. cd /folder1/sub cat ../file.txt, rename old.txt new.txt renames within the working directory
+ * 
+ * returns 0 on success or -1 if a command is unknown or is missing its arguments or an import fails
+ */
+int runCommands(fat_session *session, int argc, char **argv)
 {
-    int lastUsedLogicalSector = 0;
-    int16_t dataAreaOffsetInBytes = dataAreaOffsetInSectors(bpb) * bpb->bytesPerSec;
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
+    fat_volume *volume = session->volume;
+    block_device *device = volume->device;
 
-    int logicalClusterIndex = directoryEntry->first_logical_cluster;
+    // the file of the open and write commands
+    file_handle openHandle;
+    memset(&openHandle, 0, sizeof(file_handle));
 
-    while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
+    int result = 0;
+    for (int i = 0; i < argc && result == 0; i++)
     {
-        // pointer to physical sector
-        char *bufferPtr = buffer;
-        bufferPtr += (dataAreaOffsetInBytes + logicalClusterIndex * bpb->bytesPerSec);
+        const char *command = argv[i];
 
-        // cast to directory entry
-        directory_entry *directoryEntryPtr = (directory_entry *)bufferPtr;
+        // amount of arguments left after the command
+        int argsLeft = argc - i - 1;
 
-        // output all entries
-        bool returnLinks = true;
-        int entriesUsed = iterateEntries(directoryEntryPtr, DIR_ENTRIES_PER_SECTOR, returnLinks);
-        if (entriesUsed > 0)
+        // the commands of other sessions of the volume run in between, not during a command
+        pthread_mutex_lock(&volume->lock);
+
+        if (strcmp(command, "ls") == 0)
         {
-            lastUsedLogicalSector = logicalClusterIndex;
+            ls(session);
         }
-
-        // read next sector in the chain of sectors from the fat
-        logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
-    }
-
-    // update the FAT and remove unused sectors
-    logicalClusterIndex = directoryEntry->first_logical_cluster;
-    int oldClusterIndex = logicalClusterIndex;
-    bool lastSectorFound = false;
-    while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-    {
-        // read next sector in the chain of sectors from the fat
-        oldClusterIndex = logicalClusterIndex;
-        logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
-
-        if (oldClusterIndex == lastUsedLogicalSector)
+        else if (strcmp(command, "fat") == 0)
+        {
+            outputFat(volume);
+        }
+        else if (strcmp(command, "df") == 0)
+        {
+            df(volume);
+        }
+        else if (strcmp(command, "sync") == 0)
+        {
+            flush_block_device(device);
+        }
+        else if (strcmp(command, "stats") == 0)
+        {
+            printf("sectors read: %" PRIu64 " written: %" PRIu64 " read calls: %" PRIu64 " write calls: %" PRIu64 " async requests: %" PRIu64 " cache hits: %" PRIu64 " misses: %" PRIu64 "\n",
+                   device->sectorsRead, device->sectorsWritten, device->readCalls, device->writeCalls, device->asyncRequests, device->cacheHits, device->cacheMisses);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "cd") == 0)
+        {
+            cd(session, argv[++i]);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "cat") == 0)
+        {
+            outputFileByName(session, argv[++i]);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "mkdir") == 0)
+        {
+            mkdir(session, argv[++i]);
+            end_operation(device);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "rmdir") == 0)
+        {
+            rmdir(session, argv[++i]);
+            end_operation(device);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "touch") == 0)
+        {
+            touch(session, argv[++i], NULL);
+            end_operation(device);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "rm") == 0)
+        {
+            rm(session, argv[++i]);
+            end_operation(device);
+        }
+        else if (argsLeft >= 2 && strcmp(command, "rename") == 0)
+        {
+            const char *oldName = argv[++i];
+            const char *newName = argv[++i];
+            renameEntry(session, oldName, newName);
+            end_operation(device);
+        }
+        else if (argsLeft >= 2 && strcmp(command, "append") == 0)
+        {
+            const char *filename = argv[++i];
+            const char *data = argv[++i];
+            appendToFile(session, filename, data, strlen(data));
+            end_operation(device);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "open") == 0)
+        {
+            closeFile(volume, &openHandle);
+            openFile(session, argv[++i], true, &openHandle);
+            end_operation(device);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "write") == 0)
         {
-            for (int i = 0; i < bpb->numFats; i++)
+            const char *data = argv[++i];
+            if (openHandle.entry == NULL)
             {
-                writeFAT12Entry(buffer, fatOffset(bpb, i), oldClusterIndex, FAT12_LAST_CLUSTER_IN_CHAIN);
+                printf("Cannot write, no file is open!\n");
+            }
+            else
+            {
+                writeFile(volume, &openHandle, data, strlen(data));
+                end_operation(device);
             }
-            lastSectorFound = true;
-            continue;
         }
-
-        if (lastSectorFound)
+        else if (argsLeft >= 2 && strcmp(command, "pread") == 0)
+        {
+            uint32_t offset = strtoul(argv[++i], NULL, 10);
+            int len = atoi(argv[++i]);
+            char *data = len > 0 ? (char *)malloc(len) : NULL;
+            if (openHandle.entry == NULL)
+            {
+                printf("Cannot read, no file is open!\n");
+            }
+            else if (data != NULL)
+            {
+                int bytesRead = preadFile(volume, &openHandle, data, offset, len);
+                if (bytesRead > 0)
+                {
+                    fwrite(data, 1, bytesRead, stdout);
+                }
+                printf("\n");
+            }
+            free(data);
+        }
+        else if (argsLeft >= 2 && strcmp(command, "export") == 0)
+        {
+            const char *filename = argv[++i];
+            const char *hostPath = argv[++i];
+            FILE *hostFile = fopen(hostPath, "wb");
+            if (hostFile == NULL)
+            {
+                printf("Cannot create %s!\n", hostPath);
+            }
+            else
+            {
+                exportFile(session, filename, fileno(hostFile));
+                fclose(hostFile);
+            }
+        }
+        else if (argsLeft >= 1 && strcmp(command, "import") == 0)
         {
-            for (int i = 0; i < bpb->numFats; i++)
+            const char *hostPath = argv[++i];
+            int imported = importTree(session, hostPath);
+            if (imported >= 0)
+            {
+                printf("Imported %d files and folders from %s\n", imported, hostPath);
+            }
+            else
             {
-                writeFAT12Entry(buffer, fatOffset(bpb, i), oldClusterIndex, FAT12_FREE_CLUSTER);
+                result = -1;
             }
+            end_operation(device);
+        }
+        else if (argsLeft >= 1 && strcmp(command, "extract-all") == 0)
+        {
+            extractAll(volume, argv[++i]);
+        }
+        else if (strcmp(command, "close") == 0)
+        {
+            closeFile(volume, &openHandle);
+            end_operation(device);
+        }
+        else
+        {
+            printf("Unknown command or missing arguments: '%s'!\n", command);
+            result = -1;
         }
+
+        pthread_mutex_unlock(&volume->lock);
     }
+
+    // a file left open by the commands still gets its buffered data
+    pthread_mutex_lock(&volume->lock);
+    closeFile(volume, &openHandle);
+    pthread_mutex_unlock(&volume->lock);
+
+    return result;
 }
 
 /**
- * Deletes a file
- * 
- * 0. Check if the file exists and is not read only in its directory entries attributes.
- * 
- * Set the directory entry to free (0xE5 as first byte in the filename)
- * if there are no used directory entries after this one, set the first byte in the filename to 0x00
- * 
- * If the cluster is contained in the data area not in the root directory
- * and the entire cluster consist only of empty directory entries, remove this cluster from the
- * folders cluster chain, if it is the last cluster in the cluster chain!
- * 
- * Delete the entire cluster chain of the file.
+ * Mounts the volume on the device, bpb is the boot sector of the image. The FAT is read, the caches start empty.
+ * The device stays open until the volume is unmounted.
+ *
+ * returns 0 on success, -1 if the FAT cannot be read
  */
-void rm(const char *buffer, const bios_parameter_block *bpb, const char *filename)
+int mountVolume(fat_volume *volume, block_device *device, const bios_parameter_block *bpb)
 {
-    directory_entry *directoryEntry = findFile(buffer, bpb, filename);
-    if (directoryEntry == NULL)
-    {
-        return;
-    }
+    memset(volume, 0, sizeof(fat_volume));
+    volume->device = device;
+    volume->bpb = *bpb;
 
-    // check readonly and volume label
-    if (directoryEntry->attributes == VOLUMELABEL_FLAG || directoryEntry->attributes == READONLY_FLAG)
+    if (load_fat_table(&volume->fatTable, device, &volume->bpb) != 0)
     {
-        return;
+        free_fat_table(&volume->fatTable);
+        return -1;
     }
 
-    uint16_t firstFatOffset = fatOffset(bpb, 0);
-    int logicalClusterIndex = directoryEntry->first_logical_cluster;
-    int oldLogicalClusterIndex = logicalClusterIndex;
+    // the root directory of a FAT32 volume is a cluster chain like any other folder
+    volume->rootDirectoryEntry.attributes = DIRECTORY_FLAG;
+    setFirstCluster(volume, &volume->rootDirectoryEntry, volume->fatTable.entryBits == 32 ? bpb->rootClus : 0);
 
-    while (logicalClusterIndex > 1 && logicalClusterIndex != FAT12_LAST_CLUSTER_IN_CHAIN && logicalClusterIndex != FAT12_DEFECTIVE_CLUSTER)
-    {
-        oldLogicalClusterIndex = logicalClusterIndex;
+    pthread_mutex_init(&volume->lock, NULL);
 
-        // read next sector in the chain of sectors from the fat
-        logicalClusterIndex = readFAT12Entry(buffer, firstFatOffset, logicalClusterIndex);
+    return 0;
+}
+
+/**
+ * Releases the caches of the volume and packs the modified FAT entries into the sectors of all FAT copies.
+ * Sessions of the volume must not be used afterwards.
+ */
+void unmountVolume(fat_volume *volume)
+{
+    dir_index_clear(&volume->dirIndexes);
+    free_fat_table(&volume->fatTable);
+    pthread_mutex_destroy(&volume->lock);
+}
+
+/**
+ * Starts a session on the volume in its root directory.
+ */
+void openSession(fat_session *session, fat_volume *volume)
+{
+    memset(session, 0, sizeof(fat_session));
+    session->volume = volume;
+    changeToRootDirectory(session);
+}
+
+/**
+ * usage: a.out [--scratch] [--cached] [--cache-sectors N] [--journal] [--group-commit N] [--uring] [--queue-depth N] [image] [command [arguments]]...
+ * 
+ * The image is mapped into memory read-write, all modifications are written back to the image file.
+ * With --scratch, the image is mapped copy-on-write and the image file is never modified. --scratch cannot be
+ * combined with --cached or --journal, which write to the image file.
+ * With --cached (or --cache-sectors), the image is not mapped but read sector by sector into a cache of
+ * N sectors (BLOCK_DEVICE_DEFAULT_CACHE_SECTORS by default), modifications are written through to the image file.
+ * With --journal (or --group-commit), metadata is written ahead into <image>.journal, N operations
+ * (JOURNAL_DEFAULT_GROUP_COMMIT by default) share one journal commit. A journal left behind by a crash is replayed.
+ * With --uring (or --queue-depth), reads and writes are submitted through io_uring with up to N requests
+ * (URING_DEFAULT_QUEUE_DEPTH by default) in flight. Without io_uring support, I/O stays synchronous.
+ * Without commands, the root directory is listed.
+ */
+int main(int argc, char **argv)
+{
+    printf("Starting the application\n");
 
-        for (int i = 0; i < bpb->numFats; i++)
+    const char *filename = "resources/jamesmol.img";
+    //const char *filename = "resources/msdos_disk1.img";
+    int mode = BLOCK_DEVICE_WRITABLE;
+    uint32_t cacheSectors = BLOCK_DEVICE_DEFAULT_CACHE_SECTORS;
+    bool journaled = false;
+    uint32_t groupCommit = JOURNAL_DEFAULT_GROUP_COMMIT;
+    bool asynchronous = false;
+    uint32_t queueDepth = URING_DEFAULT_QUEUE_DEPTH;
+
+    int argIndex = 1;
+    while (argIndex < argc && strncmp(argv[argIndex], "--", 2) == 0)
+    {
+        if (strcmp(argv[argIndex], "--scratch") == 0)
+        {
+            mode &= ~BLOCK_DEVICE_WRITABLE;
+        }
+        else if (strcmp(argv[argIndex], "--cached") == 0)
+        {
+            mode |= BLOCK_DEVICE_CACHED;
+        }
+        else if (strcmp(argv[argIndex], "--cache-sectors") == 0 && argIndex + 1 < argc)
+        {
+            mode |= BLOCK_DEVICE_CACHED;
+            cacheSectors = atoi(argv[++argIndex]);
+        }
+        else if (strcmp(argv[argIndex], "--journal") == 0)
+        {
+            journaled = true;
+        }
+        else if (strcmp(argv[argIndex], "--group-commit") == 0 && argIndex + 1 < argc)
         {
-            writeFAT12Entry(buffer, fatOffset(bpb, i), oldLogicalClusterIndex, FAT12_FREE_CLUSTER);
+            journaled = true;
+            groupCommit = atoi(argv[++argIndex]);
         }
+        else if (strcmp(argv[argIndex], "--uring") == 0)
+        {
+            asynchronous = true;
+        }
+        else if (strcmp(argv[argIndex], "--queue-depth") == 0 && argIndex + 1 < argc)
+        {
+            asynchronous = true;
+            queueDepth = atoi(argv[++argIndex]);
+        }
+        else
+        {
+            printf("Unknown option '%s'!\n", argv[argIndex]);
+            return -1;
+        }
+        argIndex++;
+    }
+    if (argIndex < argc)
+    {
+        filename = argv[argIndex++];
     }
 
-    // erase directory entry
-    memset(directoryEntry, 0, sizeof(directory_entry));
-
-    // set entry to unused
-    directoryEntry->filename[0] = DIRECTORY_ENTRY_FREE;
+    // the cached backend writes evicted sectors back into the image file
+    if ((mode & BLOCK_DEVICE_CACHED) != 0 && (mode & BLOCK_DEVICE_WRITABLE) == 0)
+    {
+        printf("A scratch image cannot be cached!\n");
+        return -1;
+    }
 
-    // collapse the folder
-    collapseTheFolder(buffer, bpb, workingDirectory);
-}
+    if (journaled)
+    {
+        if ((mode & BLOCK_DEVICE_WRITABLE) == 0)
+        {
+            printf("A scratch image cannot be journaled!\n");
+            return -1;
+        }
 
-int main()
-{
-    printf("Starting the application\n");
+        // the kernel must not write mapped pages before the journal has committed them
+        mode |= BLOCK_DEVICE_WRITE_BACK;
+    }
 
-    char in[8] = "testtes\0";
-    char out[8];
-    int maxLength = 8;
-    char *buffer = NULL;
+    if (asynchronous)
+    {
+        // requests are only submitted for images that are written through a file descriptor
+        mode |= BLOCK_DEVICE_WRITE_BACK;
+    }
 
-    if (load_file_to_memory("resources/jamesmol.img", &buffer) < 0)
-    //if (load_file_to_memory("resources/msdos_disk1.img", &buffer) < 0)
+    block_device device;
+    if (open_block_device(&device, filename, mode, cacheSectors) < 0)
     {
         printf("Loading the file failed!\n");
 
@@ -1301,81 +3650,108 @@ int main()
 
     printf("File loaded!\n");
 
-    bios_parameter_block *bpb = (bios_parameter_block *)buffer;
+    if (asynchronous && enable_uring(&device, queueDepth) != 0)
+    {
+        printf("io_uring is not available, using synchronous I/O!\n");
+    }
 
-    //outputFat(buffer, bpb);
+    // keep a copy of the boot sector, the sector itself might be evicted from the sector cache
+    bios_parameter_block bootSector;
+    read_bytes(&device, 0, &bootSector, sizeof(bios_parameter_block));
+    bios_parameter_block *bpb = &bootSector;
 
-    if (bpb->bytesPerSec <= 0 || bpb->rsvdSecCnt <= 0 || bpb->numFats <= 0) 
+    //outputFat(device, bpb);
+
+    if (bpb->bytesPerSec <= 0 || bpb->secPerClus == 0 || bpb->rsvdSecCnt <= 0 || bpb->numFats <= 0 || set_sector_size(&device, bpb->bytesPerSec) != 0)
     {
         printf("Not a FAT12 image!\n");
 
-        free(buffer);
-        buffer = NULL;
+        close_block_device(&device);
 
         return 0;
     }
+    journal jnl;
+    jnl.fd = -1;
+    if (journaled)
+    {
+        int replayed = open_journal(&jnl, &device, filename, groupCommit);
+        if (replayed < 0)
+        {
+            printf("Opening the journal failed!\n");
+
+            close_block_device(&device);
+
+            return -1;
+        }
+        if (replayed > 0)
+        {
+            printf("Replayed %d journal transactions\n", replayed);
+        }
+    }
 
     // compute the sector where the first FAT starts
-    int fatStartSector = bpb->rsvdSecCnt;
+    uint64_t fatStartSector = bpb->rsvdSecCnt;
 
     // compute the amount of sectors that the redundant FAT information occupies
     // number of redundant copies of the FAT table times the amount of sectors one FAT occupies
-    int fatSectors = bpb->secPerFat * bpb->numFats;
+    uint64_t fatSectors = (uint64_t)sectorsPerFat(bpb) * bpb->numFats;
 
     // compute the sector on which the root dir starts
-    int rootDirStartSector = fatStartSector + fatSectors;
+    uint64_t rootDirStartSector = fatStartSector + fatSectors;
 
     // compute the amount of sectors the root dir occupies
-    int rootDirSectors = (32 * bpb->rootEntCnt + bpb->bytesPerSec - 1) / bpb->bytesPerSec;
+    uint64_t rootDirSectors = (32 * bpb->rootEntCnt + bpb->bytesPerSec - 1) / bpb->bytesPerSec;
 
     // compute the start sector of the data area
-    int dataStartSector = rootDirStartSector + rootDirSectors;
+    uint64_t dataStartSector = rootDirStartSector + rootDirSectors;
 
     // CountofClusters from http://elm-chan.org/docs/fat_e.html
     // When the value of bpb->totSec32 on the FAT12/16 volume is less than 0x10000,
     // this field must be invalid value 0 and the true value is set to BPB_TotSec16.
     // On the FAT32 volume, this field is always valid and old field is not used.
-    int dataSectors = -1;
-    if (bpb->totSec32 < 0x10000)
-    {
-        dataSectors = bpb->totSec16 - dataStartSector;
-    }
-    else
-    {
-        dataSectors = bpb->totSec32 - dataStartSector;
-    }
+    uint64_t volumeSectors = totalSectors(bpb);
+    uint64_t dataSectors = volumeSectors > dataStartSector ? volumeSectors - dataStartSector : 0;
 
-    int countOfClusters = dataSectors / bpb->secPerClus;
+    uint64_t countOfClusters = dataSectors / bpb->secPerClus;
+
+    int result = 0;
 
     // FAT sub-type (FAT12, FAT16, FAT32) from http://elm-chan.org/docs/fat_e.html
-    if (countOfClusters <= 4085)
-    {
-        printf("FAT12\n");
-        printf("\n");
+    // the fat table picks the encoding of the entries on its own
+    printf(countOfClusters <= 4085 ? "FAT12\n" : countOfClusters <= 65525 ? "FAT16\n" : "FAT32\n");
+    printf("\n");
 
-        ls(buffer, bpb);
-    }
-    else if (countOfClusters <= 65525)
+    fat_volume volume;
+    if (mountVolume(&volume, &device, bpb) != 0)
     {
-        printf("FAT16\n");
-        printf("Not implemented yet!\n");
+        printf("Reading the FAT failed!\n");
+        result = -1;
     }
     else
     {
-        printf("FAT32\n");
-        printf("Not implemented yet!\n");
-    }
+        fat_session session;
+        openSession(&session, &volume);
 
-    // clean up
-    if (buffer != NULL)
-    {
-        free(buffer);
-        buffer = NULL;
+        if (argIndex < argc)
+        {
+            result = runCommands(&session, argc - argIndex, argv + argIndex);
+        }
+        else
+        {
+            ls(&session);
+        }
+
+        // packs the modified FAT entries into the sectors of all FAT copies
+        unmountVolume(&volume);
     }
 
+    // clean up, this also writes all outstanding modifications back into the image file
+    close_journal(&jnl);
+    close_block_device(&device);
+
     printf("Terminating the application\n");
 
-    return 0;
+    return result;
 }
 
 /*
@@ -1440,6 +3816,25 @@ int main()
     //bpb->hiddSec = __bswap_32(bpb->hiddSec);
     //bpb->totSec32 = __bswap_32(bpb->totSec32);
 
+    journal jnl;
+    jnl.fd = -1;
+    if (journaled)
+    {
+        int replayed = open_journal(&jnl, &device, filename, groupCommit);
+        if (replayed < 0)
+        {
+            printf("Opening the journal failed!\n");
+
+            close_block_device(&device);
+
+            return -1;
+        }
+        if (replayed > 0)
+        {
+            printf("Replayed %d journal transactions\n", replayed);
+        }
+    }
+
     // compute the sector where the first FAT starts
     int fatStartSector = bpb->rsvdSecCnt;
 
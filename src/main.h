@@ -2,8 +2,99 @@
 #define MAIN_H
 
 #include <stdio.h>
+#include <pthread.h>
 
 #include "filetools.h"
+#include "blockdevice.h"
+#include "journal.h"
+#include "fattable.h"
+#include "dirindex.h"
+#include "dirscan.h"
 #include "fat.h"
 
+// sectors of a chain that outputFile() reads ahead with one batch of requests
+#define READ_AHEAD_SECTORS 128
+
+// vectors cat passes to a single writev()
+#define CAT_VECTORS 64
+
+// files the kernel reads ahead while importTree() copies the current one
+#define IMPORT_READ_AHEAD_FILES 16
+
+// upper bound of the threads extractAll() writes host files with
+#define EXTRACT_MAX_WORKERS 16
+
+// A mounted image: the sectors, the geometry of the boot sector and the caches of the metadata. The volume
+// holds no state of the commands, any number of sessions can work on it, see mountVolume().
+typedef struct
+{
+    block_device *device;
+    bios_parameter_block bpb; // copy of the boot sector, the sector itself might be evicted from the sector cache
+
+    // decoded FAT, all chain walks and allocations go through it
+    fat_table fatTable;
+
+    // the root directory of a FAT32 volume, which is not described by an entry on the volume
+    directory_entry rootDirectoryEntry;
+
+    // name indexes of recently searched directories and the lookups of resolvePath(), see dirindex.h
+    dir_index_cache dirIndexes;
+    dentry_cache dentries;
+
+    // the sector cache and the caches above are not thread safe, runCommands() holds the lock for each command
+    pthread_mutex_t lock;
+} fat_volume;
+
+// A user of a volume with a working directory of its own, see openSession()
+typedef struct
+{
+    fat_volume *volume;
+    directory_entry *workingDirectory; // NULL for the fixed root directory of FAT12 and FAT16
+    directory_entry workingDirectoryEntry;
+} fat_session;
+
+// an open file, see openFile()
+typedef struct
+{
+    directory_entry *entry; // pinned while the file is open
+    int32_t lastCluster;    // last cluster of the chain
+    int32_t clusterOffset;  // bytes of the last cluster that are used
+    char *buffer;           // small writes collected until they complete the last cluster
+    int32_t buffered;
+    fat_extent_map extents; // runs of the chain for preadFile(), built on the first read
+} file_handle;
+
+// where importTree() places an entry of the host tree
+typedef struct
+{
+    char name[FILENAME_LENGTH];
+    bool skipped;
+    uint32_t parent;       // index of the host directory containing the entry
+    uint32_t clusters;     // clusters of the file contents or directory entries
+    int32_t firstCluster;
+    int32_t cursorCluster; // directories: cluster and index of the next entry to write
+    uint32_t cursorIndex;
+} import_entry;
+
+// a file of the image found by the metadata pass of extractAll()
+typedef struct
+{
+    char *path; // destination on the host
+    uint32_t size;
+    fat_extent_map extents;
+} extract_file;
+
+// the work shared by the threads of extractAll(), the files are handed out in order of next
+typedef struct
+{
+    const block_device *device;
+    const bios_parameter_block *bpb;
+    extract_file *files;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t next;
+    uint32_t failed;
+    uint64_t *visited; // one bit per cluster, directories already walked
+} extract_job;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,238 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#define URING_SUPPORTED 1
+#include <linux/io_uring.h>
+#endif
+
+#ifdef URING_SUPPORTED
+
+// the rings are shared with the kernel, head and tail are published with acquire/release semantics
+static uint32_t loadAcquire(const uint32_t *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(uint32_t *ptr, uint32_t value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+static void unmapRings(uring *ring)
+{
+    if (ring->sqRing != NULL)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->cqRing != NULL)
+    {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    ring->sqRing = ring->cqRing = ring->sqes = NULL;
+}
+
+static void *mapRing(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+int uring_init(uring *ring, uint32_t queueDepth)
+{
+    memset(ring, 0, sizeof(uring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, queueDepth > 0 ? queueDepth : URING_DEFAULT_QUEUE_DEPTH, &params);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = mapRing(fd, ring->sqRingSize, IORING_OFF_SQ_RING);
+    ring->cqRing = mapRing(fd, ring->cqRingSize, IORING_OFF_CQ_RING);
+    ring->sqes = mapRing(fd, ring->sqesSize, IORING_OFF_SQES);
+    if (ring->sqRing == NULL || ring->cqRing == NULL || ring->sqes == NULL)
+    {
+        unmapRings(ring);
+        close(fd);
+        ring->fd = -1;
+        return -1;
+    }
+
+    char *sq = (char *)ring->sqRing;
+    ring->sqHead = (uint32_t *)(sq + params.sq_off.head);
+    ring->sqTail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sqMask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (uint32_t *)(sq + params.sq_off.array);
+
+    char *cq = (char *)ring->cqRing;
+    ring->cqHead = (uint32_t *)(cq + params.cq_off.head);
+    ring->cqTail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cqMask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    return 0;
+}
+
+void uring_exit(uring *ring)
+{
+    if (ring->fd < 0)
+    {
+        return;
+    }
+
+    // the kernel might still access the buffers of outstanding requests
+    uring_submit(ring);
+    uint64_t userData;
+    int32_t result;
+    while (ring->inflight > 0 && uring_complete(ring, true, &userData, &result))
+    {
+    }
+
+    unmapRings(ring);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+static int prepare(uring *ring, uint8_t opcode, int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t userData)
+{
+    // never queue more requests than the completion queue is guaranteed to hold
+    if (ring->fd < 0 || ring->queued + ring->inflight >= ring->entries)
+    {
+        return -1;
+    }
+
+    uint32_t tail = *ring->sqTail;
+    uint32_t index = tail & ring->sqMask;
+
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    sqe->user_data = userData;
+
+    ring->sqArray[index] = index;
+    storeRelease(ring->sqTail, tail + 1);
+    ring->queued++;
+
+    return 0;
+}
+
+int uring_prepare_readv(uring *ring, int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t userData)
+{
+    return prepare(ring, IORING_OP_READV, fd, iov, iovcnt, offset, userData);
+}
+
+int uring_prepare_writev(uring *ring, int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t userData)
+{
+    return prepare(ring, IORING_OP_WRITEV, fd, iov, iovcnt, offset, userData);
+}
+
+static int enter(uring *ring, uint32_t toSubmit, uint32_t minComplete, uint32_t flags)
+{
+    for (;;)
+    {
+        int result = (int)syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete, flags, NULL, 0);
+        if (result >= 0 || errno != EINTR)
+        {
+            return result;
+        }
+    }
+}
+
+int uring_submit(uring *ring)
+{
+    while (ring->queued > 0)
+    {
+        int submitted = enter(ring, ring->queued, 0, 0);
+        if (submitted <= 0)
+        {
+            return -1;
+        }
+        ring->queued -= submitted;
+        ring->inflight += submitted;
+    }
+
+    return 0;
+}
+
+bool uring_complete(uring *ring, bool wait, uint64_t *userData, int32_t *result)
+{
+    for (;;)
+    {
+        uint32_t head = *ring->cqHead;
+        if (head != loadAcquire(ring->cqTail))
+        {
+            const struct io_uring_cqe *cqe = &((const struct io_uring_cqe *)ring->cqes)[head & ring->cqMask];
+            *userData = cqe->user_data;
+            *result = cqe->res;
+            storeRelease(ring->cqHead, head + 1);
+            ring->inflight--;
+            return true;
+        }
+
+        if (!wait || ring->inflight == 0 || enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+        {
+            return false;
+        }
+    }
+}
+
+#else
+
+int uring_init(uring *ring, uint32_t queueDepth)
+{
+    memset(ring, 0, sizeof(uring));
+    ring->fd = -1;
+
+    return -1;
+}
+
+void uring_exit(uring *ring)
+{
+}
+
+int uring_prepare_readv(uring *ring, int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t userData)
+{
+    return -1;
+}
+
+int uring_prepare_writev(uring *ring, int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t userData)
+{
+    return -1;
+}
+
+int uring_submit(uring *ring)
+{
+    return -1;
+}
+
+bool uring_complete(uring *ring, bool wait, uint64_t *userData, int32_t *result)
+{
+    return false;
+}
+
+#endif
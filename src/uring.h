@@ -0,0 +1,79 @@
+#ifndef URING_H
+#define URING_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_DEFAULT_QUEUE_DEPTH 32
+
+// Minimal io_uring wrapper on top of the raw system calls (liburing is not required).
+//
+// Requests are prepared with uring_prepare_readv()/uring_prepare_writev(), handed to the kernel in one
+// io_uring_enter() call by uring_submit() and collected with uring_complete(). The iovecs of a request
+// have to stay valid until its completion was collected.
+//
+// If the kernel (or the seccomp profile) does not provide io_uring, uring_init() fails and callers fall
+// back to synchronous preadv()/pwritev().
+typedef struct
+{
+    int fd;
+    uint32_t entries;
+    uint32_t queued;   // prepared, not yet submitted
+    uint32_t inflight; // submitted, completion not yet collected
+
+    // submission queue
+    void *sqRing;
+    size_t sqRingSize;
+    uint32_t *sqHead;
+    uint32_t *sqTail;
+    uint32_t sqMask;
+    uint32_t *sqArray;
+    void *sqes;
+    size_t sqesSize;
+
+    // completion queue
+    void *cqRing;
+    size_t cqRingSize;
+    uint32_t *cqHead;
+    uint32_t *cqTail;
+    uint32_t cqMask;
+    void *cqes;
+} uring;
+
+/**
+ * Sets up a ring with room for queueDepth requests.
+ *
+ * return - 0 on success, -1 if io_uring is not available
+ */
+int uring_init(uring *ring, uint32_t queueDepth);
+
+/**
+ * Releases the ring. Outstanding requests are waited for.
+ */
+void uring_exit(uring *ring);
+
+/**
+ * Queues a vectored read or write of the file fd at offset. userData is returned by uring_complete().
+ *
+ * return - 0 on success, -1 if the ring is full (submit and collect completions first)
+ */
+int uring_prepare_readv(uring *ring, int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t userData);
+int uring_prepare_writev(uring *ring, int fd, const struct iovec *iov, int iovcnt, off_t offset, uint64_t userData);
+
+/**
+ * Submits all queued requests with a single system call.
+ *
+ * return - 0 on success, -1 on error
+ */
+int uring_submit(uring *ring);
+
+/**
+ * Collects one completion. If wait is set and no completion is available, blocks until a request completes.
+ *
+ * return - true if a completion was collected, userData and result (bytes transferred or -errno) are set
+ */
+bool uring_complete(uring *ring, bool wait, uint64_t *userData, int32_t *result);
+
+#endif